@@ -0,0 +1,752 @@
+/* Benchmark of the C extension with synthetic merger trees and SED templates
+ *
+ * It does not need Meraxes outputs or SED files. Each stage is timed
+ * separately for every outType and number of threads, and the results are
+ * written as JSON, which can be compared across commits by compare.py.
+ *
+ * Usage: make bench benchOption="--threads 1,4 --out bench.json"
+ * Run ./bench/bench --help for all options.
+ */
+#include "../mag_calc_cext.c"
+
+// Declare inline functions that are called directly, such that the
+// external definitions are emitted
+double trapz_table(double *y, double *x, int nPts, double a, double b);
+void templates_working(struct sed_params *rawSpectra, struct tmp_params *tmpSpectra,
+                       double *LyAbsorption, double z,
+                       struct sparse_filters *filters, int nFlux, int nObs,
+                       short nThread);
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                             *
+ * Synthetic inputs                                                            *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+double bench_random(unsigned long long *state) {
+    // xorshift64*, which gives the same sequence on every platform
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (double)((*state*2685821657736338717ULL) >> 11)/9007199254740992.;
+}
+
+
+// Progenitor forest in the same layout as Meraxes outputs
+// Galaxy i at snapshot snap is a progenitor of a galaxy at snap + 1
+struct forest {
+    int nSnap;
+    int *nGal;
+    int **firstProgenitor;
+    int **nextProgenitor;
+    float **metals;
+    float **sfr;
+    double *ageList;
+};
+
+
+struct forest *generate_forest(int nGal, int nSnap, double branch,
+                               unsigned long long *state) {
+    /* The number of galaxies at the last snapshot is nGal, and the number
+     * at each earlier snapshot is branch times that of the next one, so
+     * branch is the mean number of progenitors per galaxy. Descendants are
+     * chosen at random, which gives a Poisson distribution of progenitors.
+     */
+    int iS, iG, desc;
+    struct forest *trees = malloc(sizeof(struct forest));
+
+    trees->nSnap = nSnap;
+    trees->nGal = malloc(nSnap*sizeof(int));
+    trees->firstProgenitor = malloc(nSnap*sizeof(int*));
+    trees->nextProgenitor = malloc(nSnap*sizeof(int*));
+    trees->metals = malloc(nSnap*sizeof(float*));
+    trees->sfr = malloc(nSnap*sizeof(float*));
+    trees->ageList = malloc(nSnap*sizeof(double));
+    for(iS = nSnap - 1; iS >= 0; --iS) {
+        trees->nGal[iS] = (int)(nGal*pow(branch, nSnap - 1 - iS) + .5);
+        if (trees->nGal[iS] < 1)
+            trees->nGal[iS] = 1;
+    }
+    for(iS = 0; iS < nSnap; ++iS) {
+        nGal = trees->nGal[iS];
+        trees->firstProgenitor[iS] = malloc(nGal*sizeof(int));
+        trees->nextProgenitor[iS] = malloc(nGal*sizeof(int));
+        trees->metals[iS] = malloc(nGal*sizeof(float));
+        trees->sfr[iS] = malloc(nGal*sizeof(float));
+        for(iG = 0; iG < nGal; ++iG) {
+            trees->firstProgenitor[iS][iG] = -1;
+            trees->nextProgenitor[iS][iG] = -1;
+            trees->metals[iS][iG] = (float)(.04*bench_random(state));
+            // Some galaxies do not form stars
+            if (bench_random(state) < .1)
+                trees->sfr[iS][iG] = 0.;
+            else
+                trees->sfr[iS][iG] = (float)(-10.*log(1. - bench_random(state)));
+        }
+        // Look back time of snapshots from the last one with a spacing
+        // that increases towards low redshift
+        trees->ageList[iS] = 1e7*(iS + 1)*(1. + .02*iS);
+    }
+    for(iS = 0; iS < nSnap - 1; ++iS)
+        for(iG = trees->nGal[iS] - 1; iG >= 0; --iG) {
+            desc = (int)(bench_random(state)*trees->nGal[iS + 1]);
+            trees->nextProgenitor[iS][iG] = trees->firstProgenitor[iS + 1][desc];
+            trees->firstProgenitor[iS + 1][desc] = iG;
+        }
+    return trees;
+}
+
+
+void free_forest(struct forest *trees) {
+    int iS;
+    for(iS = 0; iS < trees->nSnap; ++iS) {
+        free(trees->firstProgenitor[iS]);
+        free(trees->nextProgenitor[iS]);
+        free(trees->metals[iS]);
+        free(trees->sfr[iS]);
+    }
+    free(trees->nGal);
+    free(trees->firstProgenitor);
+    free(trees->nextProgenitor);
+    free(trees->metals);
+    free(trees->sfr);
+    free(trees->ageList);
+    free(trees);
+}
+
+
+struct sed_params *generate_sed(int nZ, int nAge, int nWaves, double maxAge,
+                                double minWaves, double maxWaves) {
+    /* Smooth SED templates in the same layout as read_sed_templates
+     * Metallicities and ages are logarithmically spaced from 1e-4 to 0.04
+     * and from 1e5 yr to maxAge respectively
+     */
+    int iZ, iA, iW;
+    double lw;
+    struct sed_params *sed = malloc(sizeof(struct sed_params));
+
+    sed->nZ = nZ;
+    sed->nAge = nAge;
+    sed->nWaves = nWaves;
+    sed->Z = malloc(nZ*sizeof(double));
+    sed->age = malloc(nAge*sizeof(double));
+    sed->waves = malloc(nWaves*sizeof(double));
+    sed->data = malloc((size_t)nZ*nWaves*nAge*sizeof(double));
+    sed->strideZ = (long long)nWaves*nAge;
+    sed->strideWaves = nAge;
+    for(iZ = 0; iZ < nZ; ++iZ)
+        sed->Z[iZ] = 1e-4*pow(400., nZ > 1 ? (double)iZ/(nZ - 1) : 0.);
+    sed->minZ = (short)(sed->Z[0]*1000 - .5);
+    sed->maxZ = (short)(sed->Z[nZ - 1]*1000 - .5);
+    for(iA = 0; iA < nAge; ++iA)
+        sed->age[iA] = 1e5*pow(maxAge/1e5, (double)iA/(nAge - 1));
+    for(iW = 0; iW < nWaves; ++iW)
+        sed->waves[iW] = minWaves*pow(maxWaves/minWaves, (double)iW/(nWaves - 1));
+    for(iZ = 0; iZ < nZ; ++iZ)
+        for(iW = 0; iW < nWaves; ++iW) {
+            lw = log(sed->waves[iW]/1500.);
+            for(iA = 0; iA < nAge; ++iA)
+                sed->data[(iZ*nWaves + iW)*nAge + iA] \
+                = 1e-8*(1. + 10.*sed->Z[iZ])*pow(sed->age[iA]/1e6, -1.2) \
+                  *exp(-lw*lw/(2. + log(sed->age[iA]/1e5)));
+        }
+    return sed;
+}
+
+
+void free_sed(struct sed_params *sed) {
+    free(sed->Z);
+    free(sed->age);
+    free(sed->waves);
+    free(sed->data);
+    free(sed);
+}
+
+
+void box_filter(double *filter, double *waves, int nWaves, double lower, double upper) {
+    /* Box filter normalised to unit area */
+    int iW;
+    double norm;
+    for(iW = 0; iW < nWaves; ++iW)
+        filter[iW] = waves[iW] >= lower && waves[iW] <= upper ? 1. : 0.;
+    norm = trapz_table(filter, waves, nWaves, waves[0], waves[nWaves - 1]);
+    if (norm > 0.)
+        for(iW = 0; iW < nWaves; ++iW)
+            filter[iW] /= norm;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                             *
+ * Timing                                                                      *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define MAX_RECORD 256
+
+struct bench_record {
+    char stage[32];
+    char outType[16];
+    int nThread;
+    double best;
+    double mean;
+    int nRepeat;
+};
+
+struct bench_record g_records[MAX_RECORD];
+int g_nRecord = 0;
+
+// Accuracy of the single precision path relative to the double precision
+// path. The error is the largest absolute difference in magnitudes for ph,
+// the largest relative difference in fluxes for sp, and the largest 
+// absolute difference in UV slopes for uv. Tolerances of all outTypes 
+// follow from MAG_TOLERANCE. The flux tolerance is the relative change of a
+// flux by MAG_TOLERANCE, and the slope tolerance is the change of a slope 
+// by errors of MAG_TOLERANCE with opposite signs at the two ends of the 
+// windows from 1268 to 2580 angstroms.
+#define MAG_TOLERANCE 1e-3
+#define UV_LOG_RANGE 0.3085 // log10(2580/1268)
+
+struct bench_accuracy {
+    char outType[16];
+    short dust;
+    double maxError;
+    double tolerance;
+};
+
+struct bench_accuracy g_accuracy[MAX_RECORD];
+int g_nAccuracy = 0;
+
+
+double wall_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+void add_record(char *stage, char *outType, int nThread, double elapsed) {
+    /* Add one repeat of a stage */
+    int iR;
+    struct bench_record *record;
+    for(iR = 0; iR < g_nRecord; ++iR) {
+        record = g_records + iR;
+        if (!strcmp(record->stage, stage) && !strcmp(record->outType, outType)
+            && record->nThread == nThread) {
+            if (elapsed < record->best)
+                record->best = elapsed;
+            record->mean = (record->mean*record->nRepeat + elapsed)/(record->nRepeat + 1);
+            ++record->nRepeat;
+            return;
+        }
+    }
+    if (g_nRecord == MAX_RECORD) {
+        printf("Error: too many benchmark records\n");
+        exit(0);
+    }
+    record = g_records + g_nRecord++;
+    strncpy(record->stage, stage, sizeof(record->stage) - 1);
+    record->stage[sizeof(record->stage) - 1] = '\0';
+    strncpy(record->outType, outType, sizeof(record->outType) - 1);
+    record->outType[sizeof(record->outType) - 1] = '\0';
+    record->nThread = nThread;
+    record->best = elapsed;
+    record->mean = elapsed;
+    record->nRepeat = 1;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                             *
+ * Stages                                                                      *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// Inputs of composite_spectra_cext for one outType
+struct bench_case {
+    char *name;
+    short outType;
+    struct sed_params *sed;
+    double *filters;
+    double *logWaves;
+    int nFlux;
+    int nObs;
+    double *absorption;
+};
+
+
+void add_accuracy(struct bench_case *bc, short dust, int nGal, 
+                  float *outDouble, float *outSingle) {
+    /* Compare the output of the two precisions, skipping non-finite values */
+    int iA;
+    size_t i, iStart, iEnd, step;
+    double diff;
+    double maxError = 0.;
+    struct bench_accuracy *accuracy;
+
+    iStart = 0;
+    iEnd = (size_t)nGal*bc->nFlux;
+    step = 1;
+    if (bc->outType == 2) {
+        // Slopes are the first column of the fits after the fluxes
+        iStart = iEnd;
+        iEnd += (size_t)nGal*N_FIT_RESULT;
+        step = N_FIT_RESULT;
+    }
+    for(i = iStart; i < iEnd; i += step) {
+        if (!isfinite(outDouble[i]) || !isfinite(outSingle[i]))
+            continue;
+        diff = fabs((double)outSingle[i] - outDouble[i]);
+        if (bc->outType == 1) {
+            if (outDouble[i] == 0.f)
+                continue;
+            diff /= fabs(outDouble[i]);
+        }
+        if (diff > maxError)
+            maxError = diff;
+    }
+    for(iA = 0; iA < g_nAccuracy; ++iA) {
+        accuracy = g_accuracy + iA;
+        if (!strcmp(accuracy->outType, bc->name) && accuracy->dust == dust) {
+            if (maxError > accuracy->maxError)
+                accuracy->maxError = maxError;
+            return;
+        }
+    }
+    if (g_nAccuracy == MAX_RECORD) {
+        printf("Error: too many accuracy records\n");
+        exit(0);
+    }
+    accuracy = g_accuracy + g_nAccuracy++;
+    strncpy(accuracy->outType, bc->name, sizeof(accuracy->outType) - 1);
+    accuracy->outType[sizeof(accuracy->outType) - 1] = '\0';
+    accuracy->dust = dust;
+    accuracy->maxError = maxError;
+    if (bc->outType == 0)
+        accuracy->tolerance = MAG_TOLERANCE;
+    else if (bc->outType == 1)
+        accuracy->tolerance = 1. - pow(10., -.4*MAG_TOLERANCE);
+    else
+        accuracy->tolerance = .8*MAG_TOLERANCE/UV_LOG_RANGE;
+}
+
+
+void accumulate(struct bench_case *bc, struct tmp_params *tmpSpectra,
+                struct gal_props *galProps, int nAgeList, float *output, int nThread) {
+    /* The dust free loop of composite_spectra_cext */
+    int nGal = galProps->nGal;
+    long long *offsets = galProps->offsets;
+    struct props *nodes = galProps->nodes;
+    double *fluxTmp = tmpSpectra->working;
+    int nFlux = bc->nFlux;
+    int minZ = bc->sed->minZ;
+    int maxZ = bc->sed->maxZ;
+
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(offsets, nodes, nGal, fluxTmp, output, nAgeList, nFlux, minZ, maxZ) \
+    num_threads(nThread)
+    {
+        int iF, iG;
+        double *flux = malloc(nFlux*sizeof(double));
+        struct sfh_bins *bins = init_sfh_bins((maxZ + 1)*nAgeList);
+
+        #pragma omp for schedule(dynamic, 16)
+        for(iG = 0; iG < nGal; ++iG) {
+            sum_progenitors(nodes + offsets[iG], offsets[iG + 1] - offsets[iG],
+                            fluxTmp, nAgeList, minZ, maxZ, flux, nFlux, bins);
+            for(iF = 0; iF < nFlux; ++iF)
+                output[(size_t)iG*nFlux + iF] = (float)flux[iF];
+        }
+        free_sfh_bins(bins);
+        free(flux);
+    }
+}
+
+
+void attenuate(struct bench_case *bc, struct tmp_params *tmpSpectra,
+               struct sparse_filters *filters,
+               struct gal_props *galProps, double *ageList, int nAgeList, double z,
+               struct dust_params *dustArgs, float *output, int nThread) {
+    /* The dust loop of composite_spectra_cext */
+    int nGal = galProps->nGal;
+    long long *offsets = galProps->offsets;
+    struct props *nodes = galProps->nodes;
+    struct sed_params *sed = bc->sed;
+    double *absorption = bc->absorption;
+    int nFlux = bc->nFlux;
+    int nObs = bc->nObs;
+
+    tmpSpectra->cumSpectra = init_cum_templates(sed);
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(sed, tmpSpectra, offsets, nodes, nGal, ageList, nAgeList, \
+                 absorption, dustArgs, z, filters, nFlux, nObs, output) \
+    num_threads(nThread)
+    {
+        int iF, iG;
+        double *flux = malloc(nFlux*sizeof(double));
+        struct dust_buffers *buffers = init_dust_buffers(sed);
+
+        #pragma omp for schedule(dynamic, 16)
+        for(iG = 0; iG < nGal; ++iG) {
+            dust_absorption(sed, tmpSpectra, nodes + offsets[iG], 
+                            offsets[iG + 1] - offsets[iG],
+                            ageList, nAgeList, dustArgs + iG, buffers);
+            spectra_to_flux(sed, buffers, absorption, z, filters, nFlux, nObs, flux);
+            for(iF = 0; iF < nFlux; ++iF)
+                output[(size_t)iG*nFlux + iF] = (float)flux[iF];
+        }
+        free_dust_buffers(buffers);
+        free(flux);
+    }
+}
+
+
+void run_case(struct bench_case *bc, struct gal_props *galProps,
+              double *ageList, int nAgeList, double z,
+              struct dust_params *dustArgs, int nThread) {
+    /* Time every stage of one outType */
+    int nGal = galProps->nGal;
+    struct sed_params *sed = bc->sed;
+    double *integrated = malloc((size_t)sed->nZ*nAgeList*sed->nWaves*sizeof(double));
+    float *output = malloc(((size_t)bc->nFlux + N_FIT_RESULT)*nGal*sizeof(float));
+    float *cOutput;
+    float *singleOutput;
+    struct tmp_params *tmpSpectra;
+    struct sparse_filters *filters = NULL;
+    struct mag_context *ctx;
+    double t0;
+
+    t0 = wall_time();
+    templates_time_integration(sed, ageList, nAgeList, integrated);
+    add_record("time_integration", bc->name, nThread, wall_time() - t0);
+
+    t0 = wall_time();
+    tmpSpectra = init_template(ageList, nAgeList, integrated);
+    if (bc->filters != NULL)
+        filters = init_sparse_filters(sed, bc->absorption, bc->filters, bc->nFlux, bc->nObs);
+    tmpSpectra->filters = filters;
+    templates_working(sed, tmpSpectra, bc->absorption, z, filters, 
+                      bc->nFlux, bc->nObs, nThread);
+    add_record("templates_working", bc->name, nThread, wall_time() - t0);
+
+    t0 = wall_time();
+    accumulate(bc, tmpSpectra, galProps, nAgeList, output, nThread);
+    add_record("accumulation", bc->name, nThread, wall_time() - t0);
+
+    if (bc->outType == 2) {
+        t0 = wall_time();
+        fit_UV_slopes(output, nGal, bc->nFlux, bc->logWaves, NULL, 
+                      output + bc->nFlux*nGal, nThread);
+        add_record("uv_fit", bc->name, nThread, wall_time() - t0);
+    }
+
+    t0 = wall_time();
+    attenuate(bc, tmpSpectra, filters, galProps, ageList, nAgeList, z, 
+              dustArgs, output, nThread);
+    add_record("dust", bc->name, nThread, wall_time() - t0);
+    free_spectra(tmpSpectra);
+
+    // Every call has a new context, such that totals include the templates
+
+    t0 = wall_time();
+    ctx = init_context(nThread, 0);
+    cOutput = composite_spectra_cext(ctx, sed, galProps, z, ageList, nAgeList,
+                                     bc->filters, bc->logWaves, NULL, bc->nFlux, bc->nObs,
+                                     bc->absorption, NULL, NULL, integrated,
+                                     bc->outType, NULL, 0, NULL);
+    free_context(ctx);
+    add_record("total", bc->name, nThread, wall_time() - t0);
+
+    t0 = wall_time();
+    ctx = init_context(nThread, 1);
+    singleOutput = composite_spectra_cext(ctx, sed, galProps, z, ageList, nAgeList,
+                                          bc->filters, bc->logWaves, NULL, bc->nFlux, bc->nObs,
+                                          bc->absorption, NULL, NULL, integrated,
+                                          bc->outType, NULL, 0, NULL);
+    free_context(ctx);
+    add_record("total_single", bc->name, nThread, wall_time() - t0);
+    add_accuracy(bc, 0, nGal, cOutput, singleOutput);
+    free(cOutput);
+    free(singleOutput);
+
+    t0 = wall_time();
+    ctx = init_context(nThread, 0);
+    cOutput = composite_spectra_cext(ctx, sed, galProps, z, ageList, nAgeList,
+                                     bc->filters, bc->logWaves, NULL, bc->nFlux, bc->nObs,
+                                     bc->absorption, dustArgs, NULL, integrated,
+                                     bc->outType, NULL, 0, NULL);
+    free_context(ctx);
+    add_record("total_dust", bc->name, nThread, wall_time() - t0);
+
+    t0 = wall_time();
+    ctx = init_context(nThread, 1);
+    singleOutput = composite_spectra_cext(ctx, sed, galProps, z, ageList, nAgeList,
+                                          bc->filters, bc->logWaves, NULL, bc->nFlux, bc->nObs,
+                                          bc->absorption, dustArgs, NULL, integrated,
+                                          bc->outType, NULL, 0, NULL);
+    free_context(ctx);
+    add_record("total_dust_single", bc->name, nThread, wall_time() - t0);
+    add_accuracy(bc, 1, nGal, cOutput, singleOutput);
+    free(cOutput);
+    free(singleOutput);
+
+    free(integrated);
+    free(output);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                             *
+ * Main                                                                        *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void usage(void) {
+    printf("Usage: bench [options]\n"
+           "  --gals N      number of galaxies at the last snapshot (default 20000)\n"
+           "  --snaps N     number of snapshots (default 60)\n"
+           "  --branch X    mean number of progenitors per galaxy (default 0.98)\n"
+           "  --metals N    number of metallicities of SED templates (default 7)\n"
+           "  --ages N      number of ages of SED templates (default 100)\n"
+           "  --waves N     number of wavelengths of SED templates (default 1221)\n"
+           "  --threads L   comma separated numbers of threads (default 1)\n"
+           "  --types L     comma separated outTypes from ph, sp and uv (default all)\n"
+           "  --repeat N    number of repeats of each stage (default 3)\n"
+           "  --seed N      seed of the random numbers (default 1)\n"
+           "  --label S     label stored in the output (default none)\n"
+           "  --out FILE    path to the JSON output (default bench.json)\n");
+}
+
+
+int main(int argc, char **argv) {
+    int nGal = 20000;
+    int nSnap = 60;
+    double branch = .98;
+    int nZ = 7;
+    int nAge = 100;
+    int nWaves = 1221;
+    char *threads = "1";
+    char *types = "ph,sp,uv";
+    int nRepeat = 3;
+    unsigned long long seed = 1;
+    char *label = "";
+    char *outName = "bench.json";
+    double z = 6.;
+
+    int iArg, iR, iC, iF, iW, iG;
+    char *token, *pEnd;
+    char threadList[256];
+    double t0;
+
+    for(iArg = 1; iArg < argc; ++iArg) {
+        if (!strcmp(argv[iArg], "--help")) {
+            usage();
+            return 0;
+        }
+        if (iArg + 1 == argc) {
+            usage();
+            exit(0);
+        }
+        if (!strcmp(argv[iArg], "--gals"))
+            nGal = atoi(argv[++iArg]);
+        else if (!strcmp(argv[iArg], "--snaps"))
+            nSnap = atoi(argv[++iArg]);
+        else if (!strcmp(argv[iArg], "--branch"))
+            branch = atof(argv[++iArg]);
+        else if (!strcmp(argv[iArg], "--metals"))
+            nZ = atoi(argv[++iArg]);
+        else if (!strcmp(argv[iArg], "--ages"))
+            nAge = atoi(argv[++iArg]);
+        else if (!strcmp(argv[iArg], "--waves"))
+            nWaves = atoi(argv[++iArg]);
+        else if (!strcmp(argv[iArg], "--threads"))
+            threads = argv[++iArg];
+        else if (!strcmp(argv[iArg], "--types"))
+            types = argv[++iArg];
+        else if (!strcmp(argv[iArg], "--repeat"))
+            nRepeat = atoi(argv[++iArg]);
+        else if (!strcmp(argv[iArg], "--seed"))
+            seed = strtoull(argv[++iArg], &pEnd, 10);
+        else if (!strcmp(argv[iArg], "--label"))
+            label = argv[++iArg];
+        else if (!strcmp(argv[iArg], "--out"))
+            outName = argv[++iArg];
+        else {
+            printf("Error: unknown option \"%s\"\n", argv[iArg]);
+            usage();
+            exit(0);
+        }
+    }
+    if (seed == 0)
+        seed = 1;
+
+    // Generate inputs
+    struct forest *trees = generate_forest(nGal, nSnap, branch, &seed);
+    double *ageList = trees->ageList;
+    int nAgeList = nSnap;
+    struct sed_params *sed = generate_sed(nZ, nAge, nWaves, 1.5*ageList[nAgeList - 1],
+                                          100., 1e5);
+    int *indices = malloc(nGal*sizeof(int));
+    for(iG = 0; iG < nGal; ++iG)
+        indices[iG] = iG;
+    struct dust_params *dustArgs = malloc(nGal*sizeof(struct dust_params));
+    for(iG = 0; iG < nGal; ++iG) {
+        dustArgs[iG].tauUV_ISM = bench_random(&seed);
+        dustArgs[iG].nISM = -.7;
+        dustArgs[iG].tauUV_BC = 1. + bench_random(&seed);
+        dustArgs[iG].nBC = -.7;
+        dustArgs[iG].tBC = 1e6 + 3e7*bench_random(&seed);
+    }
+    double *absorption = malloc(nWaves*sizeof(double));
+    for(iW = 0; iW < nWaves; ++iW)
+        absorption[iW] = sed->waves[iW] < 1216. ? exp(-(1216. - sed->waves[iW])/100.) : 1.;
+
+    // Filters of each outType, in the same way as read_filters and
+    // beta_filters but with box filters for observer frame bands
+    double restBands[3][2] = {{1600., 100.}, {2000., 100.}, {9000., 200.}};
+    double obsBands[4][2] = {{4350., 1000.}, {6060., 2000.}, {7750., 1500.}, {8140., 2500.}};
+    double windows[10][2] = {{1268., 1284.}, {1309., 1316.}, {1342., 1371.},
+                             {1407., 1515.}, {1562., 1583.}, {1677., 1740.},
+                             {1760., 1833.}, {1866., 1890.}, {1930., 1950.},
+                             {2400., 2580.}};
+    struct bench_case cases[3];
+    struct bench_case *bc;
+    double *obsWaves = malloc(nWaves*sizeof(double));
+    double *pFilter;
+    for(iW = 0; iW < nWaves; ++iW)
+        obsWaves[iW] = (1. + z)*sed->waves[iW];
+
+    bc = cases;
+    bc->name = "ph";
+    bc->outType = 0;
+    bc->sed = sed;
+    bc->nFlux = 7;
+    bc->nObs = 4;
+    bc->logWaves = NULL;
+    bc->absorption = absorption;
+    bc->filters = malloc(bc->nFlux*nWaves*sizeof(double));
+    for(iF = 0; iF < bc->nFlux; ++iF) {
+        pFilter = bc->filters + iF*nWaves;
+        if (iF < 3)
+            box_filter(pFilter, sed->waves, nWaves, restBands[iF][0] - restBands[iF][1]/2.,
+                       restBands[iF][0] + restBands[iF][1]/2.);
+        else
+            box_filter(pFilter, obsWaves, nWaves,
+                       obsBands[iF - 3][0] - obsBands[iF - 3][1]/2.,
+                       obsBands[iF - 3][0] + obsBands[iF - 3][1]/2.);
+        for(iW = 0; iW < nWaves; ++iW)
+            pFilter[iW] *= 3.34e4*(iF < 3 ? sed->waves[iW] : obsWaves[iW]);
+    }
+
+    bc = cases + 1;
+    bc->name = "sp";
+    bc->outType = 1;
+    bc->sed = sed;
+    bc->nFlux = nWaves;
+    bc->nObs = 0;
+    bc->logWaves = NULL;
+    bc->absorption = NULL;
+    bc->filters = NULL;
+
+    // The UV slope is fitted with wavelengths trimmed to the windows
+    int minWIdx = 0;
+    int maxWIdx = nWaves - 1;
+    while(minWIdx < nWaves - 1 && sed->waves[minWIdx + 1] < windows[0][0])
+        ++minWIdx;
+    while(maxWIdx > 0 && sed->waves[maxWIdx - 1] > windows[9][1])
+        --maxWIdx;
+    // The window is a view of the full templates with the same strides
+    struct sed_params uvSED = *sed;
+    uvSED.nWaves = maxWIdx - minWIdx + 1;
+    uvSED.waves = sed->waves + minWIdx;
+    uvSED.data = sed->data + (size_t)minWIdx*nAge;
+    bc = cases + 2;
+    bc->name = "uv";
+    bc->outType = 2;
+    bc->sed = &uvSED;
+    bc->nFlux = 11;
+    bc->nObs = 0;
+    bc->absorption = NULL;
+    bc->logWaves = malloc(bc->nFlux*sizeof(double));
+    bc->filters = malloc(bc->nFlux*uvSED.nWaves*sizeof(double));
+    for(iF = 0; iF < 10; ++iF) {
+        bc->logWaves[iF] = log((windows[iF][0] + windows[iF][1])/2.);
+        box_filter(bc->filters + iF*uvSED.nWaves, uvSED.waves, uvSED.nWaves,
+                   windows[iF][0], windows[iF][1]);
+    }
+    bc->logWaves[10] = log(1600.);
+    pFilter = bc->filters + 10*uvSED.nWaves;
+    box_filter(pFilter, uvSED.waves, uvSED.nWaves, 1550., 1650.);
+    for(iW = 0; iW < uvSED.nWaves; ++iW)
+        pFilter[iW] *= 3.34e4*uvSED.waves[iW];
+
+    // Run benchmarks
+    struct gal_props *galProps;
+    long long nNode = 0;
+    int nThread;
+    strncpy(threadList, threads, sizeof(threadList) - 1);
+    threadList[sizeof(threadList) - 1] = '\0';
+    for(token = strtok(threadList, ","); token != NULL; token = strtok(NULL, ",")) {
+        nThread = atoi(token);
+        printf("# %d thread(s)\n", nThread);
+        for(iR = 0; iR < nRepeat; ++iR) {
+            t0 = wall_time();
+            galProps = trace_progenitors(trees->firstProgenitor, trees->nextProgenitor,
+                                         trees->metals, trees->sfr, nSnap - 1,
+                                         indices, nGal, nThread);
+            add_record("trace", "all", nThread, wall_time() - t0);
+            nNode = galProps->offsets[nGal];
+            for(iC = 0; iC < 3; ++iC)
+                if (strstr(types, cases[iC].name) != NULL)
+                    run_case(cases + iC, galProps, ageList, nAgeList, z, dustArgs, nThread);
+            free_gal_props(galProps);
+        }
+    }
+
+    // Save results
+    FILE *fp = open_file(outName, "w");
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"label\": \"%s\",\n", label);
+    fprintf(fp, "  \"config\": {\"gals\": %d, \"snaps\": %d, \"branch\": %g, "
+                "\"nodes\": %lld, \"metals\": %d, \"ages\": %d, \"waves\": %d, "
+                "\"repeat\": %d},\n",
+            nGal, nSnap, branch, nNode, nZ, nAge, nWaves, nRepeat);
+    fprintf(fp, "  \"results\": [\n");
+    for(iR = 0; iR < g_nRecord; ++iR)
+        fprintf(fp, "    {\"stage\": \"%s\", \"outType\": \"%s\", \"nThread\": %d, "
+                    "\"best\": %.6e, \"mean\": %.6e}%s\n",
+                g_records[iR].stage, g_records[iR].outType, g_records[iR].nThread,
+                g_records[iR].best, g_records[iR].mean, iR < g_nRecord - 1 ? "," : "");
+    fprintf(fp, "  ],\n");
+    fprintf(fp, "  \"accuracy\": [\n");
+    for(iR = 0; iR < g_nAccuracy; ++iR)
+        fprintf(fp, "    {\"outType\": \"%s\", \"dust\": %s, \"maxError\": %.6e, "
+                    "\"tolerance\": %.6e}%s\n",
+                g_accuracy[iR].outType, g_accuracy[iR].dust ? "true" : "false",
+                g_accuracy[iR].maxError, g_accuracy[iR].tolerance, 
+                iR < g_nAccuracy - 1 ? "," : "");
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+
+    printf("# %-18s %-6s %8s %12s %12s\n", "stage", "type", "threads", "best [s]", "mean [s]");
+    for(iR = 0; iR < g_nRecord; ++iR)
+        printf("  %-18s %-6s %8d %12.4f %12.4f\n",
+               g_records[iR].stage, g_records[iR].outType, g_records[iR].nThread,
+               g_records[iR].best, g_records[iR].mean);
+    printf("# %-18s %-6s %12s %12s\n", "accuracy", "dust", "max error", "tolerance");
+    for(iR = 0; iR < g_nAccuracy; ++iR)
+        printf("  %-18s %-6s %12.3e %12.3e %s\n", g_accuracy[iR].outType,
+               g_accuracy[iR].dust ? "yes" : "no", g_accuracy[iR].maxError,
+               g_accuracy[iR].tolerance,
+               g_accuracy[iR].maxError < g_accuracy[iR].tolerance ? "PASS" : "FAIL");
+
+    free(cases[0].filters);
+    free(cases[2].filters);
+    free(cases[2].logWaves);
+    free(obsWaves);
+    free(absorption);
+    free(dustArgs);
+    free(indices);
+    free_sed(sed);
+    free_forest(trees);
+    return 0;
+}
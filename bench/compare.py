@@ -0,0 +1,40 @@
+"""
+Compare two outputs of the benchmark.
+
+Usage: python bench/compare.py old.json new.json
+"""
+from __future__ import print_function
+import sys
+import json
+
+
+def load(fname):
+    with open(fname) as fp:
+        data = json.load(fp)
+    records = {}
+    for r in data["results"]:
+        records[(r["stage"], r["outType"], r["nThread"])] = r["best"]
+    return data, records
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(__doc__.strip())
+        sys.exit(1)
+    oldData, oldRecords = load(sys.argv[1])
+    newData, newRecords = load(sys.argv[2])
+    if oldData["config"] != newData["config"]:
+        print("# Warning: the configurations are different")
+    print("# %-18s %-6s %8s %12s %12s %8s"%("stage", "type", "threads", 
+                                           "old [s]", "new [s]", "speedup"))
+    for r in oldData["results"]:
+        key = (r["stage"], r["outType"], r["nThread"])
+        if key not in newRecords:
+            continue
+        old = oldRecords[key]
+        new = newRecords[key]
+        print("  %-18s %-6s %8d %12.4f %12.4f %8.2f"%(key + (old, new, old/new)))
+
+
+if __name__ == "__main__":
+    main()
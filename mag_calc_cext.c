@@ -3,11 +3,18 @@
 #include<string.h>
 #include<math.h>
 #include<time.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<omp.h>
 
 //#define SURFACE_AREA 1.1965e40 // 4*pi*(10 pc)**2 unit cm^2
 //#define JANSKY(x) (3.34e4*(x)*(x))
 #define M_AB(x) (-2.5*log10(x) + 8.9) // Convert Jansky to AB magnitude
 #define TOL 1e-30 // Minimum Flux
+#define MAX_DIRECT_FLUX 16 // Progenitors are not binned below this number of fluxes
+#define DIRECT_BLOCK 4 // Number of fluxes summed together over unbinned progenitors
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
@@ -15,13 +22,6 @@
  * Basic functions                                                             *
  *                                                                             *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-short g_nThread = 1;
-struct timespec g_sTime;
-struct timespec g_sTime2;
-struct timespec g_eTime;
-struct timespec g_eTime2;
-
-
 FILE *open_file(char *fName, char *mode) {
 /* Open the file with specific mode */
     FILE *fp;
@@ -34,12 +34,21 @@ FILE *open_file(char *fName, char *mode) {
 }
 
 
-inline void report(int i, int tot) {
+inline void report(int *nDone, int tot) {
+    /* Count a finished item and print the progress
+     * nDone is shared by all threads. It must be zero before the first call.
+     */
     #ifdef TIMING
+        int i;
         int n = tot > 10 ? tot/10 : 1;
+        #pragma omp atomic capture
+        i = (*nDone)++;
         if (i%n == 0) {
-            printf("# %5.1f%% complete!\r", 100.*(i + 1)/tot);      
-            fflush(stdout);
+            #pragma omp critical (report)
+            {
+                printf("# %5.1f%% complete!\r", 100.*(i + 1)/tot);      
+                fflush(stdout);
+            }
         }
     #endif
     ;
@@ -72,17 +81,19 @@ void free_2d_double(double **p, int nRow) {
 }
 
 
-void timing_start(char* text) {
-    clock_gettime(CLOCK_REALTIME, &g_sTime);
+// The start time is given by the caller, so that timings of different calls
+// do not interfere with each other
+void timing_start(struct timespec *sTime, char* text) {
+    clock_gettime(CLOCK_MONOTONIC, sTime);
     printf("#***********************************************************\n");
-    printf("# ");
-    printf(text);
+    printf("# %s", text);
 }
 
-void timing_end(void) {
-    clock_gettime(CLOCK_REALTIME, &g_eTime);
-    double elapsedTime = g_eTime.tv_sec - g_sTime.tv_sec \
-                         + (g_eTime.tv_nsec - g_sTime.tv_nsec)/1e9;
+void timing_end(struct timespec *sTime) {
+    struct timespec eTime;
+    clock_gettime(CLOCK_MONOTONIC, &eTime);
+    double elapsedTime = eTime.tv_sec - sTime->tv_sec \
+                         + (eTime.tv_nsec - sTime->tv_nsec)/1e9;
     int minute = (int)elapsedTime/60;
     printf("# 100.0%% complete!\n");
     printf("# Done!\n");
@@ -90,18 +101,127 @@ void timing_end(void) {
     printf("#***********************************************************\n\n");
 }
 
-void timing_start_sub(void) {
-    clock_gettime(CLOCK_REALTIME, &g_sTime2);
+void timing_start_sub(struct timespec *sTime) {
+    clock_gettime(CLOCK_MONOTONIC, sTime);
 }
 
-void timing_end_sub(char* text) {
-     clock_gettime(CLOCK_REALTIME, &g_eTime2);
-    double elapsedTime = g_eTime2.tv_sec - g_sTime2.tv_sec \
-                         + (g_eTime2.tv_nsec - g_sTime2.tv_nsec)/1e9;
-    printf("#     ");
-    printf(text);
+void timing_end_sub(struct timespec *sTime, char* text) {
+    struct timespec eTime;
+    clock_gettime(CLOCK_MONOTONIC, &eTime);
+    double elapsedTime = eTime.tv_sec - sTime->tv_sec \
+                         + (eTime.tv_nsec - sTime->tv_nsec)/1e9;
+    printf("#     %s", text);
     printf("#     Elapsed time: %.6f ms\n", elapsedTime*1e3);
-    clock_gettime(CLOCK_REALTIME, &g_sTime2);
+    clock_gettime(CLOCK_MONOTONIC, sTime);
+}
+
+
+/* Statistics of composite_spectra_cext, which are always recorded
+ *
+ * wallTime is the elapsed time of a serial stage, or the longest busy time
+ * among threads of a parallel stage. threadTime is the busy time of each 
+ * of the nThread threads, which should be at least the number of threads 
+ * of the context. nCall counts calls of the stage, e.g. the number of 
+ * galaxies, nNode counts progenitors processed, and nByte counts bytes 
+ * allocated.
+ */
+#define STAGE_TEMPLATES 0
+#define STAGE_DUST 1
+#define STAGE_FILTERS 2
+#define STAGE_ACCUMULATION 3
+#define STAGE_OUTPUT 4
+#define STAGE_PRUNING 5
+#define N_STAGE 6
+
+struct stage_stats {
+    double wallTime;
+    double *threadTime;
+    long long nCall;
+    long long nNode;
+    long long nByte;
+};
+
+struct run_stats {
+    int nThread;
+    struct stage_stats stages[N_STAGE];
+};
+
+
+void init_stats(struct run_stats *stats, int nThread) {
+    int iS;
+    memset(stats, 0, sizeof(struct run_stats));
+    stats->nThread = nThread > 0 ? nThread : 1;
+    for(iS = 0; iS < N_STAGE; ++iS)
+        stats->stages[iS].threadTime = calloc(stats->nThread, sizeof(double));
+}
+
+
+void free_stats(struct run_stats *stats) {
+    int iS;
+    for(iS = 0; iS < N_STAGE; ++iS) {
+        free(stats->stages[iS].threadTime);
+        stats->stages[iS].threadTime = NULL;
+    }
+}
+
+
+void check_stats(struct run_stats *stats, int nThread) {
+    /* Stop if the statistics cannot record nThread threads */
+    if (stats->nThread < nThread) {
+        printf("Error: statistics of %d threads are given to %d threads\n", 
+               stats->nThread, nThread);
+        exit(0);
+    }
+}
+
+
+inline double stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+void add_serial_stats(struct run_stats *stats, int stage, double wallTime,
+                      long long nCall, long long nNode, long long nByte) {
+    /* Add a stage run by the calling thread only */
+    struct stage_stats *pStage = stats->stages + stage;
+    pStage->wallTime += wallTime;
+    pStage->threadTime[0] += wallTime;
+    pStage->nCall += nCall;
+    pStage->nNode += nNode;
+    pStage->nByte += nByte;
+}
+
+
+void add_thread_stats(struct run_stats *stats, int stage, double busyTime,
+                      long long nCall, long long nNode, long long nByte) {
+    /* Add the part of a parallel stage run by the calling thread
+     * This function must be called by each thread of the parallel region
+     */
+    struct stage_stats *pStage = stats->stages + stage;
+    // Each thread has its own slot, so no atomic is needed
+    pStage->threadTime[omp_get_thread_num()] += busyTime;
+    #pragma omp atomic
+    pStage->nCall += nCall;
+    #pragma omp atomic
+    pStage->nNode += nNode;
+    #pragma omp atomic
+    pStage->nByte += nByte;
+}
+
+
+void finish_thread_stats(struct run_stats *stats, int stage, double *startTime) {
+    /* Add the longest busy time among threads since a parallel stage starts
+     * startTime: threadTime of the stage before the parallel region
+     */
+    struct stage_stats *pStage = stats->stages + stage;
+    double maxTime = 0.;
+    int iThread;
+    for(iThread = 0; iThread < stats->nThread; ++iThread)
+        if (pStage->threadTime[iThread] - startTime[iThread] > maxTime)
+            maxTime = pStage->threadTime[iThread] - startTime[iThread];
+    pStage->wallTime += maxTime;
 }
 
 inline int bisection_search(double a, double *x, double nX) {
@@ -139,6 +259,25 @@ inline double interp(double xp, double *x, double *y, int nPts) {
 }
 
 
+inline int interp_weight(double xp, double *x, int nPts, double *w) {
+    /* Return idx and w such that the interpolation at xp is
+     * y[idx] + (y[idx + 1] - y[idx])*w
+     */
+    int idx0;
+    if((xp < x[0]) || (xp > x[nPts - 1])) {
+        printf("Error: Point %10.5e is beyond the interpolation region\n", xp);
+        exit(0);
+    }
+    if (xp == x[nPts - 1]) {
+        *w = 1.;
+        return nPts - 2;
+    }
+    idx0 = bisection_search(xp, x, nPts);
+    *w = (xp - x[idx0])/(x[idx0 + 1] - x[idx0]);
+    return idx0;
+}
+
+
 inline double trapz_table(double *y, double *x, int nPts, double a, double b) {
     /* Integrate tabular data from a to b */
     int i;
@@ -182,81 +321,356 @@ inline double trapz_table(double *y, double *x, int nPts, double a, double b) {
 }
 
 
-inline double trapz_filter(double *filter, double *flux, double *waves, int nWaves) {
-    /* integrate the flux in a filter */
-    int i;
-    double y0 = filter[0]*flux[0];
-    double y1;
-    double I = 0.;
-    for(i = 1; i < nWaves; ++i) {
-        y1 = filter[i]*flux[i];
-        I += (waves[i] - waves[i - 1])*(y0 + y1);
-        y0 = y1;
-    }
-    return I/2.;
-}
-
-
-struct linResult {
-    double slope;
-    double intercept;
-    double R;
+// Linear regressions of many data sets that share the same x are computed in
+// blocks of FIT_BLOCK data sets, so that the loops over data sets can be 
+// vectorised
+#define FIT_BLOCK 8
+// Number of outputs of each fit: slope, intercept, correlation coefficient
+// and the uncertainty of the slope
+#define N_FIT_RESULT 4
+
+struct lin_design {
+    int nPts;
+    double *w;
+    // Weighted deviations from the mean of x
+    double *dx;
+    double xMean;
+    double xxSum;
 };
 
 
-inline struct linResult linregress(double *x, double *y, int nPts) {
+struct lin_design *init_lin_design(double *x, double *weights, int nPts) {
+    /* Compute the terms that only depend on x
+     * If weights is NULL, all points have the same weight. Weights are
+     * normalised such that their mean is unity.
+     */
     int i;
-   
-    double xSum = 0.;
+    double wSum = 0.;
+    struct lin_design *design = malloc(sizeof(struct lin_design));
+    design->nPts = nPts;
+    design->w = malloc(nPts*sizeof(double));
+    design->dx = malloc(nPts*sizeof(double));
+    for(i = 0; i < nPts; ++i) {
+        design->w[i] = weights == NULL ? 1. : weights[i];
+        wSum += design->w[i];
+    }
     for(i = 0; i < nPts; ++i)
-        xSum += x[i];
-
-    double ySum = 0.;
+        design->w[i] *= nPts/wSum;
+    design->xMean = 0.;
     for(i = 0; i < nPts; ++i)
-        ySum += y[i];
+        design->xMean += design->w[i]*x[i];
+    design->xMean /= nPts;
+    design->xxSum = 0.;
+    for(i = 0; i < nPts; ++i) {
+        design->dx[i] = x[i] - design->xMean;
+        design->xxSum += design->w[i]*design->dx[i]*design->dx[i];
+    }
+    return design;
+}
 
-    double xxSum = 0.;
-    for(i = 0; i < nPts; ++i)
-        xxSum += x[i]*x[i];
 
-    double xySum = 0.;
-    for(i = 0; i < nPts; ++i)
-        xySum += x[i]*y[i];
+void free_lin_design(struct lin_design *design) {
+    free(design->w);
+    free(design->dx);
+    free(design);
+}
 
-    double denominator = nPts*xxSum - xSum*xSum;
-    
-    double slope = (nPts*xySum - xSum*ySum)/denominator;
-    double intercept = (xxSum*ySum - xSum*xySum)/denominator;
 
-    double yReg;
-    double delta;
-    double ssRes = 0.;
+void linregress_block(struct lin_design *design, double *y, double *result) {
+    /* Linear regressions of FIT_BLOCK data sets 
+     * y: the i-th point of the b-th data set is y[i*FIT_BLOCK + b]
+     * result: slope, intercept, R and the uncertainty of the slope of the 
+     *         b-th data set are result[iR*FIT_BLOCK + b]
+     */
+    int i, b;
+    int nPts = design->nPts;
+    double *w = design->w;
+    double *dx = design->dx;
+    double *pY;
+    double yMean[FIT_BLOCK], xySum[FIT_BLOCK], ssRes[FIT_BLOCK], ssTot[FIT_BLOCK];
+    double *slope = result;
+    double *intercept = result + FIT_BLOCK;
+    double *R = result + 2*FIT_BLOCK;
+    double *slopeErr = result + 3*FIT_BLOCK;
+    double delta, res;
+
+    for(b = 0; b < FIT_BLOCK; ++b) {
+        yMean[b] = 0.;
+        xySum[b] = 0.;
+        ssRes[b] = 0.;
+        ssTot[b] = 0.;
+    }
+    for(i = 0; i < nPts; ++i) {
+        pY = y + i*FIT_BLOCK;
+        #pragma omp simd
+        for(b = 0; b < FIT_BLOCK; ++b) {
+            yMean[b] += w[i]*pY[b];
+            xySum[b] += w[i]*dx[i]*pY[b];
+        }
+    }
+    #pragma omp simd
+    for(b = 0; b < FIT_BLOCK; ++b) {
+        yMean[b] /= nPts;
+        slope[b] = xySum[b]/design->xxSum;
+        intercept[b] = yMean[b] - slope[b]*design->xMean;
+    }
     for(i = 0; i < nPts; ++i) {
-        yReg = slope*x[i] + intercept;
-        delta = yReg - y[i];
-        ssRes += delta*delta;
+        pY = y + i*FIT_BLOCK;
+        #pragma omp simd private(delta, res)
+        for(b = 0; b < FIT_BLOCK; ++b) {
+            delta = pY[b] - yMean[b];
+            res = delta - slope[b]*dx[i];
+            ssTot[b] += w[i]*delta*delta;
+            ssRes[b] += w[i]*res*res;
+        }
     }
+    for(b = 0; b < FIT_BLOCK; ++b) {
+        R[b] = sqrt(1. - ssRes[b]/ssTot[b]);
+        slopeErr[b] = nPts > 2 ? sqrt(ssRes[b]/(nPts - 2)/design->xxSum) : NAN;
+    }
+}
 
-    double yMean = ySum/nPts;
-    double ssTot = 0.;
-    for(i = 0; i < nPts; ++i) {
-        delta = yMean - y[i];
-        ssTot += delta*delta;
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                             *
+ * Functions to compute the IGM absorption                                     *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// Inoue calculated the absorption of 40th Lyman series
+#define NLYMAN 39
+
+static const double g_LymanSeries[NLYMAN] = {
+    1215.67, 1025.72, 972.537, 949.743, 937.803,
+    930.748, 926.226, 923.150, 920.963, 919.352,
+    918.129, 917.181, 916.429, 915.824, 915.329,
+    914.919, 914.576, 914.286, 914.039, 913.826,
+    913.641, 913.480, 913.339, 913.215, 913.104,
+    913.006, 912.918, 912.839, 912.768, 912.703,
+    912.645, 912.592, 912.543, 912.499, 912.458,
+    912.420, 912.385, 912.353, 912.324
+};
+static const double g_LAF1[NLYMAN] = {
+    1.690e-02, 4.692e-03, 2.239e-03, 1.319e-03, 8.707e-04,
+    6.178e-04, 4.609e-04, 3.569e-04, 2.843e-04, 2.318e-04,
+    1.923e-04, 1.622e-04, 1.385e-04, 1.196e-04, 1.043e-04,
+    9.174e-05, 8.128e-05, 7.251e-05, 6.505e-05, 5.868e-05,
+    5.319e-05, 4.843e-05, 4.427e-05, 4.063e-05, 3.738e-05,
+    3.454e-05, 3.199e-05, 2.971e-05, 2.766e-05, 2.582e-05,
+    2.415e-05, 2.263e-05, 2.126e-05, 2.000e-05, 1.885e-05,
+    1.779e-05, 1.682e-05, 1.593e-05, 1.510e-05
+};
+static const double g_LAF2[NLYMAN] = {
+    2.354e-03, 6.536e-04, 3.119e-04, 1.837e-04, 1.213e-04,
+    8.606e-05, 6.421e-05, 4.971e-05, 3.960e-05, 3.229e-05,
+    2.679e-05, 2.259e-05, 1.929e-05, 1.666e-05, 1.453e-05,
+    1.278e-05, 1.132e-05, 1.010e-05, 9.062e-06, 8.174e-06,
+    7.409e-06, 6.746e-06, 6.167e-06, 5.660e-06, 5.207e-06,
+    4.811e-06, 4.456e-06, 4.139e-06, 3.853e-06, 3.596e-06,
+    3.364e-06, 3.153e-06, 2.961e-06, 2.785e-06, 2.625e-06,
+    2.479e-06, 2.343e-06, 2.219e-06, 2.103e-06
+};
+static const double g_LAF3[NLYMAN] = {
+    1.026e-04, 2.849e-05, 1.360e-05, 8.010e-06, 5.287e-06,
+    3.752e-06, 2.799e-06, 2.167e-06, 1.726e-06, 1.407e-06,
+    1.168e-06, 9.847e-07, 8.410e-07, 7.263e-07, 6.334e-07,
+    5.571e-07, 4.936e-07, 4.403e-07, 3.950e-07, 3.563e-07,
+    3.230e-07, 2.941e-07, 2.689e-07, 2.467e-07, 2.270e-07,
+    2.097e-07, 1.943e-07, 1.804e-07, 1.680e-07, 1.568e-07,
+    1.466e-07, 1.375e-07, 1.291e-07, 1.214e-07, 1.145e-07,
+    1.080e-07, 1.022e-07, 9.673e-08, 9.169e-08
+};
+static const double g_DLA1[NLYMAN] = {
+    1.617e-04, 1.545e-04, 1.498e-04, 1.460e-04, 1.429e-04,
+    1.402e-04, 1.377e-04, 1.355e-04, 1.335e-04, 1.316e-04,
+    1.298e-04, 1.281e-04, 1.265e-04, 1.250e-04, 1.236e-04,
+    1.222e-04, 1.209e-04, 1.197e-04, 1.185e-04, 1.173e-04,
+    1.162e-04, 1.151e-04, 1.140e-04, 1.130e-04, 1.120e-04,
+    1.110e-04, 1.101e-04, 1.091e-04, 1.082e-04, 1.073e-04,
+    1.065e-04, 1.056e-04, 1.048e-04, 1.040e-04, 1.032e-04,
+    1.024e-04, 1.017e-04, 1.009e-04, 1.002e-04
+};
+static const double g_DLA2[NLYMAN] = {
+    5.390e-05, 5.151e-05, 4.992e-05, 4.868e-05, 4.763e-05, 
+    4.672e-05, 4.590e-05, 4.516e-05, 4.448e-05, 4.385e-05, 
+    4.326e-05, 4.271e-05, 4.218e-05, 4.168e-05, 4.120e-05,
+    4.075e-05, 4.031e-05, 3.989e-05, 3.949e-05, 3.910e-05, 
+    3.872e-05, 3.836e-05, 3.800e-05, 3.766e-05, 3.732e-05,
+    3.700e-05, 3.668e-05, 3.637e-05, 3.607e-05, 3.578e-05,
+    3.549e-05, 3.521e-05, 3.493e-05, 3.466e-05, 3.440e-05,
+    3.414e-05, 3.389e-05, 3.364e-05, 3.339e-05
+};
+
+
+void Lyman_absorption_cext(double *obsWaves, int nWaves, double z, 
+                           double *absorption) {
+    /* Transmission of the IGM given by Inoue et al. 2014
+     *
+     * obsWaves: wavelength in unit of angstrom
+     * z: redshift
+     * absorption: transmission (dimensionless) at each wavelength
+     *
+     * Loops run over wavelengths for each Lyman line, but the optical depth 
+     * of each wavelength is still summed from the first line to the last 
+     * line and then the continuum.
+     */
+    int i, j;
+    double tau, ratio, lineWave;
+    double zp1 = 1. + z;
+    // Terms of the Lyman continuum that only depend on z
+    double zLAF1 = pow(zp1, -.9);
+    double zLAF2 = pow(zp1, 1.6);
+    double zLAF3 = pow(zp1, 3.4);
+    double zDLA1 = pow(zp1, 2.);
+    double zDLA2 = pow(zp1, 2.3);
+    double zDLA3 = pow(zp1, 3.);
+    double zDLA4 = pow(zp1, 3.3);
+
+    // Lyman series
+    for(i = 0; i < nWaves; ++i)
+        absorption[i] = 0.;
+    for(j = 0; j < NLYMAN; ++j) {
+        lineWave = g_LymanSeries[j];
+        for(i = 0; i < nWaves; ++i) {
+            ratio = obsWaves[i]/lineWave;
+            if (ratio >= zp1)
+                continue;
+            tau = absorption[i];
+            // LAF terms
+            if (ratio < 2.2)
+                tau += g_LAF1[j]*pow(ratio, 1.2);
+            else if (ratio < 5.7)
+                tau += g_LAF2[j]*pow(ratio, 3.7);
+            else
+                tau += g_LAF3[j]*pow(ratio, 5.5);
+            // DLA terms
+            if (ratio < 3.)
+                tau += g_DLA1[j]*pow(ratio, 2.);
+            else
+                tau += g_DLA2[j]*pow(ratio, 3.);
+            absorption[i] = tau;
+        }
+    }
+    // Lyman continuum
+    for(i = 0; i < nWaves; ++i) {
+        tau = absorption[i];
+        ratio = obsWaves[i]/912.;
+        // LAF terms
+        if (z < 1.2) {
+            if (ratio < zp1)
+                tau += .325*(pow(ratio, 1.2) - zLAF1*pow(ratio, 2.1));
+        }
+        else if (z < 4.7) {
+            if (ratio < 2.2)
+                tau += 2.55e-2*zLAF2*pow(ratio, 2.1) + .325*pow(ratio, 1.2) 
+                       - .25*pow(ratio, 2.1);
+            else if (ratio < zp1)
+                tau += 2.55e-2*(zLAF2*pow(ratio, 2.1) - pow(ratio, 3.7));
+        }
+        else {
+            if (ratio < 2.2)
+                tau += 5.22e-4*zLAF3*pow(ratio, 2.1) + .325*pow(ratio, 1.2) 
+                       - 3.14e-2*pow(ratio, 2.1);
+            else if (ratio < 5.7)
+                tau += 5.22e-4*zLAF3*pow(ratio, 2.1) + .218*pow(ratio, 2.1) 
+                       - 2.55e-2*pow(ratio, 3.7);
+            else if (ratio < zp1)
+                tau += 5.22e-4*(zLAF3*pow(ratio, 2.1) - pow(ratio, 5.5));
+        }
+        // DLA terms
+        if (z < 2.) {
+            if (ratio < zp1)
+                tau += .211*zDLA1 - 7.66e-2*zDLA2*pow(ratio, -.3) - .135*pow(ratio, 2.);
+        }
+        else {
+            if (ratio < 3.)
+                tau += .634 + 4.7e-2*zDLA3 - 1.78e-2*zDLA4*pow(ratio, -.3) 
+                       - .135*pow(ratio, 2.) - .291*pow(ratio, -.3);
+            else if (ratio < zp1)
+                tau += 4.7e-2*zDLA3 - 1.78e-2*zDLA4*pow(ratio, -.3) 
+                       - 2.92e-2*pow(ratio, 3.);
+        }
+        absorption[i] = exp(-tau);
+    }
+}
+
+
+void Lyman_absorption_table(double *restWaves, int nWaves, 
+                            double zMin, double dz, int nZ, 
+                            double *table, short nThread) {
+    /* Tabulate the transmission of the IGM at redshifts zMin + iZ*dz
+     *
+     * The table is given in the rest frame, i.e. table[iZ*nWaves + iW] is 
+     * the transmission at (1 + z)*restWaves[iW]. The transmission of each 
+     * Lyman line jumps at a fixed rest frame wavelength, so that the table
+     * can be interpolated along redshifts without smearing the jumps.
+     */
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(restWaves, nWaves, zMin, dz, nZ, table) \
+    num_threads(nThread)
+    {
+        int iZ, iW;
+        double z;
+        double *obsWaves = malloc(nWaves*sizeof(double));
+
+        #pragma omp for schedule(static)
+        for(iZ = 0; iZ < nZ; ++iZ) {
+            z = zMin + iZ*dz;
+            for(iW = 0; iW < nWaves; ++iW)
+                obsWaves[iW] = (1. + z)*restWaves[iW];
+            Lyman_absorption_cext(obsWaves, nWaves, z, table + (size_t)iZ*nWaves);
+        }
+        free(obsWaves);
     }
+}
+
 
-    double R = sqrt(1. - ssRes/ssTot);
+void Lyman_absorption_interp(double *table, int nWaves, 
+                             double zMin, double dz, int nZ,
+                             double *z, int nGal, double *absorption,
+                             short nThread) {
+    /* Interpolate the table given by Lyman_absorption_table linearly
+     * along redshifts
+     *
+     * absorption[iG*nWaves + iW] is the transmission at (1 + z[iG])*restWaves[iW]
+     */
+    int iG;
+    for(iG = 0; iG < nGal; ++iG)
+        if (z[iG] < zMin || z[iG] > zMin + (nZ - 1)*dz) {
+            printf("Error: Redshift %10.5e is beyond the IGM table\n", z[iG]);
+            exit(0);
+        }
 
-    struct linResult result;
-    result.slope = slope;
-    result.intercept = intercept;
-    result.R = R;
-    return result;
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(table, nWaves, zMin, dz, nZ, z, nGal, absorption) \
+    num_threads(nThread)
+    {
+        int iG, iW, iZ;
+        double w;
+        double *pData0, *pData1, *pOutput;
+
+        #pragma omp for schedule(static)
+        for(iG = 0; iG < nGal; ++iG) {
+            w = (z[iG] - zMin)/dz;
+            iZ = (int)w;
+            if (iZ > nZ - 2)
+                iZ = nZ - 2;
+            w -= iZ;
+            pData0 = table + (size_t)iZ*nWaves;
+            pData1 = pData0 + nWaves;
+            pOutput = absorption + (size_t)iG*nWaves;
+            #pragma omp simd
+            for(iW = 0; iW < nWaves; ++iW)
+                pOutput[iW] = pData0[iW] + (pData1[iW] - pData0[iW])*w;
+        }
+    }
 }
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
  *                                                                             *
- * Struct to store galaxy properites                                           *
+ * Functions to trace galaxy properites                                         *
  *                                                                             *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 struct props {
@@ -265,357 +679,2184 @@ struct props {
     float sfr;
 };
 
-struct prop_set {
-   struct props *nodes;
-   int nNode;
+// Progenitors of a set of galaxies stored in one contiguous arena
+// Progenitors of galaxy iG are nodes[offsets[iG]] to nodes[offsets[iG + 1] - 1]
+// If the arena is memory-mapped from a file, mapping is the start of the
+// mapped region; otherwise it is NULL
+struct gal_props {
+    int nGal;
+    long long *offsets;
+    struct props *nodes;
+    void *mapping;
+    size_t mapSize;
 };
 
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- *                                                                             *
- * Functions to process SEDs                                                   *
- *                                                                             *
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-// Struct for SED templates
-struct sed_params {
-    double *Z;
-    int nZ;
-    int minZ;
-    int maxZ;
-    double *waves;
-    int nWaves;
-    double *age;
-    int nAge;
-    double *data;
-};
+void free_gal_props(struct gal_props *galProps) {
+    if (galProps->mapping != NULL)
+        munmap(galProps->mapping, galProps->mapSize);
+    else {
+        free(galProps->offsets);
+        free(galProps->nodes);
+    }
+    free(galProps);
+}
 
-// Struct for SED templates after processing
-struct tmp_params {
-    int nAgeList;
-    double *ageList;
-    double *integrated;
-    double *ready;
-    double *working;
+
+// Stack of (snapshot, galaxy index) pairs to walk merger trees
+struct trace_stack {
+    int *data;
+    int size;
+    int capacity;
 };
 
-struct tmp_params *g_spectra = NULL;
 
-struct tmp_params *init_template(struct sed_params *rawSpectra, 
-                                 double *ageList, int nAgeList,
-                                 int nFlux) {
-    size_t intFluxSize = rawSpectra->nZ*nAgeList*rawSpectra->nWaves*sizeof(double);
-    size_t workingSize = (rawSpectra->maxZ + 1)*nAgeList*nFlux*sizeof(double);
-    struct tmp_params *spectra = malloc(sizeof(struct tmp_params));
-    spectra->ageList = ageList;
-    spectra->nAgeList = nAgeList;
-    spectra->integrated = (double*)malloc(intFluxSize);
-    spectra->ready = (double*)malloc(intFluxSize);
-    spectra->working = (double*)malloc(workingSize);
-    return spectra;
+inline void trace_push(struct trace_stack *stack, int snap, int galIdx) {
+    if (stack->size == stack->capacity) {
+        stack->capacity *= 2;
+        stack->data = realloc(stack->data, 2*stack->capacity*sizeof(int));
+    }
+    stack->data[2*stack->size] = snap;
+    stack->data[2*stack->size + 1] = galIdx;
+    ++stack->size;
 }
 
 
-void free_spectra(void) {
-    free(g_spectra->integrated);
-    free(g_spectra->ready);
-    free(g_spectra->working);
-    free(g_spectra);
-    g_spectra = NULL;
-}
+// Histories traced at an earlier snapshot, which can be reused by their
+// descendants. lookup[galIdx] is the position of galaxy galIdx in prevProps,
+// or -1 if the galaxy was not traced
+struct trace_reuse {
+    int prevSnap;
+    int nLookup;
+    int *lookup;
+    struct gal_props *prevProps;
+};
 
 
-void templates_time_integration(struct sed_params *rawSpectra, 
-                                double *ageList, int nAgeList) {
-    int iA, iW, iZ;
-    double *pData;
+long long trace_galaxy(int **firstProgenitor, int **nextProgenitor,
+                       float **galMetals, float **galSFR,
+                       int tSnap, int galIdx, struct trace_reuse *reuse,
+                       struct props *nodes, struct trace_stack *stack) {
+    /* Walk the merger tree of a galaxy and store progenitors that have 
+     * non-zero star formation rates. The order of the progenitors is 
+     * first the galaxy itself, then the first progenitor and its history, 
+     * then the next progenitor and its history, and so on.
+     *
+     * If reuse is not NULL, the walk stops at galaxies that have been traced
+     * at reuse->prevSnap, and their histories are copied with the index 
+     * shifted by tSnap - reuse->prevSnap. Since the history of a galaxy 
+     * at its own snapshot excludes its next progenitors, the copied block 
+     * is exactly the part of the walk that it replaces.
+     *
+     * If nodes is NULL, only count progenitors.
+     *
+     * Return: number of progenitors
+     */
+    long long nNode = 0;
+    struct props *pNodes;
+    struct props *pPrev;
+    long long iN, nPrev;
+    int iPrev;
+    short shift;
+    int snap;
+    float sfr;
 
-    int nAge;
-    double *age;
-    int nWaves; 
-    int nZ;
-    double *data;
-    // Spectra after integration over time
-    // The first dimension refers to metallicites and ages
-    // The last dimension refers to wavelengths
-    double *intData;
-    
-    #ifdef TIMING
-        timing_start("Integrate SED templates over time\n");
-    #endif
-    nAge = rawSpectra->nAge;
-    age = rawSpectra->age;
-    nWaves = rawSpectra->nWaves; 
-    nZ = rawSpectra->nZ;
-    data = rawSpectra->data;
-    intData = g_spectra->integrated;
-    for(iZ = 0; iZ < nZ; ++iZ) 
-        for(iA = 0; iA < nAgeList; ++iA) {
-            pData = intData + (iZ*nAgeList + iA)*nWaves;
-            for(iW = 0; iW < nWaves; ++iW) {
-                if (iA == 0) 
-                    // The first time step of SED templates is typicall not zero
-                    // Here assumes that the templates is zero beween zero
-                    // and the first time step
-                    pData[iW] = trapz_table(data + (iZ*nWaves + iW)*nAge, age, nAge, 
-                                            age[0], ageList[iA]);
-                else
-                    pData[iW] = trapz_table(data + (iZ*nWaves + iW)*nAge, age, nAge, 
-                                            ageList[iA - 1], ageList[iA]);
+    stack->size = 0;
+    trace_push(stack, tSnap, galIdx);
+    while(stack->size > 0) {
+        --stack->size;
+        snap = stack->data[2*stack->size];
+        galIdx = stack->data[2*stack->size + 1];
+        if (reuse != NULL && snap == reuse->prevSnap && galIdx < reuse->nLookup 
+            && reuse->lookup[galIdx] >= 0) {
+            iPrev = reuse->lookup[galIdx];
+            pPrev = reuse->prevProps->nodes + reuse->prevProps->offsets[iPrev];
+            nPrev = reuse->prevProps->offsets[iPrev + 1] 
+                    - reuse->prevProps->offsets[iPrev];
+            if (nodes != NULL) {
+                shift = tSnap - snap;
+                pNodes = nodes + nNode;
+                for(iN = 0; iN < nPrev; ++iN) {
+                    pNodes[iN] = pPrev[iN];
+                    pNodes[iN].index += shift;
+                }
             }
+            nNode += nPrev;
+            if (snap < tSnap && nextProgenitor[snap][galIdx] >= 0)
+                trace_push(stack, snap, nextProgenitor[snap][galIdx]);
+            continue;
         }
-    memcpy(g_spectra->ready, g_spectra->integrated, nZ*nAgeList*nWaves*sizeof(double));
-    #ifdef TIMING
-        timing_end();
-    #endif
+        sfr = galSFR[snap][galIdx];
+        if (sfr > 0.) {
+            if (nodes != NULL) {
+                pNodes = nodes + nNode;
+                pNodes->index = tSnap - snap;
+                pNodes->metals = galMetals[snap][galIdx];
+                pNodes->sfr = sfr;
+            }
+            ++nNode;
+        }
+        // The first progenitor is visited before the next progenitor
+        // Next progenitors of the target galaxy are not included
+        if (snap < tSnap && nextProgenitor[snap][galIdx] >= 0)
+            trace_push(stack, snap, nextProgenitor[snap][galIdx]);
+        if (firstProgenitor[snap][galIdx] >= 0)
+            trace_push(stack, snap - 1, firstProgenitor[snap][galIdx]);
+    }
+    return nNode;
 }
- 
-
-struct dust_params {
-    double tauUV_ISM;
-    double nISM;
-    double tauUV_BC;
-    double nBC;
-    double tBC;
-};
 
 
-inline double *dust_absorption(struct sed_params *rawSpectra, struct dust_params *dustArgs) {
-    /* tBC: life time of the birth clound
-     * nu: fraction of ISM dust absorption
-     * tauUV: V-band absorption optical depth
-     * nBC: power law index of tauBC
-     * nISM: power law index of tauISM
-     * 
-     * Reference: da Cunha et al. 2008
+struct gal_props *trace_progenitors_incremental(int **firstProgenitor, int **nextProgenitor,
+                                                float **galMetals, float **galSFR,
+                                                int tSnap, int *indices, int nGal, 
+                                                int prevSnap, int *prevIndices,
+                                                struct gal_props *prevProps,
+                                                short nThread) {
+    /* Trace progenitors of galaxies in parallel
+     *
+     * Progenitors are counted in the first pass, and then written into 
+     * one arena in the second pass.
+     *
+     * If prevProps is not NULL, it should be the progenitors of galaxies 
+     * prevIndices at snapshot prevSnap <= tSnap. Their histories are reused 
+     * rather than walked again, such that a list of snapshots in ascending 
+     * order can be traced by walking each part of the forest only once.
      */
-    
-    int nRawAge = rawSpectra->nAge;
-    double *rawAge = rawSpectra->age;
-    double *rawData = rawSpectra->data;
-    int nWaves = rawSpectra->nWaves;
-    double *waves = rawSpectra->waves;
-    int nZ = rawSpectra->nZ;
+    int iG;
+    long long *offsets = malloc((nGal + 1)*sizeof(long long));
+    struct props *nodes;
+    struct gal_props *galProps = malloc(sizeof(struct gal_props));
+    struct trace_reuse reuseData;
+    struct trace_reuse *reuse = NULL;
+
+    if (prevProps != NULL) {
+        if (prevSnap > tSnap) {
+            printf("Error: snapshot %d cannot reuse progenitors at snapshot %d\n",
+                   tSnap, prevSnap);
+            exit(0);
+        }
+        reuseData.prevSnap = prevSnap;
+        reuseData.nLookup = 0;
+        for(iG = 0; iG < prevProps->nGal; ++iG)
+            if (prevIndices[iG] >= reuseData.nLookup)
+                reuseData.nLookup = prevIndices[iG] + 1;
+        reuseData.lookup = malloc((reuseData.nLookup > 0 ? reuseData.nLookup : 1)*sizeof(int));
+        for(iG = 0; iG < reuseData.nLookup; ++iG)
+            reuseData.lookup[iG] = -1;
+        for(iG = 0; iG < prevProps->nGal; ++iG)
+            reuseData.lookup[prevIndices[iG]] = iG;
+        reuseData.prevProps = prevProps;
+        reuse = &reuseData;
+    }
 
-    int nAge = g_spectra->nAgeList;
-    double *age = g_spectra->ageList;
-    memcpy(g_spectra->ready, g_spectra->integrated, nZ*nAge*nWaves*sizeof(double));
-    double *data = g_spectra->ready;
+    offsets[0] = 0;
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(firstProgenitor, nextProgenitor, galMetals, galSFR, \
+                 tSnap, indices, nGal, reuse, offsets) \
+    num_threads(nThread)
+    {
+        int iG;
+        struct trace_stack stack;
+        stack.size = 0;
+        stack.capacity = 1024;
+        stack.data = malloc(2*stack.capacity*sizeof(int));
+
+        #pragma omp for schedule(dynamic, 16)
+        for(iG = 0; iG < nGal; ++iG)
+            offsets[iG + 1] = trace_galaxy(firstProgenitor, nextProgenitor, 
+                                           galMetals, galSFR, tSnap, indices[iG], 
+                                           reuse, NULL, &stack);
+        free(stack.data);
+    }
+    for(iG = 0; iG < nGal; ++iG) {
+        if (offsets[iG + 1] == 0) {
+            printf("Warning: snapshot %d, index %d\n", tSnap, indices[iG]);
+            printf("         the star formation rate is zero throughout the histroy\n");
+        }
+        offsets[iG + 1] += offsets[iG];
+    }
 
-    int iAgeBC;
-    double t0, t1;
+    // Zero the padding of nodes so that saved files are reproducible
+    nodes = calloc(offsets[nGal] > 0 ? offsets[nGal] : 1, sizeof(struct props));
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(firstProgenitor, nextProgenitor, galMetals, galSFR, \
+                 tSnap, indices, nGal, reuse, offsets, nodes) \
+    num_threads(nThread)
+    {
+        int iG;
+        struct trace_stack stack;
+        stack.size = 0;
+        stack.capacity = 1024;
+        stack.data = malloc(2*stack.capacity*sizeof(int));
+
+        #pragma omp for schedule(dynamic, 16)
+        for(iG = 0; iG < nGal; ++iG)
+            trace_galaxy(firstProgenitor, nextProgenitor, galMetals, galSFR, 
+                         tSnap, indices[iG], reuse, nodes + offsets[iG], &stack);
+        free(stack.data);
+    }
+    if (reuse != NULL)
+        free(reuse->lookup);
+
+    galProps->nGal = nGal;
+    galProps->offsets = offsets;
+    galProps->nodes = nodes;
+    galProps->mapping = NULL;
+    galProps->mapSize = 0;
+    return galProps;
+}
 
-    double tauUV_ISM = dustArgs->tauUV_ISM;
-    double nISM = dustArgs->nISM;
-    double tauUV_BC = dustArgs->tauUV_BC;
-    double nBC = dustArgs->nBC;
-    double tBC = dustArgs->tBC;
 
-    double *transISM = malloc(nWaves*sizeof(double));
-    double *transBC = malloc(nWaves*sizeof(double));
+struct gal_props *trace_progenitors(int **firstProgenitor, int **nextProgenitor,
+                                    float **galMetals, float **galSFR,
+                                    int tSnap, int *indices, int nGal, short nThread) {
+    return trace_progenitors_incremental(firstProgenitor, nextProgenitor, 
+                                         galMetals, galSFR, tSnap, indices, nGal,
+                                         -1, NULL, NULL, nThread);
+}
 
-    // Find the time inverval containning the birth cloud
-    if (tBC >= age[nAge - 1]) {
-        iAgeBC = nAge;
-        t0 = 0.;
-        t1 = 0.;
-    }
-    else if(tBC < age[0]) {
-        iAgeBC = 0;
-        t0 = rawAge[0];
-        t1 = age[0];
-    }
-    else {
-        iAgeBC = bisection_search(tBC, age, nAge) + 1;
-        t0 = age[iAgeBC - 1];
-        t1 = age[iAgeBC];
-    } 
-    
-    // Compute the optical depth of both the birth cloud and the ISM
+
+void count_progenitors(int **firstProgenitor, int **nextProgenitor, float **galSFR,
+                       int tSnap, int *indices, int nGal, long long *counts, short nThread) {
+    /* Count progenitors of galaxies without storing them, which gives the
+     * cost of each galaxy before the histories are traced
+     */
     #pragma omp parallel \
     default(none) \
-    firstprivate(nRawAge, rawAge, rawData, \
-                 nWaves, waves, nZ, nAge, age, data, \
-                 iAgeBC, t0, t1, \
-                 tauUV_ISM, nISM, tauUV_BC, nBC, tBC, \
-                 transISM, transBC) \
-    num_threads(g_nThread)
+    firstprivate(firstProgenitor, nextProgenitor, galSFR, tSnap, indices, nGal, counts) \
+    num_threads(nThread)
     {
-        int iW, i, n;
-        double *pData; 
-        double ratio;        
-        
-        #pragma omp for schedule(static,1)
-        for(iW = 0; iW < nWaves; ++iW) {
-            ratio = waves[iW]/1600.;
-            transISM[iW] = exp(-tauUV_ISM*pow(ratio, nISM));
-            transBC[iW] = exp(-tauUV_BC*pow(ratio, nBC));
-        }
-        
-        // t_s < tBC < t_s + dt
-        if (iAgeBC != nAge) {
-            n = nZ*nWaves;
-            #pragma omp for schedule(static,1) 
-            for(i = 0; i < n; ++i) {
-                iW = i%nWaves;
-                pData = data + (i/nWaves*nAge + iAgeBC)*nWaves;
-                pData[iW] = transBC[iW] \
-                    *trapz_table(rawData + i*nRawAge, rawAge, nRawAge, t0, tBC) \
-                    + trapz_table(rawData + i*nRawAge, rawAge, nRawAge, tBC, t1);
-            }     
-        }
-        
-        // tBC > t_s       
-        n = iAgeBC*nZ;
-        #pragma omp for schedule(static,1) 
-        for(i = 0; i < n; ++i) {
-            pData = data + (i/iAgeBC*nAge + i%iAgeBC)*nWaves;
-            for(iW = 0; iW < nWaves; ++iW) 
-                pData[iW] *= transBC[iW];
-        }
-        
-        n = nAge*nZ;
-        #pragma omp for schedule(static,1) 
-        for(i = 0; i < n; ++i) {
-            pData = data + i*nWaves;
-            for(iW = 0; iW < nWaves; ++iW) 
-                pData[iW] *= transISM[iW];
-        }
+        int iG;
+        struct trace_stack stack;
+        stack.size = 0;
+        stack.capacity = 1024;
+        stack.data = malloc(2*stack.capacity*sizeof(int));
+
+        #pragma omp for schedule(dynamic, 16)
+        for(iG = 0; iG < nGal; ++iG)
+            counts[iG] = trace_galaxy(firstProgenitor, nextProgenitor, NULL, galSFR,
+                                      tSnap, indices[iG], NULL, NULL, &stack);
+        free(stack.data);
     }
+}
 
-    free(transISM);
-    free(transBC);
-    
-    return data;
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                             *
+ * Functions to store star formation histories                                 *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Layout of SFH files (version 1), in native byte order:
+ *
+ * struct sfh_header
+ * int indices[nGal], padded to a multiple of 8 bytes
+ * long long offsets[nGal + 1]
+ * struct props nodes[nNode]
+ *
+ * The offsets and the nodes have the same layout as struct gal_props, so 
+ * the file can be memory-mapped without any copy.
+ */
+#define SFH_MAGIC "MAGCALC_SFH"
+#define SFH_VERSION 1
+
+struct sfh_header {
+    char magic[12];
+    int version;
+    int nGal;
+    int nodeSize;
+    long long nNode;
+};
+
+
+inline size_t sfh_indices_size(int nGal) {
+    return (nGal*sizeof(int) + 7)/8*8;
 }
 
 
-inline void templates_working(struct sed_params *rawSpectra, 
-                              double *LyAbsorption, double z, 
-                              double *filters, int nFlux, int nObs) {
-    int nWaves = rawSpectra->nWaves;
-    double *waves = rawSpectra->waves;
-    int nZ = rawSpectra->nZ;
+void save_gal_props(char *fName, struct gal_props *galProps, int *indices) {
+    /* Save progenitors and galaxy indices to a SFH file */
+    int nGal = galProps->nGal;
+    long long *offsets = galProps->offsets;
+    long long nNode = offsets[nGal] - offsets[0];
+    long long *fileOffsets = malloc((nGal + 1)*sizeof(long long));
+    size_t indicesSize = sfh_indices_size(nGal);
+    char *pIndices = calloc(indicesSize > 0 ? indicesSize : 1, 1);
+    struct sfh_header header;
+    int iG;
+    FILE *fp = open_file(fName, "wb");
+
+    memset(&header, 0, sizeof(struct sfh_header));
+    memcpy(header.magic, SFH_MAGIC, sizeof(SFH_MAGIC));
+    header.version = SFH_VERSION;
+    header.nGal = nGal;
+    header.nodeSize = sizeof(struct props);
+    header.nNode = nNode;
+    memcpy(pIndices, indices, nGal*sizeof(int));
+    // Offsets in the file always start from zero
+    for(iG = 0; iG <= nGal; ++iG)
+        fileOffsets[iG] = offsets[iG] - offsets[0];
+
+    fwrite(&header, sizeof(struct sfh_header), 1, fp);
+    fwrite(pIndices, 1, indicesSize, fp);
+    fwrite(fileOffsets, sizeof(long long), nGal + 1, fp);
+    fwrite(galProps->nodes + offsets[0], sizeof(struct props), nNode, fp);
+    fclose(fp);
+    free(fileOffsets);
+    free(pIndices);
+}
 
-    int nAge = g_spectra->nAgeList;
-    double *readyData = g_spectra->ready;
-    double *workingData = g_spectra->working;
 
+#define LEGACY_NODE_SIZE (sizeof(short) + 2*sizeof(float))
+
+int legacy_node_count(char *p, char *end, char *fName) {
+    /* Return the number of nodes of the galaxy at p in a SFH file written
+     * before version 1. The count and the nodes should fit before end.
+     */
+    int nNode;
+    if (end - p < (long)sizeof(int)) {
+        printf("Error: \"%s\" is truncated or corrupt\n", fName);
+        exit(0);
+    }
+    memcpy(&nNode, p, sizeof(int));
+    if (nNode < 0 || (size_t)(end - p - sizeof(int))/LEGACY_NODE_SIZE < (size_t)nNode) {
+        printf("Error: \"%s\" is truncated or corrupt\n", fName);
+        exit(0);
+    }
+    return nNode;
+}
+
+
+struct gal_props *read_gal_props_legacy(char *fName, int iStart, int nGal) {
+    /* Read SFH files written before version 1
+     *
+     * The layout is int nGal, int indices[nGal], and then for each galaxy
+     * int nNode followed by nNode packed (short, float, float) records.
+     */
+    FILE *fp = open_file(fName, "rb");
+    long fileSize;
+    char *buffer, *p, *end;
+    int iG, iN, nTotal, nNode;
+    long long *offsets;
+    struct props *pNodes;
+    struct gal_props *galProps = malloc(sizeof(struct gal_props));
+
+    fseek(fp, 0, SEEK_END);
+    fileSize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buffer = malloc(fileSize);
+    if (fread(buffer, 1, fileSize, fp) != (size_t)fileSize) {
+        printf("File read error: \"%s\"!\n", fName);
+        exit(0);
+    }
+    fclose(fp);
+    end = buffer + fileSize;
+
+    if (fileSize < (long)sizeof(int)) {
+        printf("Error: \"%s\" is truncated or corrupt\n", fName);
+        exit(0);
+    }
+    memcpy(&nTotal, buffer, sizeof(int));
+    if (nTotal < 0 || (1LL + nTotal)*(long long)sizeof(int) > (long long)fileSize) {
+        printf("Error: \"%s\" is truncated or corrupt\n", fName);
+        exit(0);
+    }
+    if (iStart < 0 || iStart > nTotal) {
+        printf("Error: galaxy %d is out of the range of \"%s\" with %d galaxies\n", 
+               iStart, fName, nTotal);
+        exit(0);
+    }
+    if (nGal < 0 || iStart + nGal > nTotal)
+        nGal = nTotal - iStart;
+    // Skip galaxy indices and galaxies before iStart
+    p = buffer + (1 + nTotal)*sizeof(int);
+    for(iG = 0; iG < iStart; ++iG) {
+        nNode = legacy_node_count(p, end, fName);
+        p += sizeof(int) + nNode*LEGACY_NODE_SIZE;
+    }
+    // Count progenitors
+    offsets = malloc((nGal + 1)*sizeof(long long));
+    offsets[0] = 0;
+    char *pStart = p;
+    for(iG = 0; iG < nGal; ++iG) {
+        nNode = legacy_node_count(p, end, fName);
+        offsets[iG + 1] = offsets[iG] + nNode;
+        p += sizeof(int) + nNode*LEGACY_NODE_SIZE;
+    }
+    // Unpack nodes
+    pNodes = calloc(offsets[nGal] > 0 ? offsets[nGal] : 1, sizeof(struct props));
+    galProps->nodes = pNodes;
+    p = pStart;
+    for(iG = 0; iG < nGal; ++iG) {
+        p += sizeof(int);
+        for(iN = 0; iN < offsets[iG + 1] - offsets[iG]; ++iN) {
+            memcpy(&pNodes->index, p, sizeof(short));
+            p += sizeof(short);
+            memcpy(&pNodes->metals, p, sizeof(float));
+            p += sizeof(float);
+            memcpy(&pNodes->sfr, p, sizeof(float));
+            p += sizeof(float);
+            ++pNodes;
+        }
+    }
+    free(buffer);
+
+    galProps->nGal = nGal;
+    galProps->offsets = offsets;
+    galProps->mapping = NULL;
+    galProps->mapSize = 0;
+    return galProps;
+}
+
+
+struct gal_props *read_gal_props(char *fName, int iStart, int nGal) {
+    /* Memory-map galaxies from iStart to iStart + nGal - 1 in a SFH file
+     *
+     * If nGal is negative, read all galaxies after iStart. Files written 
+     * before version 1 are read into memory instead.
+     */
+    int fd;
+    struct stat st;
+    void *mapping;
+    struct sfh_header *header;
+    char *pData;
+    long long dataSize;
+    long long *fileOffsets;
+    struct gal_props *galProps;
+    int iG;
+
+    if ((fd = open(fName, O_RDONLY)) < 0) {
+        printf("File open error: \"%s\"!\n", fName);
+        exit(0);
+    }
+    if (fstat(fd, &st) != 0) {
+        printf("File stat error: \"%s\"!\n", fName);
+        exit(0);
+    }
+    if (st.st_size < (off_t)sizeof(struct sfh_header)) {
+        close(fd);
+        return read_gal_props_legacy(fName, iStart, nGal);
+    }
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        printf("File map error: \"%s\"!\n", fName);
+        exit(0);
+    }
+    header = (struct sfh_header*)mapping;
+    if (memcmp(header->magic, SFH_MAGIC, sizeof(SFH_MAGIC)) != 0) {
+        munmap(mapping, st.st_size);
+        return read_gal_props_legacy(fName, iStart, nGal);
+    }
+    if (header->version != SFH_VERSION || header->nodeSize != sizeof(struct props)) {
+        printf("Error: \"%s\" has version %d and node size %d\n", 
+               fName, header->version, header->nodeSize);
+        exit(0);
+    }
+    // The file should hold all galaxies and nodes given by the header
+    dataSize = header->nGal < 0 || header->nNode < 0 ? -1 :
+               (long long)(sizeof(struct sfh_header) + sfh_indices_size(header->nGal))
+               + (header->nGal + 1LL)*(long long)sizeof(long long)
+               + header->nNode*(long long)sizeof(struct props);
+    if (dataSize < 0 || dataSize > (long long)st.st_size) {
+        printf("Error: \"%s\" is truncated or corrupt\n", fName);
+        exit(0);
+    }
+    pData = (char*)mapping + sizeof(struct sfh_header) + sfh_indices_size(header->nGal);
+    fileOffsets = (long long*)pData;
+    if (fileOffsets[0] != 0 || fileOffsets[header->nGal] != header->nNode) {
+        printf("Error: \"%s\" is truncated or corrupt\n", fName);
+        exit(0);
+    }
+    if (iStart < 0 || iStart > header->nGal) {
+        printf("Error: galaxy %d is out of the range of \"%s\" with %d galaxies\n", 
+               iStart, fName, header->nGal);
+        exit(0);
+    }
+    if (nGal < 0 || iStart + nGal > header->nGal)
+        nGal = header->nGal - iStart;
+    // Offsets of the selected galaxies should index nodes within the file
+    if (fileOffsets[iStart] < 0 || fileOffsets[iStart + nGal] > header->nNode) {
+        printf("Error: \"%s\" is truncated or corrupt\n", fName);
+        exit(0);
+    }
+    for(iG = iStart; iG < iStart + nGal; ++iG)
+        if (fileOffsets[iG + 1] < fileOffsets[iG]) {
+            printf("Error: \"%s\" is truncated or corrupt\n", fName);
+            exit(0);
+        }
+
+    galProps = malloc(sizeof(struct gal_props));
+    galProps->nGal = nGal;
+    galProps->offsets = (long long*)pData + iStart;
+    galProps->nodes = (struct props*)(pData + (header->nGal + 1)*sizeof(long long));
+    galProps->mapping = mapping;
+    galProps->mapSize = st.st_size;
+    return galProps;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                             *
+ * Functions to process SEDs                                                   *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// Struct for SED templates
+struct sed_params {
+    double *Z;
+    int nZ;
+    int minZ;
+    int maxZ;
+    double *waves;
+    int nWaves;
+    double *age;
+    int nAge;
+    // Ages are contiguous in data, and strides of metallicities and 
+    // wavelengths are given, so that data can be a window of a larger array
+    double *data;
+    long long strideZ;
+    long long strideWaves;
+};
+
+// Struct for SED templates after processing
+// SED templates and their cumulative integrals over the raw age axis
+// The first dimension refers to metallicites and ages
+// The last dimension refers to wavelengths
+// In single precision, only dataF and cumulativeF are kept, and data and
+// cumulative are NULL
+struct cum_templates {
+    int nZ;
+    int nAge;
+    int nWaves;
+    double *age;
+    double *data;
+    double *cumulative;
+    float *dataF;
+    float *cumulativeF;
+};
+
+
+struct cum_templates *init_cum_templates(struct sed_params *rawSpectra) {
+    /* Transpose SED templates such that wavelengths are contiguous, and 
+     * integrate them from the first raw age using the trapezoidal rule
+     */
+    int iZ, iA, iW;
+    int nZ = rawSpectra->nZ;
+    int nAge = rawSpectra->nAge;
+    int nWaves = rawSpectra->nWaves;
+    double *age = rawSpectra->age;
+    double *rawData = rawSpectra->data;
+    long long strideZ = rawSpectra->strideZ;
+    long long strideWaves = rawSpectra->strideWaves;
+    size_t tableSize = (size_t)nZ*nAge*nWaves*sizeof(double);
+    struct cum_templates *cumSpectra = malloc(sizeof(struct cum_templates));
+    double *data = malloc(tableSize);
+    double *cumulative = malloc(tableSize);
+    double *pData, *pCum;
+    double halfWidth;
+
+    for(iZ = 0; iZ < nZ; ++iZ)
+        for(iW = 0; iW < nWaves; ++iW)
+            for(iA = 0; iA < nAge; ++iA)
+                data[(iZ*nAge + iA)*nWaves + iW] = rawData[iZ*strideZ + iW*strideWaves + iA];
+
+    for(iZ = 0; iZ < nZ; ++iZ) {
+        pData = data + iZ*nAge*nWaves;
+        pCum = cumulative + iZ*nAge*nWaves;
+        for(iW = 0; iW < nWaves; ++iW)
+            pCum[iW] = 0.;
+        for(iA = 1; iA < nAge; ++iA) {
+            halfWidth = (age[iA] - age[iA - 1])/2.;
+            for(iW = 0; iW < nWaves; ++iW)
+                pCum[iA*nWaves + iW] = pCum[(iA - 1)*nWaves + iW] \
+                                       + halfWidth*(pData[(iA - 1)*nWaves + iW] 
+                                                    + pData[iA*nWaves + iW]);
+        }
+    }
+
+    cumSpectra->nZ = nZ;
+    cumSpectra->nAge = nAge;
+    cumSpectra->nWaves = nWaves;
+    cumSpectra->age = age;
+    cumSpectra->data = data;
+    cumSpectra->cumulative = cumulative;
+    cumSpectra->dataF = NULL;
+    cumSpectra->cumulativeF = NULL;
+    return cumSpectra;
+}
+
+
+void free_cum_templates(struct cum_templates *cumSpectra) {
+    free(cumSpectra->data);
+    free(cumSpectra->cumulative);
+    free(cumSpectra->dataF);
+    free(cumSpectra->cumulativeF);
+    free(cumSpectra);
+}
+
+
+inline void cumulative_integral(struct cum_templates *cumSpectra, int iZ, double t, 
+                                double *output) {
+    /* Integrate SED templates of metallicity iZ from the first raw age to t
+     * for all wavelengths. The result is the same as trapz_table.
+     */
+    int iW;
+    int nAge = cumSpectra->nAge;
+    int nWaves = cumSpectra->nWaves;
+    double *age = cumSpectra->age;
+    int iA;
+    double *pCum, *pData0, *pData1;
+    double dt, w;
+
+    if (t < age[0] || t > age[nAge - 1]) {
+        printf("Error: Integration range %10.5e is beyond the tabular data\n", t);
+        exit(0);
+    }
+    iA = bisection_search(t, age, nAge);
+    dt = t - age[iA];
+    w = dt/(age[iA + 1] - age[iA]);
+    pCum = cumSpectra->cumulative + (iZ*nAge + iA)*nWaves;
+    pData0 = cumSpectra->data + (iZ*nAge + iA)*nWaves;
+    pData1 = pData0 + nWaves;
+    for(iW = 0; iW < nWaves; ++iW)
+        output[iW] = pCum[iW] + dt*(pData0[iW] + .5*(pData1[iW] - pData0[iW])*w);
+}
+
+
+// Integrated templates are owned by the caller if ownIntegrated is zero
+// cumSpectra is only used by the dust model
+// Filters are stored by their supports, since a filter is usually non-zero
+// over a small part of the wavelengths. Filter iF is non-zero from start[iF]
+// to start[iF] + size[iF] - 1, and weights[offsets[iF] + i] is the filter at
+// start[iF] + i multiplied by the weight of the trapezoidal rule. Weights of
+// observer frame filters also include the IGM absorption, and the factor 
+// 1/(1 + z) of the flux cancels with the factor 1 + z of the wavelength, so 
+// that all fluxes are weighted sums of the rest frame spectrum.
+#define FILTER_BLOCK 8 // Number of spectra integrated together
+
+struct sparse_filters {
+    int nFlux;
+    int *start;
+    int *size;
+    long long *offsets;
+    double *weights;
+};
+
+
+struct sparse_filters *init_sparse_filters(struct sed_params *rawSpectra, 
+                                           double *LyAbsorption, 
+                                           double *filters, int nFlux, int nObs) {
+    /* Convert filters in a nFlux x nWaves array to their supports and 
+     * weights. The last nObs filters are in the observer frame.
+     */
+    int iF, iW, iMin, iMax;
+    int nWaves = rawSpectra->nWaves;
+    int nRest = nFlux - nObs;
+    double *waves = rawSpectra->waves;
+    double *pFilter;
+    double *pWeights;
+    double dw;
+    struct sparse_filters *sparse = malloc(sizeof(struct sparse_filters));
+
+    sparse->nFlux = nFlux;
+    sparse->start = malloc(nFlux*sizeof(int));
+    sparse->size = malloc(nFlux*sizeof(int));
+    sparse->offsets = malloc((nFlux + 1)*sizeof(long long));
+    sparse->offsets[0] = 0;
+    for(iF = 0; iF < nFlux; ++iF) {
+        pFilter = filters + (size_t)iF*nWaves;
+        iMin = 0;
+        while(iMin < nWaves && pFilter[iMin] == 0.)
+            ++iMin;
+        iMax = nWaves - 1;
+        while(iMax > iMin && pFilter[iMax] == 0.)
+            --iMax;
+        sparse->start[iF] = iMin;
+        sparse->size[iF] = iMax - iMin + 1;
+        sparse->offsets[iF + 1] = sparse->offsets[iF] + sparse->size[iF];
+    }
+    sparse->weights = malloc((sparse->offsets[nFlux] > 0 ? sparse->offsets[nFlux] : 1)
+                             *sizeof(double));
+    for(iF = 0; iF < nFlux; ++iF) {
+        pFilter = filters + (size_t)iF*nWaves;
+        pWeights = sparse->weights + sparse->offsets[iF];
+        for(iW = sparse->start[iF]; iW < sparse->start[iF] + sparse->size[iF]; ++iW) {
+            dw = 0.;
+            if (iW > 0)
+                dw += waves[iW] - waves[iW - 1];
+            if (iW < nWaves - 1)
+                dw += waves[iW + 1] - waves[iW];
+            dw *= .5*pFilter[iW];
+            if (iF >= nRest && LyAbsorption != NULL)
+                dw *= LyAbsorption[iW];
+            *pWeights++ = dw;
+        }
+    }
+    return sparse;
+}
+
+
+void free_sparse_filters(struct sparse_filters *filters) {
+    free(filters->start);
+    free(filters->size);
+    free(filters->offsets);
+    free(filters->weights);
+    free(filters);
+}
+
+
+void filter_flux(struct sparse_filters *filters, double *spectra, double *flux) {
+    /* Integrate a spectrum over all filters */
+    int iF, iW;
+    int size;
+    double *pWeights;
+    double *pSpectra;
+    double sum;
+
+    for(iF = 0; iF < filters->nFlux; ++iF) {
+        size = filters->size[iF];
+        pWeights = filters->weights + filters->offsets[iF];
+        pSpectra = spectra + filters->start[iF];
+        sum = 0.;
+        for(iW = 0; iW < size; ++iW)
+            sum += pWeights[iW]*pSpectra[iW];
+        flux[iF] = sum;
+    }
+}
+
+
+void filter_block(struct sparse_filters *filters, double *spectra, int nSpectra, int nWaves,
+                  double *flux) {
+    /* Integrate nSpectra <= FILTER_BLOCK contiguous spectra over all filters
+     *
+     * This is a product of the spectra and the filter matrix, where each 
+     * weight is loaded once for the whole block. The flux of spectrum iS in
+     * filter iF is flux[iF*FILTER_BLOCK + iS].
+     */
+    int iF, iW, iS;
+    int size;
+    double w;
+    double *pWeights;
+    double *pSpectra;
+    double *pFlux;
+
+    for(iF = 0; iF < filters->nFlux; ++iF) {
+        size = filters->size[iF];
+        pWeights = filters->weights + filters->offsets[iF];
+        pSpectra = spectra + filters->start[iF];
+        pFlux = flux + iF*FILTER_BLOCK;
+        for(iS = 0; iS < FILTER_BLOCK; ++iS)
+            pFlux[iS] = 0.;
+        if (nSpectra == FILTER_BLOCK)
+            for(iW = 0; iW < size; ++iW) {
+                w = pWeights[iW];
+                for(iS = 0; iS < FILTER_BLOCK; ++iS)
+                    pFlux[iS] += w*pSpectra[iS*nWaves + iW];
+            }
+        else
+            for(iW = 0; iW < size; ++iW) {
+                w = pWeights[iW];
+                for(iS = 0; iS < nSpectra; ++iS)
+                    pFlux[iS] += w*pSpectra[iS*nWaves + iW];
+            }
+    }
+}
+
+
+// Arrays in single precision are only used by the single precision path,
+// and are NULL otherwise. A template kept in single precision is built in
+// double precision and then converted, and its double precision array is
+// NULL, except integrated templates owned by the caller
+struct tmp_params {
+    int nAgeList;
+    double *ageList;
+    double *integrated;
+    short ownIntegrated;
+    double *working;
+    short workingReady;
+    struct cum_templates *cumSpectra;
+    struct sparse_filters *filters;
+    // Working and integrated templates in single precision
+    float *workingF;
+    float *integratedF;
+    // log(waves/1600) for the dust transmission
+    float *logRatio;
+    // Weights of the spectrum of a galaxy to compute each flux
+    float *fluxWeights;
+};
+
+struct tmp_params *init_template(double *ageList, int nAgeList, double *integrated) {
+    /* Integrated templates are owned by the caller. The caller sets 
+     * ownIntegrated if they are not.
+     */
+    struct tmp_params *spectra = malloc(sizeof(struct tmp_params));
+    spectra->ageList = ageList;
+    spectra->nAgeList = nAgeList;
+    spectra->integrated = integrated;
+    spectra->ownIntegrated = 0;
+    // Working templates are allocated when they are built
+    spectra->working = NULL;
+    spectra->workingReady = 0;
+    spectra->cumSpectra = NULL;
+    spectra->filters = NULL;
+    spectra->workingF = NULL;
+    spectra->integratedF = NULL;
+    spectra->logRatio = NULL;
+    spectra->fluxWeights = NULL;
+    return spectra;
+}
+
+
+void free_spectra(struct tmp_params *spectra) {
+    if (spectra->ownIntegrated)
+        free(spectra->integrated);
+    free(spectra->working);
+    if (spectra->cumSpectra != NULL)
+        free_cum_templates(spectra->cumSpectra);
+    if (spectra->filters != NULL)
+        free_sparse_filters(spectra->filters);
+    free(spectra->workingF);
+    free(spectra->integratedF);
+    free(spectra->logRatio);
+    free(spectra->fluxWeights);
+    free(spectra);
+}
+
+
+// Templates of a lightcone, where each galaxy has its own redshift. Only 
+// observer frame filters depend on the redshift, so they are given at nGrid
+// redshifts zGrid in ascending order, and fluxes of a galaxy are linearly
+// interpolated between the two nearest nodes. filters + k*nFlux*nWaves are 
+// the filters of node k, whose observer frame filters also include the 
+// distance modulus, and absorption + k*nWaves is its IGM absorption, which
+// can be NULL. Both arrays are owned by the caller. spectra[k] shares the 
+// integrated templates of the context, and is built by the first call that
+// needs it.
+struct lightcone {
+    int nGrid;
+    double *zGrid;
+    double *filters;
+    double *absorption;
+    struct tmp_params **spectra;
+};
+
+
+int lightcone_node(struct lightcone *lightcone, double z, double *w) {
+    /* Return the node k below the redshift z, and the weight w of node k + 1
+     * Redshifts beyond the grid use the nearest node
+     */
+    int nGrid = lightcone->nGrid;
+    double *zGrid = lightcone->zGrid;
+    int k;
+
+    *w = 0.;
+    if (nGrid == 1 || z <= zGrid[0])
+        return 0;
+    if (z >= zGrid[nGrid - 1])
+        return nGrid - 1;
+    k = bisection_search(z, zGrid, nGrid);
+    *w = (z - zGrid[k])/(zGrid[k + 1] - zGrid[k]);
+    return k;
+}
+
+
+// A context owns the thread setting and the templates of calls of 
+// composite_spectra_cext, so that calls with different contexts can run at
+// the same time. Templates are built by the first call that needs them and
+// reused by later calls with the same context, which should therefore 
+// have the same SED templates, snapshot, filters and IGM absorption. If
+// singlePrecision is true, galaxies are computed in single precision, and
+// templates are only kept in single precision.
+struct mag_context {
+    short nThread;
+    short singlePrecision;
+    struct tmp_params *spectra;
+    struct lightcone *lightcone;
+};
+
+
+struct mag_context *init_context(short nThread, short singlePrecision) {
+    struct mag_context *ctx = malloc(sizeof(struct mag_context));
+    ctx->nThread = nThread;
+    ctx->singlePrecision = singlePrecision;
+    ctx->spectra = NULL;
+    ctx->lightcone = NULL;
+    return ctx;
+}
+
+
+void init_lightcone(struct mag_context *ctx, int nGrid, double *zGrid, 
+                    double *filters, double *absorption) {
+    /* Set the redshift grid of a context for calls with per galaxy redshifts */
+    struct lightcone *lightcone = malloc(sizeof(struct lightcone));
+    lightcone->nGrid = nGrid;
+    lightcone->zGrid = zGrid;
+    lightcone->filters = filters;
+    lightcone->absorption = absorption;
+    lightcone->spectra = calloc(nGrid, sizeof(struct tmp_params*));
+    ctx->lightcone = lightcone;
+}
+
+
+void free_context(struct mag_context *ctx) {
+    int k;
+    if (ctx->spectra != NULL)
+        free_spectra(ctx->spectra);
+    if (ctx->lightcone != NULL) {
+        for(k = 0; k < ctx->lightcone->nGrid; ++k)
+            if (ctx->lightcone->spectra[k] != NULL)
+                free_spectra(ctx->lightcone->spectra[k]);
+        free(ctx->lightcone->spectra);
+        free(ctx->lightcone);
+    }
+    free(ctx);
+}
+
+
+void templates_time_integration(struct sed_params *rawSpectra, 
+                                double *ageList, int nAgeList, double *intData) {
+    /* intData: spectra after integration over time
+     * The first dimension refers to metallicites and ages
+     * The last dimension refers to wavelengths
+     *
+     * Each age bin is the difference of the cumulative integrals at its 
+     * edges, so the cumulative integral is computed once per edge.
+     */
+    int iA, iW, iZ;
+    double *pData;
+    int nWaves = rawSpectra->nWaves; 
+    int nZ = rawSpectra->nZ;
+    double *cumLower = malloc(nWaves*sizeof(double));
+    double *cumUpper = malloc(nWaves*sizeof(double));
+    double *pSwap;
+    struct cum_templates *cumSpectra;
+    
+    #ifdef TIMING
+        struct timespec sTime;
+        timing_start(&sTime, "Integrate SED templates over time\n");
+    #endif
+    cumSpectra = init_cum_templates(rawSpectra);
+    for(iZ = 0; iZ < nZ; ++iZ) {
+        // The first time step of SED templates is typicall not zero
+        // Here assumes that the templates is zero beween zero
+        // and the first time step
+        cumulative_integral(cumSpectra, iZ, rawSpectra->age[0], cumLower);
+        for(iA = 0; iA < nAgeList; ++iA) {
+            pData = intData + (iZ*nAgeList + iA)*nWaves;
+            cumulative_integral(cumSpectra, iZ, ageList[iA], cumUpper);
+            for(iW = 0; iW < nWaves; ++iW)
+                pData[iW] = cumUpper[iW] - cumLower[iW];
+            pSwap = cumLower;
+            cumLower = cumUpper;
+            cumUpper = pSwap;
+        }
+    }
+    free_cum_templates(cumSpectra);
+    free(cumLower);
+    free(cumUpper);
+    #ifdef TIMING
+        timing_end(&sTime);
+    #endif
+}
+ 
+
+struct dust_params {
+    double tauUV_ISM;
+    double nISM;
+    double tauUV_BC;
+    double nBC;
+    double tBC;
+};
+
+
+inline void dust_transmission(double *waves, int nWaves, struct dust_params *dustArgs,
+                              double *transISM, double *transBC) {
+    /* tBC: life time of the birth clound
+     * nu: fraction of ISM dust absorption
+     * tauUV: V-band absorption optical depth
+     * nBC: power law index of tauBC
+     * nISM: power law index of tauISM
+     * 
+     * Reference: da Cunha et al. 2008
+     */
+    int iW;
+    double ratio;
+    double tauUV_ISM = dustArgs->tauUV_ISM;
+    double nISM = dustArgs->nISM;
+    double tauUV_BC = dustArgs->tauUV_BC;
+    double nBC = dustArgs->nBC;
+
+    for(iW = 0; iW < nWaves; ++iW) {
+        ratio = waves[iW]/1600.;
+        transISM[iW] = exp(-tauUV_ISM*pow(ratio, nISM));
+        transBC[iW] = exp(-tauUV_BC*pow(ratio, nBC));
+    }
+}
+
+
+inline int birth_cloud_bin(double tBC, double *age, int nAge, double rawAge0,
+                           double *t0, double *t1) {
+    /* Find the time inverval containning the birth cloud 
+     * Return the index of the age bin which is split at tBC. The bin spans
+     * from t0 to t1. If all bins are younger than tBC, return nAge.
+     */
+    int iAgeBC;
+    if (tBC >= age[nAge - 1]) {
+        iAgeBC = nAge;
+        *t0 = 0.;
+        *t1 = 0.;
+    }
+    else if(tBC < age[0]) {
+        iAgeBC = 0;
+        *t0 = rawAge0;
+        *t1 = age[0];
+    }
+    else {
+        iAgeBC = bisection_search(tBC, age, nAge) + 1;
+        *t0 = age[iAgeBC - 1];
+        *t1 = age[iAgeBC];
+    } 
+    return iAgeBC;
+}
+
+
+// Per-thread buffers of the dust pipeline
+struct dust_buffers {
+    double *transISM;
+    double *transBC;
+    // Spectra of stars younger and older than tBC
+    double *young;
+    double *old;
+    // Spectra of the bin split at tBC, computed only for metallicities in use
+    // The first dimension refers to metallicities
+    // The last dimension refers to wavelengths
+    double *splitYoung;
+    double *splitOld;
+    short *splitReady;
+    double *cumBC;
+    // Spectra after dust absorption in the rest and the observer frames
+    double *spectra;
+    double *obsWaves;
+    double *obsSpectra;
+    // Buffers of the single precision path
+    float *transISMF;
+    float *transBCF;
+    float *youngF;
+    float *oldF;
+    float *splitYoungF;
+    float *splitOldF;
+    float *cumBCF;
+    float *spectraF;
+    // Total size in bytes
+    size_t nByte;
+};
+
+
+struct dust_buffers *init_dust_buffers(struct sed_params *rawSpectra) {
+    int nWaves = rawSpectra->nWaves;
+    int nZ = rawSpectra->nZ;
+    struct dust_buffers *buffers = malloc(sizeof(struct dust_buffers));
+    buffers->transISM = malloc(nWaves*sizeof(double));
+    buffers->transBC = malloc(nWaves*sizeof(double));
+    buffers->young = malloc(nWaves*sizeof(double));
+    buffers->old = malloc(nWaves*sizeof(double));
+    buffers->splitYoung = malloc(nZ*nWaves*sizeof(double));
+    buffers->splitOld = malloc(nZ*nWaves*sizeof(double));
+    buffers->splitReady = malloc(nZ*sizeof(short));
+    buffers->cumBC = malloc(nWaves*sizeof(double));
+    buffers->spectra = malloc(nWaves*sizeof(double));
+    buffers->obsWaves = malloc(nWaves*sizeof(double));
+    buffers->obsSpectra = malloc(nWaves*sizeof(double));
+    buffers->transISMF = malloc(nWaves*sizeof(float));
+    buffers->transBCF = malloc(nWaves*sizeof(float));
+    buffers->youngF = malloc(nWaves*sizeof(float));
+    buffers->oldF = malloc(nWaves*sizeof(float));
+    buffers->splitYoungF = malloc(nZ*nWaves*sizeof(float));
+    buffers->splitOldF = malloc(nZ*nWaves*sizeof(float));
+    buffers->cumBCF = malloc(nWaves*sizeof(float));
+    buffers->spectraF = malloc(nWaves*sizeof(float));
+    buffers->nByte = (9 + 2*nZ)*nWaves*sizeof(double) + nZ*sizeof(short) 
+                     + (6 + 2*nZ)*nWaves*sizeof(float);
+    return buffers;
+}
+
+
+void free_dust_buffers(struct dust_buffers *buffers) {
+    free(buffers->transISM);
+    free(buffers->transBC);
+    free(buffers->young);
+    free(buffers->old);
+    free(buffers->splitYoung);
+    free(buffers->splitOld);
+    free(buffers->splitReady);
+    free(buffers->cumBC);
+    free(buffers->spectra);
+    free(buffers->obsWaves);
+    free(buffers->obsSpectra);
+    free(buffers->transISMF);
+    free(buffers->transBCF);
+    free(buffers->youngF);
+    free(buffers->oldF);
+    free(buffers->splitYoungF);
+    free(buffers->splitOldF);
+    free(buffers->cumBCF);
+    free(buffers->spectraF);
+    free(buffers);
+}
+
+
+void split_birth_cloud(struct cum_templates *cumSpectra, int iZ, 
+                       double t0, double tBC, double t1, 
+                       struct dust_buffers *buffers) {
+    /* Integrate raw SED templates of metallicity iZ over [t0, tBC] and
+     * [tBC, t1]
+     */
+    int iW;
+    int nWaves = cumSpectra->nWaves;
+    double *pYoung = buffers->splitYoung + iZ*nWaves;
+    double *pOld = buffers->splitOld + iZ*nWaves;
+    double *cumBC = buffers->cumBC;
+
+    cumulative_integral(cumSpectra, iZ, t0, pYoung);
+    cumulative_integral(cumSpectra, iZ, tBC, cumBC);
+    cumulative_integral(cumSpectra, iZ, t1, pOld);
+    for(iW = 0; iW < nWaves; ++iW) {
+        pYoung[iW] = cumBC[iW] - pYoung[iW];
+        pOld[iW] -= cumBC[iW];
+    }
+    buffers->splitReady[iZ] = 1;
+}
+
+
+void dust_absorption(struct sed_params *rawSpectra, struct tmp_params *tmpSpectra,
+                     struct props *nodes, int nNode, double *ageList, int nAgeList, 
+                     struct dust_params *dustArgs, struct dust_buffers *buffers) {
+    /* Compute the dust attenuated spectrum of one galaxy
+     *
+     * Progenitors are first collapsed into a spectrum younger than tBC and 
+     * a spectrum older than tBC. The transmission curves are then applied 
+     * to the two spectra only, so that the cost scales with the number of 
+     * progenitors rather than the size of the SED templates. The result is
+     * stored in buffers->spectra.
+     */
+    int iW, iP, iZ;
+    struct props *pNodes;
+
+    double *Z = rawSpectra->Z;
+    int nZ = rawSpectra->nZ;
+    int minZ = rawSpectra->minZ;
+    int maxZ = rawSpectra->maxZ;
+    int nWaves = rawSpectra->nWaves;
+    double *intData = tmpSpectra->integrated;
+
+    double *transISM = buffers->transISM;
+    double *transBC = buffers->transBC;
+    double *young = buffers->young;
+    double *old = buffers->old;
+    double *spectra = buffers->spectra;
+
+    double tBC = dustArgs->tBC;
+    double t0, t1;
+    int iAgeBC = birth_cloud_bin(tBC, ageList, nAgeList, rawSpectra->age[0], &t0, &t1);
+
+    int iA;
+    int metals;
+    double sfr, w;
+    double *pData0, *pData1;
+    double *pSpectra;
+
+    dust_transmission(rawSpectra->waves, nWaves, dustArgs, transISM, transBC);
+    memset(young, 0, nWaves*sizeof(double));
+    memset(old, 0, nWaves*sizeof(double));
+    memset(buffers->splitReady, 0, nZ*sizeof(short));
+    for(iP = 0; iP < nNode; ++iP) {
+        pNodes = nodes + iP;
+        sfr = pNodes->sfr;
+        iA = pNodes->index;
+        // Interploate SED templates along metallicities
+        // Use the same metallicity bins as the working templates
+        metals = (int)(pNodes->metals*1000 - .5);
+        if (metals < minZ)
+            metals = minZ;
+        else if (metals > maxZ)
+            metals = maxZ;
+        iZ = interp_weight((metals + 1.)/1000., Z, nZ, &w);
+        if (iA == iAgeBC) {
+            // t_s < tBC < t_s + dt
+            if (!buffers->splitReady[iZ])
+                split_birth_cloud(tmpSpectra->cumSpectra, iZ, t0, tBC, t1, buffers);
+            if (!buffers->splitReady[iZ + 1])
+                split_birth_cloud(tmpSpectra->cumSpectra, iZ + 1, t0, tBC, t1, buffers);
+            pData0 = buffers->splitYoung + iZ*nWaves;
+            pData1 = pData0 + nWaves;
+            for(iW = 0; iW < nWaves; ++iW)
+                young[iW] += sfr*(pData0[iW] + (pData1[iW] - pData0[iW])*w);
+            pData0 = buffers->splitOld + iZ*nWaves;
+            pData1 = pData0 + nWaves;
+            for(iW = 0; iW < nWaves; ++iW)
+                old[iW] += sfr*(pData0[iW] + (pData1[iW] - pData0[iW])*w);
+        }
+        else {
+            // tBC > t_s  or tBC < t_s
+            pSpectra = iA < iAgeBC ? young : old;
+            pData0 = intData + (iZ*nAgeList + iA)*nWaves;
+            pData1 = pData0 + nAgeList*nWaves;
+            for(iW = 0; iW < nWaves; ++iW)
+                pSpectra[iW] += sfr*(pData0[iW] + (pData1[iW] - pData0[iW])*w);
+        }
+    }
+    for(iW = 0; iW < nWaves; ++iW)
+        spectra[iW] = transISM[iW]*(transBC[iW]*young[iW] + old[iW]);
+}
+
+
+void spectra_to_flux(struct sed_params *rawSpectra, struct dust_buffers *buffers,
+                     double *LyAbsorption, double z,
+                     struct sparse_filters *filters, int nFlux, int nObs, double *flux) {
+    /* Convert the spectrum in buffers->spectra to the same fluxes as given 
+     * by the working templates
+     */
+    int iF, iW;
+    int nWaves = rawSpectra->nWaves;
+    double *waves = rawSpectra->waves;
+    double *spectra = buffers->spectra;
+    double *obsWaves = buffers->obsWaves;
+    double *obsSpectra = buffers->obsSpectra;
+
+    if (filters != NULL) {
+        // Observer frame filters apply to the rest frame spectrum directly
+        filter_flux(filters, spectra, flux);
+        for(iF = 0; iF < nFlux; ++iF)
+            flux[iF] += TOL;
+        return;
+    }
+    if (nObs > 0) {
+        // Transform everything to observer frame
+        for(iW = 0; iW < nWaves; ++iW) {
+            obsWaves[iW] = waves[iW]*(1. + z);
+            obsSpectra[iW] = spectra[iW]/(1. + z);
+        }
+        if (LyAbsorption != NULL)
+            // Add IGM absorption
+            for(iW = 0; iW < nWaves; ++iW)
+                obsSpectra[iW] *= LyAbsorption[iW];
+    }
+    if (nObs > 0)
+        spectra = obsSpectra;
+    for(iW = 0; iW < nWaves; ++iW)
+        flux[iW] = TOL + spectra[iW];
+}
+
+
+inline void templates_working(struct sed_params *rawSpectra, struct tmp_params *tmpSpectra,
+                              double *LyAbsorption, double z, 
+                              struct sparse_filters *filters, int nFlux, int nObs,
+                              short nThread) {
+    int nWaves = rawSpectra->nWaves;
+    double *waves = rawSpectra->waves;
+    int nZ = rawSpectra->nZ;
+
+    int nAge = tmpSpectra->nAgeList;
+    double *intData = tmpSpectra->integrated;
+    double *workingData;
+
+    // Working templates are allocated if they do not exist
+    if (tmpSpectra->working == NULL)
+        tmpSpectra->working = malloc((size_t)(rawSpectra->maxZ + 1)*nAge*nFlux*sizeof(double));
+    workingData = tmpSpectra->working;
+
+    // Observer frame spectra are only needed without filters, since weights
+    // of observer frame filters apply to rest frame spectra
     double *obsWaves = NULL;
     double *obsData = NULL;
-    if (nObs > 0) {
+    if (nObs > 0 && filters == NULL) {
         obsWaves = (double*)malloc(nWaves*sizeof(double));
         obsData = (double*)malloc(nZ*nAge*nWaves*sizeof(double));
     }
-    // Spectra to be interploated along metallicities
-    // The first dimension refers to filters/wavelengths and ages
-    // Thw last dimension refers to metallicites
-    double *refSpectra = malloc(nFlux*nAge*nZ*sizeof(double));
-    
-    int minZ = rawSpectra->minZ;
-    int maxZ = rawSpectra->maxZ;   
-    double *Z = rawSpectra->Z;
+    // Spectra to be interploated along metallicities
+    // The first dimension refers to filters/wavelengths and ages
+    // Thw last dimension refers to metallicites
+    double *refSpectra = malloc(nFlux*nAge*nZ*sizeof(double));
+    
+    int minZ = rawSpectra->minZ;
+    int maxZ = rawSpectra->maxZ;   
+    double *Z = rawSpectra->Z;
+
+    #pragma omp parallel \
+    default(none)  \
+    firstprivate(LyAbsorption, z, filters, nFlux, nObs, \
+                 nWaves, waves, nZ, nAge, \
+                 intData, workingData, refSpectra, \
+                 obsWaves, obsData, \
+                 minZ, maxZ, Z) \
+    num_threads(nThread) 
+    {
+        int iA, iW, iZ, iAZ, iF, iS, i, n, nB;
+        double *pData;
+        double *pObsData;
+        double interpZ;
+        double *block = filters != NULL ? malloc(nFlux*FILTER_BLOCK*sizeof(double)) : NULL;
+        
+        if (filters == NULL) {
+            #pragma omp single
+            if (nObs > 0) {
+                // Transform everything to observer frame
+                // Note the fluxes in this case is a function of wavelength
+                // Therefore the fluxes has a factor of 1/(1 + z)
+                for(iW = 0; iW < nWaves; ++iW)
+                    obsWaves[iW] = waves[iW]*(1. + z);
+                for(iAZ = 0; iAZ < nAge*nZ; ++iAZ) {
+                    pData = intData + iAZ*nWaves;
+                    pObsData = obsData + iAZ*nWaves;
+                    for(iW = 0; iW < nWaves; ++iW)
+                        pObsData[iW] = pData[iW]/(1. + z);           
+                }
+                if (LyAbsorption != NULL)
+                    // Add IGM absorption
+                     for(iAZ = 0; iAZ < nAge*nZ; ++iAZ) {
+                        pObsData = obsData + iAZ*nWaves;
+                        for(iW = 0; iW < nWaves; ++iW)
+                            pObsData[iW] *= LyAbsorption[iW];
+                        }       
+            }
+
+            // Tranpose the templates such that the last dimension is the metallicity
+            #pragma omp single
+            if (nObs > 0) {
+                for(iZ = 0; iZ < nZ; ++iZ) 
+                    for(iA = 0; iA < nAge; ++iA) {
+                        // Use fluxes in the observer frame
+                        pObsData = obsData + (iZ*nAge + iA)*nWaves;
+                        for(iW = 0; iW < nWaves; ++iW)
+                            refSpectra[(iW*nAge + iA)*nZ + iZ] = pObsData[iW];
+                    }
+            }
+            else {
+                for(iZ = 0; iZ < nZ; ++iZ) 
+                    for(iA = 0; iA < nAge; ++iA) {
+                        pData = intData + (iZ*nAge + iA)*nWaves;
+                        for(iW = 0; iW < nWaves; ++iW)
+                            refSpectra[(iW*nAge + iA)*nZ + iZ] = pData[iW];
+                    }
+            }
+        }
+        else {
+            // Intgrate SED templates over all filters in blocks of 
+            // FILTER_BLOCK templates
+            n = (nZ*nAge + FILTER_BLOCK - 1)/FILTER_BLOCK;
+            #pragma omp for schedule(static,1)
+            for(i = 0; i < n; ++i) {
+                iAZ = i*FILTER_BLOCK;
+                nB = nZ*nAge - iAZ < FILTER_BLOCK ? nZ*nAge - iAZ : FILTER_BLOCK;
+                filter_block(filters, intData + (size_t)iAZ*nWaves, nB, nWaves, block);
+                for(iS = 0; iS < nB; ++iS) {
+                    iZ = (iAZ + iS)/nAge;
+                    iA = (iAZ + iS)%nAge;
+                    for(iF = 0; iF < nFlux; ++iF)
+                        refSpectra[(iF*nAge + iA)*nZ + iZ] = block[iF*FILTER_BLOCK + iS];
+                }
+            }
+        }
+
+        // Interploate SED templates along metallicities
+        n = (maxZ - minZ + 1)*nAge;
+        #pragma omp for schedule(static,1)
+        for(i = 0; i < n; ++i) {
+            interpZ = (minZ + i/nAge + 1.)/1000.;
+            pData = workingData + i*nFlux;
+            for(iF = 0; iF < nFlux; ++iF) 
+                pData[iF] = interp(interpZ, Z, refSpectra + (iF*nAge+ i%nAge)*nZ, nZ);
+        }
+        free(block);
+    }
+    
+    if (nObs > 0 && filters == NULL) {
+        free(obsWaves);
+        free(obsData);
+    }
+    free(refSpectra);
+
+}
+
+
+// Progenitors of a galaxy binned by metallicity and age
+// weights[cell] is the total star formation rate of the cell, where 
+// cell = metals*nAgeList + index. cells lists the nCell non-empty cells in
+// the order they are first filled. If progenitors are not binned, rows and
+// sfr are the offsets of their rows in the working templates and their 
+// star formation rates, which have space for maxRow progenitors
+struct sfh_bins {
+    int nCell;
+    double *weights;
+    short *used;
+    int *cells;
+    int nRow;
+    int maxRow;
+    size_t *rows;
+    double *sfr;
+};
+
+
+struct sfh_bins *init_sfh_bins(int nBin) {
+    struct sfh_bins *bins = malloc(sizeof(struct sfh_bins));
+    bins->nCell = 0;
+    bins->weights = calloc(nBin, sizeof(double));
+    bins->used = calloc(nBin, sizeof(short));
+    bins->cells = malloc(nBin*sizeof(int));
+    bins->nRow = 0;
+    bins->maxRow = 0;
+    bins->rows = NULL;
+    bins->sfr = NULL;
+    return bins;
+}
+
+
+void free_sfh_bins(struct sfh_bins *bins) {
+    free(bins->weights);
+    free(bins->used);
+    free(bins->cells);
+    free(bins->rows);
+    free(bins->sfr);
+    free(bins);
+}
+
+
+void bin_progenitors(struct props *nodes, int nNode, int nAgeList, int minZ, int maxZ,
+                     struct sfh_bins *bins) {
+    /* Merge progenitors that fall in the same metallicity and age cell */
+    int iP, cell;
+    int metals;
+    struct props *pNodes;
+
+    for(iP = 0; iP < nNode; ++iP) {
+        pNodes = nodes + iP;
+        metals = (int)(pNodes->metals*1000 - .5);
+        if (metals < minZ)
+            metals = minZ;
+        else if (metals > maxZ)
+            metals = maxZ;
+        cell = metals*nAgeList + pNodes->index;
+        if (!bins->used[cell]) {
+            bins->used[cell] = 1;
+            bins->cells[bins->nCell++] = cell;
+        }
+        bins->weights[cell] += pNodes->sfr;
+    }
+}
+
+
+void accumulate_bins(struct sfh_bins *bins, double *fluxTmp, double *flux, int nFlux) {
+    /* Add binned progenitors to fluxes, and then empty the bins */
+    int iC, iF, cell;
+    int nCell = bins->nCell;
+    int *cells = bins->cells;
+    double *weights = bins->weights;
+    double *pData;
+    double w;
+
+    for(iC = 0; iC < nCell; ++iC) {
+        cell = cells[iC];
+        w = weights[cell];
+        pData = fluxTmp + (size_t)cell*nFlux;
+        for(iF = 0; iF < nFlux; ++iF)
+            flux[iF] += w*pData[iF];
+        weights[cell] = 0.;
+        bins->used[cell] = 0;
+    }
+    bins->nCell = 0;
+}
+
+
+void gather_rows(struct props *nodes, int nNode, int nAgeList, int minZ, int maxZ, 
+                 int nFlux, struct sfh_bins *bins) {
+    /* Find the row of each progenitor in the working templates */
+    int iP;
+    int metals;
+    struct props *pNodes;
+
+    if (nNode > bins->maxRow) {
+        bins->maxRow = nNode > 2*bins->maxRow ? nNode : 2*bins->maxRow;
+        bins->rows = realloc(bins->rows, bins->maxRow*sizeof(size_t));
+        bins->sfr = realloc(bins->sfr, bins->maxRow*sizeof(double));
+    }
+    for(iP = 0; iP < nNode; ++iP) {
+        pNodes = nodes + iP;
+        metals = (int)(pNodes->metals*1000 - .5);
+        if (metals < minZ)
+            metals = minZ;
+        else if (metals > maxZ)
+            metals = maxZ;
+        bins->rows[iP] = (size_t)(metals*nAgeList + pNodes->index)*nFlux;
+        bins->sfr[iP] = pNodes->sfr;
+    }
+    bins->nRow = nNode;
+}
+
+
+void accumulate_rows(struct sfh_bins *bins, double *fluxTmp, double *flux, int nFlux) {
+    /* Add the rows found by gather_rows to fluxes
+     *
+     * Fluxes are summed in blocks of DIRECT_BLOCK, which are kept in 
+     * registers over all rows. Each flux is summed in the order of 
+     * progenitors, starting from its initial value. This is used when nFlux
+     * is small, where rows of the working templates are too short for 
+     * merging cells to pay off.
+     */
+    int iF, iR, iB;
+    int nRow = bins->nRow;
+    int nRem = nFlux%DIRECT_BLOCK;
+    size_t *rows = bins->rows;
+    double *sfr = bins->sfr;
+    double *pData;
+    double acc[DIRECT_BLOCK];
+
+    for(iF = 0; iF < nFlux - nRem; iF += DIRECT_BLOCK) {
+        for(iB = 0; iB < DIRECT_BLOCK; ++iB)
+            acc[iB] = flux[iF + iB];
+        for(iR = 0; iR < nRow; ++iR) {
+            pData = fluxTmp + rows[iR] + iF;
+            #pragma omp simd
+            for(iB = 0; iB < DIRECT_BLOCK; ++iB)
+                acc[iB] += sfr[iR]*pData[iB];
+        }
+        for(iB = 0; iB < DIRECT_BLOCK; ++iB)
+            flux[iF + iB] = acc[iB];
+    }
+    if (nRem == 0)
+        return;
+    for(iB = 0; iB < nRem; ++iB)
+        acc[iB] = flux[iF + iB];
+    for(iR = 0; iR < nRow; ++iR) {
+        pData = fluxTmp + rows[iR] + iF;
+        for(iB = 0; iB < nRem; ++iB)
+            acc[iB] += sfr[iR]*pData[iB];
+    }
+    for(iB = 0; iB < nRem; ++iB)
+        flux[iF + iB] = acc[iB];
+}
+
+
+void sum_progenitors(struct props *nodes, int nNode, double *fluxTmp, 
+                     int nAgeList, int minZ, int maxZ, 
+                     double *flux, int nFlux, struct sfh_bins *bins) {
+    /* Sum contributions from all progenitors of a galaxy
+     * fluxTmp: working templates
+     * flux: output fluxes
+     * bins: working space with (maxZ + 1)*nAgeList cells
+     */
+    int iF;
+    // Initialise fluxes
+    for(iF = 0; iF < nFlux; ++iF)
+        flux[iF] = TOL;
+    if (nFlux <= MAX_DIRECT_FLUX) {
+        gather_rows(nodes, nNode, nAgeList, minZ, maxZ, nFlux, bins);
+        accumulate_rows(bins, fluxTmp, flux, nFlux);
+    }
+    else {
+        bin_progenitors(nodes, nNode, nAgeList, minZ, maxZ, bins);
+        accumulate_bins(bins, fluxTmp, flux, nFlux);
+    }
+}
+
+
+void fit_UV_slopes(float *flux, int nGal, int nFlux, double *logWaves, double *weights,
+                   float *fits, short nThread) {
+    /* Fit a power law to the first nFlux - 1 fluxes of each galaxy
+     * weights: weights of the fluxes in the fit, which can be NULL
+     * fits: slope, intercept, correlation coefficient and uncertainty of 
+     *       the slope of each galaxy
+     */
+    struct lin_design *design = init_lin_design(logWaves, weights, nFlux - 1);
+    int nBlock = (nGal + FIT_BLOCK - 1)/FIT_BLOCK;
+
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(flux, nGal, nFlux, fits, design, nBlock) \
+    num_threads(nThread)
+    {
+        int iF, iG, iB, iR, b, nB;
+        int nFit = nFlux - 1;
+        double *logf = malloc(nFit*FIT_BLOCK*sizeof(double));
+        double result[N_FIT_RESULT*FIT_BLOCK];
+        float *pFlux;
+
+        #pragma omp for schedule(static)
+        for(iB = 0; iB < nBlock; ++iB) {
+            iG = iB*FIT_BLOCK;
+            nB = nGal - iG < FIT_BLOCK ? nGal - iG : FIT_BLOCK;
+            for(b = 0; b < FIT_BLOCK; ++b) {
+                // Pad the last block with the first galaxy of the block
+                pFlux = flux + (size_t)(iG + (b < nB ? b : 0))*nFlux;
+                for(iF = 0; iF < nFit; ++iF)
+                    logf[iF*FIT_BLOCK + b] = log(pFlux[iF]);
+            }
+            linregress_block(design, logf, result);
+            for(b = 0; b < nB; ++b)
+                for(iR = 0; iR < N_FIT_RESULT; ++iR)
+                    fits[(size_t)(iG + b)*N_FIT_RESULT + iR] = (float)result[iR*FIT_BLOCK + b];
+        }
+        free(logf);
+    }
+    free_lin_design(design);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                             *
+ * Functions in single precision                                               *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Templates of the single precision path are built in double precision by
+ * the same functions as the double precision path, and only kept after 
+ * they are converted to float, which halves their memory and bandwidth. 
+ * Loops over wavelengths or fluxes are marked by omp simd, so that the 
+ * compiler vectorises them with twice as many elements per instruction as 
+ * double.
+ */
+float *to_float(double *data, size_t n) {
+    size_t i;
+    float *output = malloc((n > 0 ? n : 1)*sizeof(float));
+    for(i = 0; i < n; ++i)
+        output[i] = (float)data[i];
+    return output;
+}
+
+
+double *to_double(float *data, size_t n) {
+    size_t i;
+    double *output = malloc((n > 0 ? n : 1)*sizeof(double));
+    for(i = 0; i < n; ++i)
+        output[i] = data[i];
+    return output;
+}
+
+
+void cum_templates_to_float(struct cum_templates *cumSpectra) {
+    /* Keep only the single precision copy of cumulative templates */
+    size_t tableSize = (size_t)cumSpectra->nZ*cumSpectra->nAge*cumSpectra->nWaves;
+    cumSpectra->dataF = to_float(cumSpectra->data, tableSize);
+    cumSpectra->cumulativeF = to_float(cumSpectra->cumulative, tableSize);
+    free(cumSpectra->data);
+    free(cumSpectra->cumulative);
+    cumSpectra->data = NULL;
+    cumSpectra->cumulative = NULL;
+}
+
+
+void cumulative_integral_float(struct cum_templates *cumSpectra, int iZ, double t, 
+                               float *output) {
+    /* Single precision version of cumulative_integral */
+    int iW;
+    int nAge = cumSpectra->nAge;
+    int nWaves = cumSpectra->nWaves;
+    double *age = cumSpectra->age;
+    int iA;
+    float *pCum, *pData0, *pData1;
+    float dt, w;
+
+    if (t < age[0] || t > age[nAge - 1]) {
+        printf("Error: Integration range %10.5e is beyond the tabular data\n", t);
+        exit(0);
+    }
+    iA = bisection_search(t, age, nAge);
+    dt = (float)(t - age[iA]);
+    w = (float)((t - age[iA])/(age[iA + 1] - age[iA]));
+    pCum = cumSpectra->cumulativeF + (iZ*nAge + iA)*nWaves;
+    pData0 = cumSpectra->dataF + (iZ*nAge + iA)*nWaves;
+    pData1 = pData0 + nWaves;
+    #pragma omp simd
+    for(iW = 0; iW < nWaves; ++iW)
+        output[iW] = pCum[iW] + dt*(pData0[iW] + .5f*(pData1[iW] - pData0[iW])*w);
+}
+
+
+void split_birth_cloud_float(struct cum_templates *cumSpectra, int iZ, 
+                             double t0, double tBC, double t1, 
+                             struct dust_buffers *buffers) {
+    /* Single precision version of split_birth_cloud */
+    int iW;
+    int nWaves = cumSpectra->nWaves;
+    float *pYoung = buffers->splitYoungF + iZ*nWaves;
+    float *pOld = buffers->splitOldF + iZ*nWaves;
+    float *cumBC = buffers->cumBCF;
+
+    cumulative_integral_float(cumSpectra, iZ, t0, pYoung);
+    cumulative_integral_float(cumSpectra, iZ, tBC, cumBC);
+    cumulative_integral_float(cumSpectra, iZ, t1, pOld);
+    #pragma omp simd
+    for(iW = 0; iW < nWaves; ++iW) {
+        pYoung[iW] = cumBC[iW] - pYoung[iW];
+        pOld[iW] -= cumBC[iW];
+    }
+    buffers->splitReady[iZ] = 1;
+}
+
+
+float *init_flux_weights(struct sed_params *rawSpectra, double *LyAbsorption, double z, 
+                         struct sparse_filters *filters, int nObs) {
+    /* Weights of the spectrum of a galaxy to compute each flux
+     *
+     * If filters is not NULL, they are the weights of the filters in single
+     * precision. Otherwise, the weights convert the spectrum to the output 
+     * frame, which includes the factor 1/(1 + z) and the IGM absorption.
+     */
+    int iW;
+    int nWaves = rawSpectra->nWaves;
+    float *weights;
+
+    if (filters != NULL)
+        return to_float(filters->weights, filters->offsets[filters->nFlux]);
+    weights = malloc(nWaves*sizeof(float));
+    for(iW = 0; iW < nWaves; ++iW) {
+        if (nObs == 0)
+            weights[iW] = 1.f;
+        else if (LyAbsorption != NULL)
+            weights[iW] = (float)(LyAbsorption[iW]/(1. + z));
+        else
+            weights[iW] = (float)(1./(1. + z));
+    }
+    return weights;
+}
+
+
+void sum_progenitors_float(struct props *nodes, int nNode, float *fluxTmp, 
+                           int nAgeList, int minZ, int maxZ, 
+                           float *flux, int nFlux, struct sfh_bins *bins) {
+    /* Single precision version of sum_progenitors without the TOL offset
+     * fluxTmp: working templates in single precision
+     */
+    int iF, iP, iC, cell;
+    int metals;
+    struct props *pNodes;
+    float *pData;
+    float w;
+
+    for(iF = 0; iF < nFlux; ++iF)
+        flux[iF] = 0.f;
+    if (nFlux <= MAX_DIRECT_FLUX) {
+        for(iP = 0; iP < nNode; ++iP) {
+            pNodes = nodes + iP;
+            metals = (int)(pNodes->metals*1000 - .5);
+            if (metals < minZ)
+                metals = minZ;
+            else if (metals > maxZ)
+                metals = maxZ;
+            w = pNodes->sfr;
+            pData = fluxTmp + (metals*nAgeList + pNodes->index)*nFlux;
+            #pragma omp simd
+            for(iF = 0; iF < nFlux; ++iF)
+                flux[iF] += w*pData[iF];
+        }
+        return;
+    }
+    bin_progenitors(nodes, nNode, nAgeList, minZ, maxZ, bins);
+    for(iC = 0; iC < bins->nCell; ++iC) {
+        cell = bins->cells[iC];
+        w = (float)bins->weights[cell];
+        pData = fluxTmp + (size_t)cell*nFlux;
+        #pragma omp simd
+        for(iF = 0; iF < nFlux; ++iF)
+            flux[iF] += w*pData[iF];
+        bins->weights[cell] = 0.;
+        bins->used[cell] = 0;
+    }
+    bins->nCell = 0;
+}
+
+
+void dust_absorption_float(struct sed_params *rawSpectra, struct tmp_params *tmpSpectra,
+                           struct props *nodes, int nNode, double *ageList, int nAgeList, 
+                           struct dust_params *dustArgs, struct dust_buffers *buffers) {
+    /* Single precision version of dust_absorption 
+     * The result is stored in buffers->spectraF.
+     */
+    int iW, iP, iZ;
+    struct props *pNodes;
+
+    double *Z = rawSpectra->Z;
+    int nZ = rawSpectra->nZ;
+    int minZ = rawSpectra->minZ;
+    int maxZ = rawSpectra->maxZ;
+    int nWaves = rawSpectra->nWaves;
+    float *intData = tmpSpectra->integratedF;
+    float *logRatio = tmpSpectra->logRatio;
+
+    float *transISM = buffers->transISMF;
+    float *transBC = buffers->transBCF;
+    float *young = buffers->youngF;
+    float *old = buffers->oldF;
+    float *spectra = buffers->spectraF;
+
+    float tauUV_ISM = dustArgs->tauUV_ISM;
+    float nISM = dustArgs->nISM;
+    float tauUV_BC = dustArgs->tauUV_BC;
+    float nBC = dustArgs->nBC;
+    double tBC = dustArgs->tBC;
+    double t0, t1;
+    int iAgeBC = birth_cloud_bin(tBC, ageList, nAgeList, rawSpectra->age[0], &t0, &t1);
+
+    int iA;
+    int metals;
+    double w;
+    float sfr, wF;
+    float *pData0, *pData1;
+    float *pSpectra;
+
+    #pragma omp simd
+    for(iW = 0; iW < nWaves; ++iW) {
+        transISM[iW] = expf(-tauUV_ISM*expf(nISM*logRatio[iW]));
+        transBC[iW] = expf(-tauUV_BC*expf(nBC*logRatio[iW]));
+    }
+    memset(young, 0, nWaves*sizeof(float));
+    memset(old, 0, nWaves*sizeof(float));
+    memset(buffers->splitReady, 0, nZ*sizeof(short));
+    for(iP = 0; iP < nNode; ++iP) {
+        pNodes = nodes + iP;
+        sfr = pNodes->sfr;
+        iA = pNodes->index;
+        metals = (int)(pNodes->metals*1000 - .5);
+        if (metals < minZ)
+            metals = minZ;
+        else if (metals > maxZ)
+            metals = maxZ;
+        iZ = interp_weight((metals + 1.)/1000., Z, nZ, &w);
+        wF = (float)w;
+        if (iA == iAgeBC) {
+            if (!buffers->splitReady[iZ])
+                split_birth_cloud_float(tmpSpectra->cumSpectra, iZ, t0, tBC, t1, buffers);
+            if (!buffers->splitReady[iZ + 1])
+                split_birth_cloud_float(tmpSpectra->cumSpectra, iZ + 1, t0, tBC, t1, buffers);
+            pData0 = buffers->splitYoungF + iZ*nWaves;
+            pData1 = pData0 + nWaves;
+            #pragma omp simd
+            for(iW = 0; iW < nWaves; ++iW)
+                young[iW] += sfr*(pData0[iW] + (pData1[iW] - pData0[iW])*wF);
+            pData0 = buffers->splitOldF + iZ*nWaves;
+            pData1 = pData0 + nWaves;
+            #pragma omp simd
+            for(iW = 0; iW < nWaves; ++iW)
+                old[iW] += sfr*(pData0[iW] + (pData1[iW] - pData0[iW])*wF);
+        }
+        else {
+            pSpectra = iA < iAgeBC ? young : old;
+            pData0 = intData + (iZ*nAgeList + iA)*nWaves;
+            pData1 = pData0 + nAgeList*nWaves;
+            #pragma omp simd
+            for(iW = 0; iW < nWaves; ++iW)
+                pSpectra[iW] += sfr*(pData0[iW] + (pData1[iW] - pData0[iW])*wF);
+        }
+    }
+    #pragma omp simd
+    for(iW = 0; iW < nWaves; ++iW)
+        spectra[iW] = transISM[iW]*(transBC[iW]*young[iW] + old[iW]);
+}
+
+
+void spectra_to_flux_float(struct dust_buffers *buffers, int nWaves, 
+                           struct sparse_filters *filters, float *weights, float *flux) {
+    /* Single precision version of spectra_to_flux without the TOL offset
+     * It uses the weights given by init_flux_weights.
+     */
+    int iF, iW;
+    int size;
+    float *spectra = buffers->spectraF;
+    float *pWeights;
+    float *pSpectra;
+    float sum;
+
+    if (filters == NULL) {
+        #pragma omp simd
+        for(iW = 0; iW < nWaves; ++iW)
+            flux[iW] = weights[iW]*spectra[iW];
+        return;
+    }
+    for(iF = 0; iF < filters->nFlux; ++iF) {
+        size = filters->size[iF];
+        pWeights = weights + filters->offsets[iF];
+        pSpectra = spectra + filters->start[iF];
+        sum = 0.f;
+        #pragma omp simd reduction(+:sum)
+        for(iW = 0; iW < size; ++iW)
+            sum += pWeights[iW]*pSpectra[iW];
+        flux[iF] = sum;
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                             *
+ * Pruning of progenitors                                                      *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Progenitors in the same metallicity and age cell use the same templates, 
+ * so they are merged into one node. Nodes whose contributions are small are
+ * then dropped, as long as the magnitude of every flux changes by less than 
+ * the tolerance. The contribution of a node to flux iF is bounded by its
+ * star formation rate times the maximum of the working templates over 
+ * metallicities at its age, which is also used to bound the rounding of 
+ * merged star formation rates to float.
+ */
+struct prune_node {
+    double score;
+    int pos;
+};
+
+// Working space of one thread, which grows with the number of progenitors
+struct prune_buffers {
+    int capacity;
+    double *sfr;
+    struct prune_node *order;
+    // Position of the merged node of each cell or -1
+    int *cellPos;
+    double *total;
+    double *dropped;
+};
+
+
+struct prune_buffers *init_prune_buffers(int nCell, int nFlux) {
+    int iC;
+    struct prune_buffers *buffers = malloc(sizeof(struct prune_buffers));
+    buffers->capacity = 1024;
+    buffers->sfr = malloc(buffers->capacity*sizeof(double));
+    buffers->order = malloc(buffers->capacity*sizeof(struct prune_node));
+    buffers->cellPos = malloc(nCell*sizeof(int));
+    for(iC = 0; iC < nCell; ++iC)
+        buffers->cellPos[iC] = -1;
+    buffers->total = malloc(nFlux*sizeof(double));
+    buffers->dropped = malloc(nFlux*sizeof(double));
+    return buffers;
+}
+
+
+void free_prune_buffers(struct prune_buffers *buffers) {
+    free(buffers->sfr);
+    free(buffers->order);
+    free(buffers->cellPos);
+    free(buffers->total);
+    free(buffers->dropped);
+    free(buffers);
+}
+
+
+int compare_prune_nodes(const void *a, const void *b) {
+    const struct prune_node *nodeA = a;
+    const struct prune_node *nodeB = b;
+    if (nodeA->score != nodeB->score)
+        return nodeA->score < nodeB->score ? -1 : 1;
+    return nodeA->pos - nodeB->pos;
+}
+
+
+inline int prune_cell(struct props *node, int nAgeList, int minZ, int maxZ) {
+    /* Return the metallicity and age cell of a progenitor, whose 
+     * metallicity is clamped to the range of the templates
+     */
+    int metals = (int)(node->metals*1000 - .5);
+    if (metals < minZ)
+        metals = minZ;
+    else if (metals > maxZ)
+        metals = maxZ;
+    return metals*nAgeList + node->index;
+}
+
+
+int prune_galaxy(struct props *nodes, int nNode, double *working, double *maxWorking,
+                 int nAgeList, int minZ, int maxZ, int nFlux, double *budgetFactor,
+                 struct props *output, double *bounds, struct prune_buffers *buffers) {
+    /* Merge and drop progenitors of a galaxy
+     * working: working templates
+     * maxWorking: maximum of the working templates over metallicities at 
+     *             each age
+     * budgetFactor: fraction of each flux that can be dropped
+     * output: pruned progenitors in the order they first appear in nodes,
+     *         which can be the same as nodes
+     * bounds: upper bound of the change of the magnitude of each flux
+     *
+     * Return: number of pruned progenitors
+     */
+    int iP, iF, iO, nMerged, nKept;
+    int cell;
+    short fits;
+    double budget, contrib, score;
+    double *pMax;
+    double *sfr;
+    double *total = buffers->total;
+    double *dropped = buffers->dropped;
+    struct prune_node *order;
+
+    if (nNode > buffers->capacity) {
+        buffers->capacity = nNode;
+        buffers->sfr = realloc(buffers->sfr, nNode*sizeof(double));
+        buffers->order = realloc(buffers->order, nNode*sizeof(struct prune_node));
+    }
+    sfr = buffers->sfr;
+    order = buffers->order;
+
+    // Merge progenitors in the same cell
+    nMerged = 0;
+    for(iP = 0; iP < nNode; ++iP) {
+        cell = prune_cell(nodes + iP, nAgeList, minZ, maxZ);
+        if (buffers->cellPos[cell] < 0) {
+            buffers->cellPos[cell] = nMerged;
+            sfr[nMerged] = nodes[iP].sfr;
+            output[nMerged++] = nodes[iP];
+        }
+        else
+            sfr[buffers->cellPos[cell]] += nodes[iP].sfr;
+    }
+    for(iO = 0; iO < nMerged; ++iO) {
+        buffers->cellPos[prune_cell(output + iO, nAgeList, minZ, maxZ)] = -1;
+        output[iO].sfr = (float)sfr[iO];
+    }
+
+    // Score each node by the largest fraction of the budget it takes
+    for(iF = 0; iF < nFlux; ++iF)
+        dropped[iF] = 0.;
+    for(iO = 0; iO < nMerged; ++iO) {
+        pMax = maxWorking + output[iO].index*nFlux;
+        for(iF = 0; iF < nFlux; ++iF)
+            dropped[iF] += fabs((double)output[iO].sfr - sfr[iO])*pMax[iF];
+    }
+    // Total fluxes are the same as sum_progenitors
+    for(iF = 0; iF < nFlux; ++iF)
+        total[iF] = TOL;
+    for(iO = 0; iO < nMerged; ++iO) {
+        cell = prune_cell(output + iO, nAgeList, minZ, maxZ);
+        for(iF = 0; iF < nFlux; ++iF)
+            total[iF] += sfr[iO]*working[cell*nFlux + iF];
+    }
+    for(iO = 0; iO < nMerged; ++iO) {
+        pMax = maxWorking + output[iO].index*nFlux;
+        score = 0.;
+        for(iF = 0; iF < nFlux; ++iF) {
+            contrib = sfr[iO]*pMax[iF];
+            budget = budgetFactor[iF]*total[iF] - dropped[iF];
+            if (contrib > 0.)
+                score = budget > 0. ? fmax(score, contrib/budget) : HUGE_VAL;
+        }
+        order[iO].score = score;
+        order[iO].pos = iO;
+    }
+    qsort(order, nMerged, sizeof(struct prune_node), compare_prune_nodes);
 
-    #pragma omp parallel \
-    default(none)  \
-    firstprivate(LyAbsorption, z, filters, nFlux, nObs, \
-                 nWaves, waves, nZ, nAge, \
-                 readyData, workingData, refSpectra, \
-                 obsWaves, obsData, \
-                 minZ, maxZ, Z) \
-    num_threads(g_nThread) 
-    {
-        int iA, iW, iZ, iAZ, iF, i, n;
-        int nRest = nFlux - nObs;
-        double *pData;
-        double *pObsData;
-        double *pFilter;
-        double interpZ;
-        
-        #pragma omp single
-        if (nObs > 0) {
-            // Transform everything to observer frame
-            // Note the fluxes in this case is a function of wavelength
-            // Therefore the fluxes has a factor of 1/(1 + z)
-            for(iW = 0; iW < nWaves; ++iW)
-                obsWaves[iW] = waves[iW]*(1. + z);
-            for(iAZ = 0; iAZ < nAge*nZ; ++iAZ) {
-                pData = readyData + iAZ*nWaves;
-                pObsData = obsData + iAZ*nWaves;
-                for(iW = 0; iW < nWaves; ++iW)
-                    pObsData[iW] = pData[iW]/(1. + z);           
+    // Drop nodes from the smallest score until the budget is used up
+    for(iO = 0; iO < nMerged && order[iO].score <= 1.; ++iO) {
+        pMax = maxWorking + output[order[iO].pos].index*nFlux;
+        fits = 1;
+        for(iF = 0; iF < nFlux; ++iF)
+            if (dropped[iF] + sfr[order[iO].pos]*pMax[iF] > budgetFactor[iF]*total[iF]) {
+                fits = 0;
+                break;
             }
-            if (LyAbsorption != NULL)
-                // Add IGM absorption
-                 for(iAZ = 0; iAZ < nAge*nZ; ++iAZ) {
-                    pObsData = obsData + iAZ*nWaves;
-                    for(iW = 0; iW < nWaves; ++iW)
-                        pObsData[iW] *= LyAbsorption[iW];
-                    }       
+        if (fits) {
+            for(iF = 0; iF < nFlux; ++iF)
+                dropped[iF] += sfr[order[iO].pos]*pMax[iF];
+            sfr[order[iO].pos] = -1.;
         }
+    }
+    nKept = 0;
+    for(iO = 0; iO < nMerged; ++iO)
+        if (sfr[iO] >= 0.)
+            output[nKept++] = output[iO];
+    for(iF = 0; iF < nFlux; ++iF)
+        bounds[iF] = -2.5*log10(1. - dropped[iF]/total[iF]);
+    return nKept;
+}
 
 
-        if (filters == NULL) {
-            // Tranpose the templates such that the last dimension is the metallicity
-            #pragma omp single
-            if (nObs > 0) {
-                for(iZ = 0; iZ < nZ; ++iZ) 
-                    for(iA = 0; iA < nAge; ++iA) {
-                        // Use fluxes in the observer frame
-                        pObsData = obsData + (iZ*nAge + iA)*nWaves;
-                        for(iW = 0; iW < nWaves; ++iW)
-                            refSpectra[(iW*nAge + iA)*nZ + iZ] = pObsData[iW];
-                    }
-            }
-            else {
-                for(iZ = 0; iZ < nZ; ++iZ) 
-                    for(iA = 0; iA < nAge; ++iA) {
-                        pData = readyData + (iZ*nAge + iA)*nWaves;
-                        for(iW = 0; iW < nWaves; ++iW)
-                            refSpectra[(iW*nAge + iA)*nZ + iZ] = pData[iW];
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                             *
+ * Histograms of outputs                                                       *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define MAX_HIST_DIM 2
+
+struct histogram {
+    /* Weighted counts of galaxies in uniform bins of one or two quantities
+     * Each quantity is the column first minus the column second, or only 
+     * the column first if second is negative. Columns are the fluxes or 
+     * magnitudes of a galaxy followed by the results of the UV slope fit.
+     * weights: weight of each galaxy, which can be NULL
+     * counts: nBin[0] x nBin[1] counts, to which galaxies are added
+     */
+    int nDim;
+    int first[MAX_HIST_DIM];
+    int second[MAX_HIST_DIM];
+    double min[MAX_HIST_DIM];
+    double width[MAX_HIST_DIM];
+    int nBin[MAX_HIST_DIM];
+    double *weights;
+    double *counts;
+};
+
+
+double output_column(float *output, float *fits, int nFlux, int iG, int column) {
+    if (column < nFlux)
+        return output[(size_t)iG*nFlux + column];
+    return fits[(size_t)iG*N_FIT_RESULT + column - nFlux];
+}
+
+
+void fill_histograms(struct histogram *hists, int nHist, float *output, 
+                     int nGal, int nFlux, short withFits, short nThread) {
+    /* Add galaxies to histograms
+     * output: nGal x nFlux outputs followed by nGal x N_FIT_RESULT fit 
+     *         results if withFits is true
+     * Each thread counts galaxies in its own copy, and copies are added in
+     * the order of threads, so that the result does not depend on the 
+     * scheduling. Galaxies out of range or with a NaN are ignored.
+     */
+    int iH, iT;
+    long long iB;
+    long long *start = malloc((nHist + 1)*sizeof(long long));
+    float *fits = withFits ? output + (size_t)nGal*nFlux : NULL;
+    double *local;
+
+    start[0] = 0;
+    for(iH = 0; iH < nHist; ++iH)
+        start[iH + 1] = start[iH] + (long long)hists[iH].nBin[0]
+                                    *(hists[iH].nDim > 1 ? hists[iH].nBin[1] : 1);
+    local = calloc((size_t)nThread*start[nHist], sizeof(double));
+
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(hists, nHist, output, fits, nGal, nFlux, local, start) \
+    num_threads(nThread)
+    {
+        int iG, iH, iD;
+        long long idx;
+        double value;
+        struct histogram *hist;
+        double *counts = local + (size_t)omp_get_thread_num()*start[nHist];
+
+        #pragma omp for schedule(static)
+        for(iG = 0; iG < nGal; ++iG)
+            for(iH = 0; iH < nHist; ++iH) {
+                hist = hists + iH;
+                idx = 0;
+                for(iD = 0; iD < hist->nDim; ++iD) {
+                    value = output_column(output, fits, nFlux, iG, hist->first[iD]);
+                    if (hist->second[iD] >= 0)
+                        value -= output_column(output, fits, nFlux, iG, hist->second[iD]);
+                    value = floor((value - hist->min[iD])/hist->width[iD]);
+                    if (!(value >= 0. && value < hist->nBin[iD])) {
+                        idx = -1;
+                        break;
                     }
-            }
-        }
-        else {
-            // Intgrate SED templates over filters
-            // Compute fluxes in rest frame filters
-            n = nRest*nAge;
-            #pragma omp for schedule(static,1)
-            for(i = 0; i < n; ++i) {
-                pFilter = filters + i/nAge*nWaves;
-                pData = refSpectra + i*nZ;
-                for(iZ = 0; iZ < nZ; ++iZ)
-                    pData[iZ] = trapz_filter(pFilter, readyData + (iZ*nAge + i%nAge)*nWaves, 
-                                             waves, nWaves);
-                }
-            // Compute fluxes in observer frame filters
-            n = nFlux*nAge;
-            #pragma omp for schedule(static,1)
-            for(i = nRest*nAge; i < n; ++i) {
-                pFilter = filters + i/nAge*nWaves;
-                pData = refSpectra + i*nZ;
-                for(iZ = 0; iZ < nZ; ++iZ)
-                    pData[iZ] = trapz_filter(pFilter, obsData + (iZ*nAge+ i%nAge)*nWaves, 
-                                             obsWaves, nWaves);
+                    idx = idx*hist->nBin[iD] + (long long)value;
                 }
+                if (idx >= 0)
+                    counts[start[iH] + idx] += hist->weights == NULL ? 1. : hist->weights[iG];
             }
-
-        // Interploate SED templates along metallicities
-        n = (maxZ - minZ + 1)*nAge;
-        #pragma omp for schedule(static,1)
-        for(i = 0; i < n; ++i) {
-            interpZ = (minZ + i/nAge + 1.)/1000.;
-            pData = workingData + i*nFlux;
-            for(iF = 0; iF < nFlux; ++iF) 
-                pData[iF] = interp(interpZ, Z, refSpectra + (iF*nAge+ i%nAge)*nZ, nZ);
-        }
-    }
-    
-    if (nObs > 0) {
-        free(obsWaves);
-        free(obsData);
     }
-    free(refSpectra);
-
+    for(iT = 0; iT < nThread; ++iT)
+        for(iH = 0; iH < nHist; ++iH)
+            for(iB = 0; iB < start[iH + 1] - start[iH]; ++iB)
+                hists[iH].counts[iB] += local[iT*start[nHist] + start[iH] + iB];
+    free(local);
+    free(start);
 }
 
 
@@ -624,149 +2865,868 @@ inline void templates_working(struct sed_params *rawSpectra,
  * Primary Functions                                                           *
  *                                                                             *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-float *composite_spectra_cext(struct sed_params *rawSpectra,
-                              struct prop_set *galProps, int nGal,
+double *double_integrated(struct sed_params *rawSpectra, struct tmp_params *spectra) {
+    /* Return integrated templates in double precision, which is a new copy
+     * if they are only kept in single precision
+     */
+    if (spectra->integrated != NULL)
+        return spectra->integrated;
+    return to_double(spectra->integratedF, 
+                     (size_t)rawSpectra->nZ*spectra->nAgeList*rawSpectra->nWaves);
+}
+
+
+double *new_working(struct sed_params *rawSpectra, struct tmp_params *spectra, 
+                    double *integrated, double *absorption, double z, 
+                    int nFlux, int nObs, short nThread) {
+    /* Return new working templates in double precision built from the 
+     * integrated templates and the filters of spectra, which are not kept 
+     * by spectra
+     */
+    double *working;
+    double *ownIntegrated = spectra->integrated;
+    spectra->integrated = integrated;
+    spectra->working = NULL;
+    templates_working(rawSpectra, spectra, absorption, z, spectra->filters, 
+                      nFlux, nObs, nThread);
+    working = spectra->working;
+    spectra->integrated = ownIntegrated;
+    spectra->working = NULL;
+    return working;
+}
+
+
+long long build_working(struct sed_params *rawSpectra, struct tmp_params *spectra,
+                        double *integrated, double *absorption, double z, 
+                        int nFlux, int nObs, short singlePrecision, short nThread) {
+    /* Build the working templates of spectra in the given precision, and 
+     * return their size in bytes. In single precision, the templates are 
+     * built in a scratch buffer, which is freed after the conversion.
+     */
+    size_t workingSize = (size_t)(rawSpectra->maxZ + 1)*spectra->nAgeList*nFlux;
+    double *working = new_working(rawSpectra, spectra, integrated, absorption, z, 
+                                  nFlux, nObs, nThread);
+    spectra->workingReady = 1;
+    if (singlePrecision) {
+        spectra->workingF = to_float(working, workingSize);
+        free(working);
+        return workingSize*sizeof(float);
+    }
+    spectra->working = working;
+    return workingSize*sizeof(double);
+}
+
+
+void prepare_templates(struct mag_context *ctx, struct sed_params *rawSpectra,
+                       double z, double *ageList, int nAgeList, 
+                       double *filters, int nFlux, int nObs, 
+                       double *absorption, double *integrated, short working,
+                       struct run_stats *stats) {
+    /* Build templates of a context that have not been built yet
+     * If working is true, also build the working templates, i.e. templates
+     * integrated over time and filters, which are used without dust
+     * Templates are kept in the precision of the context
+     */
+    int nZ = rawSpectra->nZ;
+    int nWaves = rawSpectra->nWaves;
+    size_t intSize = (size_t)nZ*nAgeList*nWaves;
+    long long nByte;
+    double *pIntegrated;
+    double t0;
+
+    if (ctx->spectra == NULL) {
+        t0 = stats_clock();
+        ctx->spectra = init_template(ageList, nAgeList, integrated);
+        nByte = 0;
+        if (integrated == NULL) {
+            pIntegrated = malloc(intSize*sizeof(double));
+            templates_time_integration(rawSpectra, ageList, nAgeList, pIntegrated);
+            if (ctx->singlePrecision) {
+                ctx->spectra->integratedF = to_float(pIntegrated, intSize);
+                free(pIntegrated);
+                nByte = intSize*sizeof(float);
+            }
+            else {
+                ctx->spectra->integrated = pIntegrated;
+                ctx->spectra->ownIntegrated = 1;
+                nByte = intSize*sizeof(double);
+            }
+        }
+        add_serial_stats(stats, STAGE_TEMPLATES, stats_clock() - t0, 1, 0, nByte);
+        if (filters != NULL) {
+            t0 = stats_clock();
+            ctx->spectra->filters = init_sparse_filters(rawSpectra, absorption, 
+                                                        filters, nFlux, nObs);
+            add_serial_stats(stats, STAGE_FILTERS, stats_clock() - t0, 1, 0,
+                             ctx->spectra->filters->offsets[nFlux]*sizeof(double) 
+                             + nFlux*(2*sizeof(int) + sizeof(long long)));
+        }
+    }
+    if (working && !ctx->spectra->workingReady) {
+        t0 = stats_clock();
+        pIntegrated = double_integrated(rawSpectra, ctx->spectra);
+        nByte = build_working(rawSpectra, ctx->spectra, pIntegrated, absorption, z, 
+                              nFlux, nObs, ctx->singlePrecision, ctx->nThread);
+        if (pIntegrated != ctx->spectra->integrated)
+            free(pIntegrated);
+        add_serial_stats(stats, STAGE_FILTERS, stats_clock() - t0, 1, 0, nByte);
+    }
+}
+
+
+void prepare_lightcone(struct mag_context *ctx, struct sed_params *rawSpectra,
+                       int nFlux, int nObs, short dust, struct run_stats *stats) {
+    /* Build templates of each node of the lightcone of a context that have 
+     * not been built yet, after the templates of the context. Working 
+     * templates are built without dust, and weights of spectra are built 
+     * with dust in single precision. Nodes do not keep integrated templates.
+     */
+    int k;
+    int nWaves = rawSpectra->nWaves;
+    short singlePrecision = ctx->singlePrecision;
+    struct lightcone *lightcone = ctx->lightcone;
+    struct tmp_params *node;
+    double *absorption;
+    double *pIntegrated = NULL;
+    double t0 = stats_clock();
+    long long nByte = 0;
+
+    for(k = 0; k < lightcone->nGrid; ++k) {
+        absorption = lightcone->absorption == NULL ? NULL 
+                     : lightcone->absorption + (size_t)k*nWaves;
+        if (lightcone->spectra[k] == NULL) {
+            node = init_template(ctx->spectra->ageList, ctx->spectra->nAgeList,
+                                 ctx->spectra->integrated);
+            node->filters = init_sparse_filters(rawSpectra, absorption, 
+                                                lightcone->filters + (size_t)k*nFlux*nWaves,
+                                                nFlux, nObs);
+            lightcone->spectra[k] = node;
+            nByte += node->filters->offsets[nFlux]*sizeof(double);
+        }
+        node = lightcone->spectra[k];
+        if (!dust && !node->workingReady) {
+            if (pIntegrated == NULL)
+                pIntegrated = double_integrated(rawSpectra, ctx->spectra);
+            nByte += build_working(rawSpectra, node, pIntegrated, absorption, 
+                                   lightcone->zGrid[k], nFlux, nObs, singlePrecision, 
+                                   ctx->nThread);
+        }
+        if (dust && singlePrecision && node->fluxWeights == NULL) {
+            node->fluxWeights = init_flux_weights(rawSpectra, absorption, lightcone->zGrid[k],
+                                                  node->filters, nObs);
+            nByte += node->filters->offsets[nFlux]*sizeof(float);
+        }
+    }
+    if (pIntegrated != NULL && pIntegrated != ctx->spectra->integrated)
+        free(pIntegrated);
+    add_serial_stats(stats, STAGE_FILTERS, stats_clock() - t0, 1, 0, nByte);
+}
+
+
+float *composite_spectra_cext(struct mag_context *ctx,
+                              struct sed_params *rawSpectra,
+                              struct gal_props *galProps,
                               double z, double *ageList, int nAgeList,
-                              double *filters, double* logWaves, int nFlux, int nObs,
+                              double *filters, double* logWaves, double *fitWeights, 
+                              int nFlux, int nObs,
                               double *absorption, struct dust_params *dustArgs,
-                              short outType, short nThread) {
-    g_nThread = nThread;
-
-    int iF, iG, iP, iFG;
-    double *pData;
+                              double *redshifts, double *integrated, short outType,
+                              struct histogram *hists, int nHist,
+                              struct run_stats *stats) {
+    /* ctx: context of the call, which gives the number of threads and the
+     *      precision, and keeps the templates for later calls
+     * fitWeights: weights of fluxes in the fit of UV slopes, which can be NULL
+     * redshifts: redshift of each galaxy, which requires the lightcone of 
+     *            the context, or NULL to use z for all galaxies
+     * Galaxies are added to the nHist histograms hists
+     * If stats is not NULL, statistics of this call are added to it 
+     */
+    short nThread = ctx->nThread;
+    short singlePrecision = ctx->singlePrecision;
+    int iG;
+    size_t iFG;
+    int nGal = galProps->nGal;
+    long long *offsets = galProps->offsets;
+    struct props *nodes = galProps->nodes;
+    struct run_stats localStats;
+    double t0;
+    int nZ = rawSpectra->nZ;
+    int nWaves = rawSpectra->nWaves;
+    struct tmp_params *tmpSpectra;
+    struct sparse_filters *sparse;
+    #ifdef TIMING
+        struct timespec sTime, sTime2;
+    #endif
 
-    //Generate templates
-    if (g_spectra == NULL) {
-        g_spectra = init_template(rawSpectra, ageList, nAgeList, nFlux);
-        templates_time_integration(rawSpectra, ageList, nAgeList);
+    if (stats == NULL) {
+        init_stats(&localStats, nThread);
+        stats = &localStats;
+    }
+    check_stats(stats, nThread);
+
+    prepare_templates(ctx, rawSpectra, z, ageList, nAgeList, filters, nFlux, nObs, 
+                      absorption, integrated, dustArgs == NULL && redshifts == NULL, stats);
+    if (redshifts != NULL) {
+        if (ctx->lightcone == NULL) {
+            printf("Error: redshifts of galaxies require a lightcone\n");
+            exit(0);
+        }
+        prepare_lightcone(ctx, rawSpectra, nFlux, nObs, dustArgs != NULL, stats);
     }
-    double *fluxTmp = g_spectra->working;
-    double *flux = malloc(nFlux*sizeof(double));
+    struct lightcone *lightcone = ctx->lightcone;
+    tmpSpectra = ctx->spectra;
+    sparse = tmpSpectra->filters;
+    double *fluxTmp = tmpSpectra->working;
 
-    float *output = malloc(nGal*nFlux*sizeof(float));
+    float *output = malloc((size_t)nGal*nFlux*sizeof(float));
     float *pOutput = output;
 
-    struct prop_set *pGalProps;
-    struct props *pNodes;
-    int nProg;
-
-    double sfr;
-    int metals;
     int minZ = rawSpectra->minZ;
     int maxZ = rawSpectra->maxZ;
+    int nDone = 0;
+    double *startTime[N_STAGE];
+    int iS;
+    for(iS = 0; iS < N_STAGE; ++iS) {
+        startTime[iS] = malloc(stats->nThread*sizeof(double));
+        memcpy(startTime[iS], stats->stages[iS].threadTime, stats->nThread*sizeof(double));
+    }
 
     #ifdef TIMING
-        timing_start("Compute magnitudes\n");
+        timing_start(&sTime, "Compute magnitudes\n");
     #endif
-    if (dustArgs == NULL)
-        templates_working(rawSpectra, absorption, z, filters, nFlux, nObs);
-    for(iG = 0; iG < nGal; report(iG++, nGal)) {
-        // Initialise fluxes
-        for(iF = 0; iF < nFlux; ++iF)
-            flux[iF] = TOL;
-        // Add dust absorption to SED templates
-        #ifdef TIMING
-            if (iG < 10)
-                timing_start_sub();
-        #endif
-        if (dustArgs != NULL) {
-            dust_absorption(rawSpectra, dustArgs + iG);
-            #ifdef TIMING
-                if (iG < 10)
-                    timing_end_sub("Add dust absorption to SED templates\n");
-            #endif
-            templates_working(rawSpectra, absorption, z, filters, nFlux, nObs);
-            #ifdef TIMING 
-                if (iG < 10)
-                    timing_end_sub("Process working templates\n");
-            #endif
-        }
-        // Sum contributions from all progenitors
-        pGalProps = galProps + iG;
-        nProg = pGalProps->nNode;
-        for(iP = 0; iP < nProg; ++iP) {
-            pNodes = pGalProps->nodes + iP;
-            sfr = pNodes->sfr;
-            metals = (int)(pNodes->metals*1000 - .5);
-            if (metals < minZ)
-                metals = minZ;
-            else if (metals > maxZ)
-                metals = maxZ;
-            pData = fluxTmp + (metals*nAgeList + pNodes->index)*nFlux;
-            for(iF = 0 ; iF < nFlux; ++iF)
-                flux[iF] += sfr*pData[iF];
+    if (dustArgs == NULL) {
+        float *fluxTmpF = tmpSpectra->workingF;
+        // Galaxies are independent of each other. The number of progenitors
+        // varies a lot between galaxies, so they are dynamically scheduled.
+        // Each galaxy is summed by one thread in the same order as the
+        // serial loop, so the output does not depend on the number of threads
+        #pragma omp parallel \
+        default(none) \
+        firstprivate(offsets, nodes, nGal, fluxTmp, fluxTmpF, output, \
+                     nAgeList, nFlux, minZ, maxZ, singlePrecision, stats, \
+                     redshifts, lightcone) \
+        shared(nDone) \
+        num_threads(nThread)
+        {
+            int iF, iG;
+            int k = 0;
+            float *pOutput;
+            double *flux = malloc(nFlux*sizeof(double));
+            float *fluxF = malloc(nFlux*sizeof(float));
+            // Fluxes at the next node of the lightcone
+            double *nextFlux = malloc(nFlux*sizeof(double));
+            float *nextFluxF = malloc(nFlux*sizeof(float));
+            double *working = fluxTmp;
+            float *workingF = fluxTmpF;
+            double w = 0.;
+            int nBin = (maxZ + 1)*nAgeList;
+            struct sfh_bins *bins = init_sfh_bins(nBin);
+            long long nCall = 0;
+            long long nNode = 0;
+            double t0, t1, t2;
+            double accTime = 0.;
+            double outTime = 0.;
+
+            #pragma omp for schedule(dynamic, 16)
+            for(iG = 0; iG < nGal; ++iG) {
+                t0 = stats_clock();
+                pOutput = output + (size_t)iG*nFlux;
+                if (redshifts != NULL) {
+                    k = lightcone_node(lightcone, redshifts[iG], &w);
+                    working = lightcone->spectra[k]->working;
+                    workingF = lightcone->spectra[k]->workingF;
+                }
+                if (singlePrecision) {
+                    sum_progenitors_float(nodes + offsets[iG], offsets[iG + 1] - offsets[iG], 
+                                          workingF, nAgeList, minZ, maxZ, fluxF, nFlux, bins);
+                    if (w > 0.) {
+                        sum_progenitors_float(nodes + offsets[iG], 
+                                              offsets[iG + 1] - offsets[iG], 
+                                              lightcone->spectra[k + 1]->workingF, 
+                                              nAgeList, minZ, maxZ, nextFluxF, nFlux, bins);
+                        for(iF = 0; iF < nFlux; ++iF)
+                            fluxF[iF] += (float)w*(nextFluxF[iF] - fluxF[iF]);
+                    }
+                    t1 = stats_clock();
+                    for(iF = 0; iF < nFlux; ++iF) 
+                        pOutput[iF] = fluxF[iF] + (float)TOL;
+                }
+                else {
+                    sum_progenitors(nodes + offsets[iG], offsets[iG + 1] - offsets[iG], 
+                                    working, nAgeList, minZ, maxZ, flux, nFlux, bins);
+                    if (w > 0.) {
+                        sum_progenitors(nodes + offsets[iG], offsets[iG + 1] - offsets[iG], 
+                                        lightcone->spectra[k + 1]->working, 
+                                        nAgeList, minZ, maxZ, nextFlux, nFlux, bins);
+                        for(iF = 0; iF < nFlux; ++iF)
+                            flux[iF] += w*(nextFlux[iF] - flux[iF]);
+                    }
+                    t1 = stats_clock();
+                    for(iF = 0; iF < nFlux; ++iF) 
+                        pOutput[iF] = (float)flux[iF];
+                }
+                t2 = stats_clock();
+                accTime += t1 - t0;
+                outTime += t2 - t1;
+                ++nCall;
+                nNode += offsets[iG + 1] - offsets[iG];
+                report(&nDone, nGal);
+            }
+            add_thread_stats(stats, STAGE_ACCUMULATION, accTime, nCall, nNode,
+                             nBin*(sizeof(double) + sizeof(short) + sizeof(int)) 
+                             + nFlux*(sizeof(double) + sizeof(float)));
+            add_thread_stats(stats, STAGE_OUTPUT, outTime, nCall, 0, 0);
+            free_sfh_bins(bins);
+            free(flux);
+            free(fluxF);
+            free(nextFlux);
+            free(nextFluxF);
         }
-        #ifdef TIMING
-                if (iG < 10) {
-                    timing_end_sub("Sum contributions from all progenitors\n");
-                    printf("# \n");
+        finish_thread_stats(stats, STAGE_ACCUMULATION, startTime[STAGE_ACCUMULATION]);
+    }
+    else {
+        // Add dust absorption to the spectrum of each galaxy rather than
+        // the SED templates, so that galaxies are independent of each other
+        if (tmpSpectra->cumSpectra == NULL) {
+            t0 = stats_clock();
+            tmpSpectra->cumSpectra = init_cum_templates(rawSpectra);
+            if (singlePrecision)
+                cum_templates_to_float(tmpSpectra->cumSpectra);
+            add_serial_stats(stats, STAGE_TEMPLATES, stats_clock() - t0, 1, 0,
+                             2*(long long)nZ*rawSpectra->nAge*nWaves
+                             *(singlePrecision ? sizeof(float) : sizeof(double)));
+        }
+        if (singlePrecision && tmpSpectra->logRatio == NULL) {
+            t0 = stats_clock();
+            // Integrated templates owned by the context are already in float
+            if (tmpSpectra->integratedF == NULL)
+                tmpSpectra->integratedF = to_float(tmpSpectra->integrated, 
+                                                   (size_t)nZ*nAgeList*nWaves);
+            tmpSpectra->logRatio = malloc(nWaves*sizeof(float));
+            for(iG = 0; iG < nWaves; ++iG)
+                tmpSpectra->logRatio[iG] = (float)log(rawSpectra->waves[iG]/1600.);
+            add_serial_stats(stats, STAGE_TEMPLATES, stats_clock() - t0, 1, 0,
+                             ((long long)nZ*nAgeList*nWaves + nWaves)*sizeof(float));
+            t0 = stats_clock();
+            tmpSpectra->fluxWeights = init_flux_weights(rawSpectra, absorption, z, 
+                                                        sparse, nObs);
+            add_serial_stats(stats, STAGE_FILTERS, stats_clock() - t0, 1, 0,
+                             (sparse == NULL ? nWaves : sparse->offsets[nFlux])*sizeof(float));
+        }
+        float *fluxWeights = tmpSpectra->fluxWeights;
+        #pragma omp parallel \
+        default(none) \
+        firstprivate(rawSpectra, tmpSpectra, offsets, nodes, nGal, ageList, nAgeList, \
+                     absorption, dustArgs, z, sparse, fluxWeights, nFlux, nObs, output, \
+                     nWaves, singlePrecision, stats, redshifts, lightcone) \
+        shared(nDone) \
+        num_threads(nThread)
+        {
+            int iF, iG;
+            int k = 0;
+            float *pOutput;
+            double *flux = malloc(nFlux*sizeof(double));
+            float *fluxF = malloc(nFlux*sizeof(float));
+            // Fluxes at the next node of the lightcone
+            double *nextFlux = malloc(nFlux*sizeof(double));
+            float *nextFluxF = malloc(nFlux*sizeof(float));
+            struct sparse_filters *filters = sparse;
+            struct tmp_params *next;
+            float *weights = fluxWeights;
+            double w = 0.;
+            struct dust_buffers *buffers = init_dust_buffers(rawSpectra);
+            long long nCall = 0;
+            long long nNode = 0;
+            double t0, t1, t2, t3;
+            double dustTime = 0.;
+            double filterTime = 0.;
+            double outTime = 0.;
+
+            #pragma omp for schedule(dynamic, 16)
+            for(iG = 0; iG < nGal; ++iG) {
+                t0 = stats_clock();
+                pOutput = output + (size_t)iG*nFlux;
+                if (singlePrecision) {
+                    dust_absorption_float(rawSpectra, tmpSpectra, nodes + offsets[iG], 
+                                          offsets[iG + 1] - offsets[iG],
+                                          ageList, nAgeList, dustArgs + iG, buffers);
+                    t1 = stats_clock();
+                    if (redshifts != NULL) {
+                        k = lightcone_node(lightcone, redshifts[iG], &w);
+                        filters = lightcone->spectra[k]->filters;
+                        weights = lightcone->spectra[k]->fluxWeights;
+                    }
+                    spectra_to_flux_float(buffers, nWaves, filters, weights, fluxF);
+                    if (w > 0.) {
+                        next = lightcone->spectra[k + 1];
+                        spectra_to_flux_float(buffers, nWaves, next->filters, 
+                                              next->fluxWeights, nextFluxF);
+                        for(iF = 0; iF < nFlux; ++iF)
+                            fluxF[iF] += (float)w*(nextFluxF[iF] - fluxF[iF]);
+                    }
+                    t2 = stats_clock();
+                    for(iF = 0; iF < nFlux; ++iF) 
+                        pOutput[iF] = fluxF[iF] + (float)TOL;
                 }
-        #endif
-        // Store output
-        for(iF = 0; iF < nFlux; ++iF) 
-            *pOutput++ = (float)flux[iF];
+                else {
+                    dust_absorption(rawSpectra, tmpSpectra, nodes + offsets[iG], 
+                                    offsets[iG + 1] - offsets[iG],
+                                    ageList, nAgeList, dustArgs + iG, buffers);
+                    t1 = stats_clock();
+                    if (redshifts != NULL) {
+                        k = lightcone_node(lightcone, redshifts[iG], &w);
+                        filters = lightcone->spectra[k]->filters;
+                    }
+                    spectra_to_flux(rawSpectra, buffers, absorption, z, 
+                                    filters, nFlux, nObs, flux);
+                    if (w > 0.) {
+                        spectra_to_flux(rawSpectra, buffers, absorption, z, 
+                                        lightcone->spectra[k + 1]->filters, nFlux, nObs, 
+                                        nextFlux);
+                        for(iF = 0; iF < nFlux; ++iF)
+                            flux[iF] += w*(nextFlux[iF] - flux[iF]);
+                    }
+                    t2 = stats_clock();
+                    for(iF = 0; iF < nFlux; ++iF) 
+                        pOutput[iF] = (float)flux[iF];
+                }
+                t3 = stats_clock();
+                dustTime += t1 - t0;
+                filterTime += t2 - t1;
+                outTime += t3 - t2;
+                ++nCall;
+                nNode += offsets[iG + 1] - offsets[iG];
+                report(&nDone, nGal);
+            }
+            add_thread_stats(stats, STAGE_DUST, dustTime, nCall, nNode, buffers->nByte);
+            add_thread_stats(stats, STAGE_FILTERS, filterTime, nCall, 0, 
+                             nFlux*(sizeof(double) + sizeof(float)));
+            add_thread_stats(stats, STAGE_OUTPUT, outTime, nCall, 0, 0);
+            free_dust_buffers(buffers);
+            free(flux);
+            free(fluxF);
+            free(nextFlux);
+            free(nextFluxF);
+        }
+        finish_thread_stats(stats, STAGE_DUST, startTime[STAGE_DUST]);
+        finish_thread_stats(stats, STAGE_FILTERS, startTime[STAGE_FILTERS]);
     }
-    free(flux);
-    free_spectra();
+    finish_thread_stats(stats, STAGE_OUTPUT, startTime[STAGE_OUTPUT]);
 
+    t0 = stats_clock();
     if (outType == 0) {
         pOutput = output;
-        for(iFG = 0; iFG < nFlux*nGal; iFG++) {
+        for(iFG = 0; iFG < (size_t)nFlux*nGal; iFG++) {
             *pOutput = M_AB(*pOutput);
             ++pOutput;
         }
-        #ifdef TIMING
-            timing_end();
-        #endif
-        return output;
     }
-    else if (outType == 1) {
+    else if (outType == 2) {
+        // Fit UV slopes
+        int nFit = nFlux - 1;
+
+        output = (float*)realloc(output, (size_t)(nFlux + N_FIT_RESULT)*nGal*sizeof(float));
         #ifdef TIMING
-            timing_end();
+            timing_start_sub(&sTime2);
         #endif
-        return output;
+        fit_UV_slopes(output, nGal, nFlux, logWaves, fitWeights, 
+                      output + (size_t)nFlux*nGal, nThread);
+        #ifdef TIMING
+            timing_end_sub(&sTime2, "Fit UV slopes\n");
+        #endif       
+        // Convert to AB magnitude
+        pOutput = output + nFit;
+        for(iG = 0; iG < nGal; ++iG) {
+            *pOutput = M_AB(*pOutput);
+            pOutput += nFlux;
+        }
     }
-    
-    // Fit UV slopes
-    int nR = 3;
-    struct linResult result;
+    if (nHist > 0)
+        fill_histograms(hists, nHist, output, nGal, nFlux, outType == 2, nThread);
+    add_serial_stats(stats, STAGE_OUTPUT, stats_clock() - t0, 0, 0,
+                     (long long)nGal*(nFlux + (outType == 2 ? N_FIT_RESULT : 0))*sizeof(float));
+
+    for(iS = 0; iS < N_STAGE; ++iS)
+        free(startTime[iS]);
+    if (stats == &localStats)
+        free_stats(stats);
+    #ifdef TIMING
+        timing_end(&sTime);
+    #endif
+    return output;
+}
 
-    output = (float*)realloc(output, (nFlux + nR)*nGal*sizeof(float));
-    pOutput = output + nFlux*nGal;
-    float *pFit = output;
 
-    int nFit = nFlux - 1;
-    double *logf = malloc(nFit*sizeof(double));
+void reduce_spectra_cext(struct mag_context *ctx,
+                         struct sed_params *rawSpectra,
+                         struct gal_props *galProps,
+                         double z, double *ageList, int nAgeList,
+                         double *filters, double* logWaves, double *fitWeights, 
+                         int nFlux, int nObs,
+                         double *absorption, struct dust_params *dustArgs,
+                         double *redshifts, double *integrated, short outType,
+                         struct histogram *hists, int nHist,
+                         int blockSize, struct run_stats *stats) {
+    /* Add galaxies to histograms without keeping the output of each galaxy
+     * Galaxies are computed by composite_spectra_cext in blocks of 
+     * blockSize, so that the memory does not grow with the number of 
+     * galaxies. Other arguments are the same as composite_spectra_cext.
+     */
+    int iG, iH;
+    struct gal_props block;
+    struct histogram *blockHists = malloc(nHist*sizeof(struct histogram));
+
+    memcpy(blockHists, hists, nHist*sizeof(struct histogram));
+    block.nodes = galProps->nodes;
+    block.mapping = NULL;
+    block.mapSize = 0;
+    for(iG = 0; iG < galProps->nGal; iG += blockSize) {
+        block.nGal = galProps->nGal - iG < blockSize ? galProps->nGal - iG : blockSize;
+        block.offsets = galProps->offsets + iG;
+        for(iH = 0; iH < nHist; ++iH)
+            if (hists[iH].weights != NULL)
+                blockHists[iH].weights = hists[iH].weights + iG;
+        free(composite_spectra_cext(ctx, rawSpectra, &block, z, ageList, nAgeList,
+                                    filters, logWaves, fitWeights, nFlux, nObs, absorption, 
+                                    dustArgs == NULL ? NULL : dustArgs + iG,
+                                    redshifts == NULL ? NULL : redshifts + iG,
+                                    integrated, outType, blockHists, nHist, stats));
+    }
+    free(blockHists);
+}
 
-    #ifdef TIMING
-        timing_start_sub();
-    #endif
-    for(iG = 0; iG < nGal; ++iG) {
-        for(iF = 0; iF < nFit; ++iF) 
-            logf[iF] = log(pFit[iF]);
-        pFit += nFlux;
-
-        //printf("waves = %.1f, logf = %.1f\n", logWaves[1], logf[1]);
-        result = linregress(logWaves, logf, nFit);
-        pOutput[0] = (float)result.slope;
-        pOutput[1] = (float)result.intercept;
-        pOutput[2] = (float)result.R;
-        pOutput += nR;
-        //printf("Slope = %.1f\n", result.slope);
+
+struct gal_props *prune_progenitors_cext(struct mag_context *ctx,
+                                         struct sed_params *rawSpectra,
+                                         struct gal_props *galProps,
+                                         double z, double *ageList, int nAgeList,
+                                         double *filters, int nFlux, int nObs,
+                                         double *absorption, double *integrated,
+                                         double *tolerance, double *bounds,
+                                         struct run_stats *stats) {
+    /* Return progenitors of galaxies after merging and dropping nodes, such 
+     * that the magnitude of flux iF without dust changes by less than 
+     * tolerance[iF]
+     * bounds: nGal x nFlux upper bounds of the change of the magnitudes
+     * The working templates of the context are built if they have not been.
+     * A single precision context does not keep them in double precision, so
+     * they are built in a scratch buffer instead.
+     * galProps is not changed, and the result is owned by the caller.
+     */
+    short nThread = ctx->nThread;
+    int iG, iA, iZ, iF;
+    int nGal = galProps->nGal;
+    int minZ = rawSpectra->minZ;
+    int maxZ = rawSpectra->maxZ;
+    long long *offsets = galProps->offsets;
+    struct props *nodes = galProps->nodes;
+    long long *newOffsets = malloc((nGal + 1)*sizeof(long long));
+    long long *counts = malloc((nGal > 0 ? nGal : 1)*sizeof(long long));
+    struct props *newNodes;
+    struct gal_props *pruned = malloc(sizeof(struct gal_props));
+    double *working;
+    double *pIntegrated;
+    double *maxWorking = malloc(nAgeList*nFlux*sizeof(double));
+    double *budgetFactor = malloc(nFlux*sizeof(double));
+    double *startTime;
+    double t0;
+    struct run_stats localStats;
+
+    if (stats == NULL) {
+        init_stats(&localStats, nThread);
+        stats = &localStats;
     }
-    #ifdef TIMING
-        timing_end_sub("Fit UV slopes\n");
-    #endif       
-    // Convert to AB magnitude
-    pOutput = output + nFit;
+    check_stats(stats, nThread);
+    prepare_templates(ctx, rawSpectra, z, ageList, nAgeList, filters, nFlux, nObs, 
+                      absorption, integrated, !ctx->singlePrecision, stats);
+    t0 = stats_clock();
+    if (ctx->singlePrecision) {
+        pIntegrated = double_integrated(rawSpectra, ctx->spectra);
+        working = new_working(rawSpectra, ctx->spectra, pIntegrated, absorption, z, 
+                              nFlux, nObs, nThread);
+        if (pIntegrated != ctx->spectra->integrated)
+            free(pIntegrated);
+    }
+    else
+        working = ctx->spectra->working;
+    for(iA = 0; iA < nAgeList; ++iA)
+        for(iF = 0; iF < nFlux; ++iF) {
+            maxWorking[iA*nFlux + iF] = 0.;
+            for(iZ = minZ; iZ <= maxZ; ++iZ)
+                maxWorking[iA*nFlux + iF] = fmax(maxWorking[iA*nFlux + iF], 
+                                                 working[(iZ*nAgeList + iA)*nFlux + iF]);
+        }
+    for(iF = 0; iF < nFlux; ++iF)
+        budgetFactor[iF] = 1. - pow(10., -.4*tolerance[iF]);
+
+    // Galaxies are pruned in place of a copy of the arena, and then packed
+    // Zero the padding of nodes so that saved files are reproducible
+    newNodes = calloc(offsets[nGal] - offsets[0] > 0 ? offsets[nGal] - offsets[0] : 1, 
+                      sizeof(struct props));
+    add_serial_stats(stats, STAGE_PRUNING, stats_clock() - t0, 0, 0, 
+                     (nAgeList + 1)*nFlux*sizeof(double) 
+                     + (offsets[nGal] - offsets[0])*sizeof(struct props));
+    startTime = malloc(stats->nThread*sizeof(double));
+    memcpy(startTime, stats->stages[STAGE_PRUNING].threadTime, 
+           stats->nThread*sizeof(double));
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(offsets, nodes, newNodes, counts, nGal, working, maxWorking, \
+                 budgetFactor, nAgeList, minZ, maxZ, nFlux, bounds, stats) \
+    num_threads(nThread)
+    {
+        int iG;
+        struct prune_buffers *buffers = init_prune_buffers((maxZ + 1)*nAgeList, nFlux);
+        long long nCall = 0;
+        long long nNode = 0;
+        double t0;
+        double pruneTime = 0.;
+
+        #pragma omp for schedule(dynamic, 16)
+        for(iG = 0; iG < nGal; ++iG) {
+            t0 = stats_clock();
+            counts[iG] = prune_galaxy(nodes + offsets[iG], offsets[iG + 1] - offsets[iG],
+                                      working, maxWorking, nAgeList, minZ, maxZ, nFlux, 
+                                      budgetFactor, newNodes + offsets[iG] - offsets[0],
+                                      bounds + (size_t)iG*nFlux, buffers);
+            pruneTime += stats_clock() - t0;
+            ++nCall;
+            nNode += offsets[iG + 1] - offsets[iG];
+        }
+        add_thread_stats(stats, STAGE_PRUNING, pruneTime, nCall, nNode,
+                         (long long)buffers->capacity
+                         *(sizeof(double) + sizeof(struct prune_node))
+                         + (maxZ + 1)*nAgeList*sizeof(int) + 2*nFlux*sizeof(double));
+        free_prune_buffers(buffers);
+    }
+    finish_thread_stats(stats, STAGE_PRUNING, startTime);
+    free(startTime);
+    t0 = stats_clock();
+    newOffsets[0] = 0;
     for(iG = 0; iG < nGal; ++iG) {
-        *pOutput = M_AB(*pOutput);
-        pOutput += nFlux;
+        memmove(newNodes + newOffsets[iG], newNodes + offsets[iG] - offsets[0], 
+                counts[iG]*sizeof(struct props));
+        newOffsets[iG + 1] = newOffsets[iG] + counts[iG];
     }
+    newNodes = realloc(newNodes, (newOffsets[nGal] > 0 ? newOffsets[nGal] : 1)
+                                 *sizeof(struct props));
+    add_serial_stats(stats, STAGE_PRUNING, stats_clock() - t0, 0, 0, 0);
+    free(counts);
+    free(maxWorking);
+    free(budgetFactor);
+    if (working != ctx->spectra->working)
+        free(working);
+    if (stats == &localStats)
+        free_stats(stats);
+
+    pruned->nGal = nGal;
+    pruned->offsets = newOffsets;
+    pruned->nodes = newNodes;
+    pruned->mapping = NULL;
+    pruned->mapSize = 0;
+    return pruned;
+}
 
-    #ifdef TIMING
-        timing_end();
-    #endif
-    return output;
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                             *
+ * Dust model of Mason et al. 2015                                             *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define DUST_C -2.33
+#define DUST_M0 -19.5
+#define DUST_BRIGHTER -35.
+#define DUST_FAINTER 0.
+#define DUST_BOUND -5.
+// Tolerances of the root finding, which are the same as scipy.optimize.brentq
+#define DUST_XTOL 2e-12
+#define DUST_RTOL 8.881784197001252e-16
+#define DUST_MAXITER 100
+
+inline double beta_MUV(double obsMag, double slope, double inter) {
+    if (obsMag >= DUST_M0)
+        return (inter - DUST_C)*exp(slope*(obsMag - DUST_M0)/(inter - DUST_C)) + DUST_C;
+    else
+        return slope*(obsMag - DUST_M0) + inter;
+}
+
+
+inline double dust_equation(double obsMag, double slope, double inter, double ref) {
+    /* The Meurer relation is obsMag - insMag = 4.43 + 1.99*(beta + noise), 
+     * where ref = insMag + 1.99*noise
+     */
+    return obsMag - ref - (4.43 + 1.99*beta_MUV(obsMag, slope, inter));
+}
+
+
+double solve_dust_equation(double slope, double inter, double ref) {
+    /* Find the observed magnitude by the Brent method 
+     * Return NAN if there is no root between DUST_BRIGHTER and DUST_FAINTER
+     */
+    int i;
+    double xPre = DUST_BRIGHTER;
+    double xCur = DUST_FAINTER;
+    double xBlk = 0.;
+    double fPre = dust_equation(xPre, slope, inter, ref);
+    double fCur = dust_equation(xCur, slope, inter, ref);
+    double fBlk = 0.;
+    double sPre = 0.;
+    double sCur = 0.;
+    double sBis, sTry, dPre, dBlk, delta;
+
+    if (fPre*fCur > 0.)
+        return NAN;
+    if (fPre == 0.)
+        return xPre;
+    if (fCur == 0.)
+        return xCur;
+    for(i = 0; i < DUST_MAXITER; ++i) {
+        if (fPre != 0. && fCur != 0. && (signbit(fPre) != signbit(fCur))) {
+            xBlk = xPre;
+            fBlk = fPre;
+            sPre = sCur = xCur - xPre;
+        }
+        if (fabs(fBlk) < fabs(fCur)) {
+            xPre = xCur;
+            xCur = xBlk;
+            xBlk = xPre;
+            fPre = fCur;
+            fCur = fBlk;
+            fBlk = fPre;
+        }
+        delta = (DUST_XTOL + DUST_RTOL*fabs(xCur))/2.;
+        sBis = (xBlk - xCur)/2.;
+        if (fCur == 0. || fabs(sBis) < delta)
+            return xCur;
+        if (fabs(sPre) > delta && fabs(fCur) < fabs(fPre)) {
+            if (xPre == xBlk)
+                // Interpolate
+                sTry = -fCur*(xCur - xPre)/(fCur - fPre);
+            else {
+                // Extrapolate
+                dPre = (fPre - fCur)/(xPre - xCur);
+                dBlk = (fBlk - fCur)/(xBlk - xCur);
+                sTry = -fCur*(fBlk*dBlk - fPre*dPre)/(dBlk*dPre*(fBlk - fPre));
+            }
+            if (2.*fabs(sTry) < fmin(fabs(sPre), 3.*fabs(sBis) - delta)) {
+                // Accept the step
+                sPre = sCur;
+                sCur = sTry;
+            }
+            else {
+                // Bisect
+                sPre = sBis;
+                sCur = sBis;
+            }
+        }
+        else {
+            sPre = sBis;
+            sCur = sBis;
+        }
+        xPre = xCur;
+        fPre = fCur;
+        if (fabs(sCur) > delta)
+            xCur += sCur;
+        else
+            xCur += sBis > 0. ? delta : -delta;
+        fCur = dust_equation(xCur, slope, inter, ref);
+    }
+    return xCur;
+}
+
+
+void dust_extinction_cext(double *M1600, double *noise, int nM, 
+                          double slope, double inter, double *A1600, short nThread) {
+    /* Dust extinction at rest frame 1600 angstrom by solving the Meurer
+     * relation for each galaxy
+     *
+     * noise: scatter of beta of each galaxy, which can be NULL
+     * A1600: NAN if the relation has no solution
+     */
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(M1600, noise, nM, slope, inter, A1600) \
+    num_threads(nThread)
+    {
+        int iM;
+        double ref;
+
+        #pragma omp for schedule(static)
+        for(iM = 0; iM < nM; ++iM) {
+            if (M1600[iM] < DUST_BOUND) {
+                ref = M1600[iM] + 1.99*(noise != NULL ? noise[iM] : 0.);
+                A1600[iM] = solve_dust_equation(slope, inter, ref) - M1600[iM];
+                if (A1600[iM] < 0.)
+                    A1600[iM] = 0.;
+            }
+            else
+                A1600[iM] = 0.;
+        }
+    }
+}
+
+
+/* The noise only enters the Meurer relation through insMag + 1.99*noise, 
+ * so that the observed magnitude is a monotonic function of this single
+ * variable. Its inverse is tabulated on a uniform grid and interpolated 
+ * linearly.
+ */
+void dust_table_range(double slope, double inter, double *refMin, double *refMax) {
+    /* The range of the table is given by the bounds of the root finding */
+    *refMin = DUST_BRIGHTER - (4.43 + 1.99*beta_MUV(DUST_BRIGHTER, slope, inter));
+    *refMax = DUST_FAINTER - (4.43 + 1.99*beta_MUV(DUST_FAINTER, slope, inter));
+}
+
+
+void dust_inversion_table(double slope, double inter, double refMin, double dRef, int nRef,
+                          double *obsMag, short nThread) {
+    /* obsMag[iR] is the observed magnitude at insMag + 1.99*noise = refMin + iR*dRef */
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(slope, inter, refMin, dRef, nRef, obsMag) \
+    num_threads(nThread)
+    {
+        int iR;
+        #pragma omp for schedule(static)
+        for(iR = 0; iR < nRef; ++iR)
+            obsMag[iR] = solve_dust_equation(slope, inter, refMin + iR*dRef);
+    }
 }
 
+
+void dust_extinction_table(double *obsMag, double refMin, double dRef, int nRef,
+                           double *M1600, double *noise, int nM, 
+                           double *A1600, short nThread) {
+    /* The same as dust_extinction_cext but using the table given by
+     * dust_inversion_table
+     * A1600: NAN if insMag + 1.99*noise is beyond the table 
+     */
+    #pragma omp parallel \
+    default(none) \
+    firstprivate(obsMag, refMin, dRef, nRef, M1600, noise, nM, A1600) \
+    num_threads(nThread)
+    {
+        int iM, iR;
+        double w;
+
+        #pragma omp for schedule(static)
+        for(iM = 0; iM < nM; ++iM) {
+            if (M1600[iM] < DUST_BOUND) {
+                w = (M1600[iM] + 1.99*(noise != NULL ? noise[iM] : 0.) - refMin)/dRef;
+                if (w >= 0. && w <= nRef - 1) {
+                    iR = (int)w;
+                    if (iR > nRef - 2)
+                        iR = nRef - 2;
+                    w -= iR;
+                    A1600[iM] = obsMag[iR] + (obsMag[iR + 1] - obsMag[iR])*w - M1600[iM];
+                    if (A1600[iM] < 0.)
+                        A1600[iM] = 0.;
+                }
+                else
+                    A1600[iM] = NAN;
+            }
+            else
+                A1600[iM] = 0.;
+        }
+    }
+}
@@ -1,22 +1,36 @@
-int **g_firstProgenitor;
-int **g_nextProgenitor;
-float **g_metals;
-float **g_sfr;
-
 struct props {
     short index;
     float metals;
     float sfr;
 };
 
-struct prop_set {
+struct gal_props {
+    int nGal;
+    long long *offsets;
     struct props *nodes;
-    int nNode;
+    void *mapping;
+    size_t mapSize;
 };
 
-struct prop_set *read_properties_by_progenitors(int **firstProgenitor, int **nextProgenitor,
+struct gal_props *trace_progenitors(int **firstProgenitor, int **nextProgenitor,
+                                    float **galMetals, float **galSFR,
+                                    int tSnap, int *indices, int nGal, short nThread);
+
+struct gal_props *trace_progenitors_incremental(int **firstProgenitor, int **nextProgenitor,
                                                 float **galMetals, float **galSFR,
-                                                int tSnap, int *indices, int nGal);
+                                                int tSnap, int *indices, int nGal, 
+                                                int prevSnap, int *prevIndices,
+                                                struct gal_props *prevProps,
+                                                short nThread);
+
+void count_progenitors(int **firstProgenitor, int **nextProgenitor, float **galSFR,
+                       int tSnap, int *indices, int nGal, long long *counts, short nThread);
+
+void free_gal_props(struct gal_props *galProps);
+
+void save_gal_props(char *fName, struct gal_props *galProps, int *indices);
+
+struct gal_props *read_gal_props(char *fName, int iStart, int nGal);
 
 
 struct sed_params {
@@ -28,10 +42,27 @@ struct sed_params {
     int nWaves;
     double *age;
     int nAge;
+    // Ages are contiguous in data, and strides of metallicities and 
+    // wavelengths are given, so that data can be a window of a larger array
     double *data;
+    long long strideZ;
+    long long strideWaves;
 };
 
 
+void Lyman_absorption_cext(double *obsWaves, int nWaves, double z, 
+                           double *absorption);
+
+void Lyman_absorption_table(double *restWaves, int nWaves, 
+                            double zMin, double dz, int nZ, 
+                            double *table, short nThread);
+
+void Lyman_absorption_interp(double *table, int nWaves, 
+                             double zMin, double dz, int nZ,
+                             double *z, int nGal, double *absorption,
+                             short nThread);
+
+
 struct dust_params {
     double tauUV_ISM;
     double nISM;
@@ -41,9 +72,92 @@ struct dust_params {
 };
 
 
-float *composite_spectra_cext(struct sed_params *rawSpectra,
-                              struct prop_set *galProps, int nGal,
+#define N_STAGE 6
+
+struct stage_stats {
+    double wallTime;
+    double *threadTime;
+    long long nCall;
+    long long nNode;
+    long long nByte;
+};
+
+struct run_stats {
+    int nThread;
+    struct stage_stats stages[N_STAGE];
+};
+
+void init_stats(struct run_stats *stats, int nThread);
+void free_stats(struct run_stats *stats);
+
+
+#define MAX_HIST_DIM 2
+
+struct histogram {
+    int nDim;
+    int first[MAX_HIST_DIM];
+    int second[MAX_HIST_DIM];
+    double min[MAX_HIST_DIM];
+    double width[MAX_HIST_DIM];
+    int nBin[MAX_HIST_DIM];
+    double *weights;
+    double *counts;
+};
+
+
+struct mag_context;
+
+struct mag_context *init_context(short nThread, short singlePrecision);
+
+void free_context(struct mag_context *ctx);
+
+void init_lightcone(struct mag_context *ctx, int nGrid, double *zGrid, 
+                    double *filters, double *absorption);
+
+float *composite_spectra_cext(struct mag_context *ctx,
+                              struct sed_params *rawSpectra,
+                              struct gal_props *galProps,
                               double z, double *ageList, int nAgeList,
-                              double *filters, double *logWaves, int nFlux, int nObs,
+                              double *filters, double *logWaves, double *fitWeights, 
+                              int nFlux, int nObs,
                               double *absorption, struct dust_params *dustArgs,
-                              short outType, short nThread);
+                              double *redshifts, double *integrated, short outType,
+                              struct histogram *hists, int nHist,
+                              struct run_stats *stats);
+
+void reduce_spectra_cext(struct mag_context *ctx,
+                         struct sed_params *rawSpectra,
+                         struct gal_props *galProps,
+                         double z, double *ageList, int nAgeList,
+                         double *filters, double *logWaves, double *fitWeights, 
+                         int nFlux, int nObs,
+                         double *absorption, struct dust_params *dustArgs,
+                         double *redshifts, double *integrated, short outType,
+                         struct histogram *hists, int nHist,
+                         int blockSize, struct run_stats *stats);
+
+struct gal_props *prune_progenitors_cext(struct mag_context *ctx,
+                                         struct sed_params *rawSpectra,
+                                         struct gal_props *galProps,
+                                         double z, double *ageList, int nAgeList,
+                                         double *filters, int nFlux, int nObs,
+                                         double *absorption, double *integrated,
+                                         double *tolerance, double *bounds,
+                                         struct run_stats *stats);
+
+
+void templates_time_integration(struct sed_params *rawSpectra, 
+                                double *ageList, int nAgeList, double *intData);
+
+
+void dust_extinction_cext(double *M1600, double *noise, int nM, 
+                          double slope, double inter, double *A1600, short nThread);
+
+void dust_table_range(double slope, double inter, double *refMin, double *refMax);
+
+void dust_inversion_table(double slope, double inter, double refMin, double dRef, int nRef,
+                          double *obsMag, short nThread);
+
+void dust_extinction_table(double *obsMag, double refMin, double dRef, int nRef,
+                           double *M1600, double *noise, int nM, 
+                           double *A1600, short nThread);
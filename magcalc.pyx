@@ -1,16 +1,22 @@
 import os, sys
 from warnings import warn
 from time import time
-from struct import pack, unpack
-from copy import deepcopy
-
-from libc.stdlib cimport malloc, free
+from threading import Lock, RLock, Thread, Event, local
+try:
+    from Queue import Queue, Empty, Full
+except ImportError:
+    from queue import Queue, Empty, Full
+from collections import OrderedDict
+from hashlib import sha1
+
+from libc.stdlib cimport malloc, calloc, free
 from libc.string cimport memcpy
 from libc.math cimport exp, log
 
 import numpy as np
 from numpy import isnan, isscalar, vectorize
-from pandas import DataFrame
+import h5py
+from pandas import DataFrame, HDFStore, Index, concat
 
 from astropy.cosmology import FlatLambdaCDM
 from astropy import units as u
@@ -21,45 +27,46 @@ from dragons import meraxes
 # Basic functions                                                               #
 #                                                                               #
 # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
-global sTime
+# Start time of timing_start(...) in each thread
+g_timing = local()
+# HDF5 is not thread safe, so threads read and write HDF5 files in turn
+g_hdf5Lock = RLock()
 
 cdef int *init_1d_int(int[:] memview):
     cdef:
         int nSize = memview.shape[0]
-        int *p = <int*>malloc(nSize*sizeof(int))
-        int[:] cMemview = <int[:nSize]>p
-    cMemview[...] = memview
+        int *p = <int*>malloc(max(nSize, 1)*sizeof(int))
+        int[:] cMemview = <int[:max(nSize, 1)]>p
+    cMemview[:nSize] = memview
     return p
 
 
 cdef float *init_1d_float(float[:] memview):
     cdef:
         int nSize = memview.shape[0]
-        float *p = <float*>malloc(nSize*sizeof(float))
-        float[:] cMemview = <float[:nSize]>p
-    cMemview[...] = memview
+        float *p = <float*>malloc(max(nSize, 1)*sizeof(float))
+        float[:] cMemview = <float[:max(nSize, 1)]>p
+    cMemview[:nSize] = memview
     return p
 
 
 cdef double *init_1d_double(double[:] memview):
     cdef:
         int nSize = memview.shape[0]
-        double *p = <double*>malloc(nSize*sizeof(double))
-        double[:] cMemview = <double[:nSize]>p
-    cMemview[...] = memview
+        double *p = <double*>malloc(max(nSize, 1)*sizeof(double))
+        double[:] cMemview = <double[:max(nSize, 1)]>p
+    cMemview[:nSize] = memview
     return p
 
 
 def timing_start(text):
-    global sTime
-    sTime = time()
+    g_timing.sTime = time()
     print "#***********************************************************"
     print text
  
 
 def timing_end():
-    global sTime
-    elapsedTime = time() - sTime
+    elapsedTime = time() - g_timing.sTime
     minute = int(elapsedTime)/60
     print "# Done!"
     print "# Elapsed time: %i min %.6f sec"%(minute, elapsedTime - minute*60)
@@ -71,50 +78,81 @@ def timing_end():
 # Functions to load galaxy properties                                           #
 #                                                                               #
 # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
-cdef:
-    int **g_firstProgenitor = NULL
-    int **g_nextProgenitor = NULL
-    float **g_metals = NULL
-    float **g_sfr = NULL
-    # >>>>> New metallicity tracer
-    #float *g_dTime 
-    # <<<<<
+cdef class meraxes_trees:
+    #=====================================================================
+    # Merger trees and galaxy properties read from Meraxes output. Each 
+    # call of read_meraxes(...) returns its own trees, which are freed 
+    # with the object, so that several outputs can be used at the same 
+    # time.
+    #
+    # snapMin: the smallest snapshot number that contains a galaxy
+    # rows: galaxy indices of the rows loaded at each snapshot if Meraxes
+    #       output is read selectively; otherwise None
+    #=====================================================================
+    cdef:
+        int **firstProgenitor
+        int **nextProgenitor
+        # Unit: 1e10 M_sun (New metallicity tracer)
+        float **metals
+        # Unit: M_sun/yr
+        float **sfr
+        # >>>>> New metallicity tracer
+        #float *dTime 
+        # <<<<<
+        public int snapMin
+        public int snapMax
+        public object rows
+
+    def __cinit__(self, int snapMax):
+        # Pointers are set to NULL so that partially read trees can be freed
+        self.snapMin = snapMax
+        self.snapMax = snapMax
+        self.rows = None
+        self.firstProgenitor = <int**>calloc(snapMax + 1, sizeof(int*))
+        self.nextProgenitor = <int**>calloc(snapMax + 1, sizeof(int*))
+        self.metals = <float**>calloc(snapMax + 1, sizeof(float*))
+        self.sfr = <float**>calloc(snapMax + 1, sizeof(float*))
+
+    def __dealloc__(self):
+        cdef int i
+        for i in xrange(self.snapMax + 1):
+            free(self.firstProgenitor[i])
+            free(self.nextProgenitor[i])
+            free(self.metals[i])
+            free(self.sfr[i])
+        free(self.firstProgenitor)
+        free(self.nextProgenitor)
+        free(self.metals)
+        free(self.sfr)
+        # >>>>>  New metallicity tracer
+        #free(self.dTime) 
+        # <<<<<
 
-def read_meraxes(fname, int snapMax, h):
+
+def read_meraxes(fname, int snapMax, h, selection = None):
     #=====================================================================
     # This function reads meraxes output. It is called by galaxy_mags(...).
-    # Meraxes output is stored by g_firstProgenitor, g_nextProgenitor, g_metals
-    # and g_sfr. They are external variables of mag_calc_cext.c
     #
     # fname: path of the meraxes output
     # snapMax: start snapshot
     # h: liitle h
+    # selection: a dict of galaxy indices keyed by snapshots. If given, 
+    #            only these galaxies and their progenitors are read. Use 
+    #            meraxes_rows(...) to convert galaxy indices to rows.
     #
-    # Return: the smallest snapshot number that contains a galaxy
+    # Return: a meraxes_trees object
     #=====================================================================
+    if selection is not None:
+        return read_meraxes_selective(fname, snapMax, h, selection)
     cdef:
         int snapNum = snapMax+ 1
         int snapMin = snapMax
-        int snap, N
-        int[:] intMemview1, intMemview2
-        float[:] floatMemview1, floatMemview2
-    global g_firstProgenitor 
-    global g_nextProgenitor
-    global g_metals
-    global g_sfr
-    # >>>>> New metallicity tracer
-    #global g_dTime
-    # <<<<<
+        int snap
+        meraxes_trees trees = meraxes_trees(snapMax)
     timing_start("# Read meraxes output")
-    g_firstProgenitor = <int**>malloc(snapNum*sizeof(int*))
-    g_nextProgenitor = <int**>malloc(snapMax*sizeof(int*))
-    # Unit: 1e10 M_sun (New metallicity tracer)
-    g_metals = <float**>malloc(snapNum*sizeof(float*))
-    # Unit: M_sun/yr
-    g_sfr = <float**>malloc(snapNum*sizeof(float*))
     # >>>>>  New metallicity tracer
     # Unit: Myr
-    #g_dTime = init_1d_float(np.append([0], -np.diff(meraxes.io.read_snaplist(fname, h)[2])) \
+    #trees.dTime = init_1d_float(np.append([0], -np.diff(meraxes.io.read_snaplist(fname, h)[2])) \
     #                        .astype('f4'))
     # <<<<<
     meraxes.set_little_h(h = h)
@@ -127,64 +165,192 @@ def read_meraxes(fname, int snapMax, h):
             # <<<<< Old Metallicity tracer
             metals = gals["MetalsColdGas"]/gals["ColdGas"]
             metals[isnan(metals)] = 0.001
-            g_metals[snap] = init_1d_float(metals)
+            trees.metals[snap] = init_1d_float(metals)
             # >>>>> New metallicity tracer
-            #g_metals[snap] = init_1d_float(gals["MetalsStellarMass"])
+            #trees.metals[snap] = init_1d_float(gals["MetalsStellarMass"])
             # <<<<<
-            g_sfr[snap] = init_1d_float(gals["Sfr"])
+            trees.sfr[snap] = init_1d_float(gals["Sfr"])
             snapMin = snap
             gals = None
         except IndexError:
             print "# No galaxies in snapshot %d"%snap
             break;
     print "# snapMin = %d"%snapMin
+    trees.snapMin = snapMin
     for snap in xrange(snapMin, snapNum):
         # Copy first progenitor indices to the pointer
-        g_firstProgenitor[snap] = \
+        trees.firstProgenitor[snap] = \
         init_1d_int(meraxes.io.read_firstprogenitor_indices(fname, snap))
         # Copy next progenitor indices to the pointer
         if snap < snapMax:
-            g_nextProgenitor[snap] = \
+            trees.nextProgenitor[snap] = \
             init_1d_int(meraxes.io.read_nextprogenitor_indices(fname, snap))
 
     timing_end()    
-    return snapMin
+    return trees
 
 
-cdef void free_meraxes(int snapMin, int snapMax):
+DEF MERAXES_SLAB_FACTOR = 4
+
+def read_rows(dataset, rows):
     #=====================================================================
-    # Function to free g_firstProgenitor, g_nextProgenitor, 
-    # g_metals, and g_sfr
+    # Read rows of a HDF5 dataset. rows should be sorted and unique. If 
+    # they are dense, read them by one hyperslab; otherwise read them by 
+    # point selection.
     #=====================================================================
-    cdef int i
-    # There is no indices in g_nextProgenitor[snapMax]
-    for i in xrange(snapMin, snapMax):
-        free(g_nextProgenitor[i])
+    if len(rows) == 0:
+        return np.zeros(0, dtype = dataset.dtype)
+    iStart = rows[0]
+    iEnd = rows[-1] + 1
+    if iEnd - iStart <= MERAXES_SLAB_FACTOR*len(rows):
+        return dataset[iStart:iEnd][rows - iStart]
+    else:
+        return dataset[rows]
 
-    snapMax += 1
-    for i in xrange(snapMin, snapMax):
-        free(g_firstProgenitor[i])
-        free(g_metals[i])
-        free(g_sfr[i])
 
-    free(g_firstProgenitor)
-    free(g_nextProgenitor)
-    free(g_metals)
-    free(g_sfr)
-    # >>>>>  New metallicity tracer
-    #free(g_dTime) 
-    # <<<<<
+def remap_rows(indices, rows):
+    #=====================================================================
+    # Convert galaxy indices to positions in rows. Indices that are 
+    # negative or not in rows are converted to -1.
+    #=====================================================================
+    indices = np.asarray(indices)
+    pos = np.searchsorted(rows, indices)
+    pos[pos == len(rows)] = 0
+    found = (indices >= 0) & (len(rows) > 0)
+    if len(rows) > 0:
+        found &= rows[pos] == indices
+    return np.where(found, pos, -1).astype('i4')
 
 
-cdef extern from "mag_calc_cext.h":
+def read_meraxes_selective(fname, int snapMax, h, selection):
+    #=====================================================================
+    # The same as read_meraxes(...) but only reads galaxies given by 
+    # selection and their progenitors. Progenitors of each snapshot are 
+    # found from those of the next snapshot, and only their rows are read.
+    # Progenitor indices are converted to rows of the previous snapshot.
+    #=====================================================================
+    cdef:
+        int snapMin = snapMax
+        int snap
+        meraxes_trees trees = meraxes_trees(snapMax)
+    timing_start("# Read meraxes output selectively")
+    meraxes.set_little_h(h = h)
+    fp = h5py.File(fname, "r")
+    # Find the smallest snapshot in the same way as read_meraxes(...)
+    for snap in xrange(snapMax, -1, -1):
+        name = "Snap%03d/Galaxies"%snap
+        if name not in fp or len(fp[name]) == 0:
+            print "# No galaxies in snapshot %d"%snap
+            break
+        snapMin = snap
+    print "# snapMin = %d"%snapMin
+    trees.snapMin = snapMin
+    # Walk down merger trees
+    trees.rows = {}
+    rows = np.zeros(0, dtype = 'i4')
+    nRead = 0
+    nTotal = 0
+    for snap in xrange(snapMax, snapMin - 1, -1):
+        if snap in selection:
+            rows = np.union1d(rows, np.asarray(selection[snap], dtype = 'i4'))
+        trees.rows[snap] = rows
+        # Read properties of reachable galaxies
+        if len(rows) > 0:
+            gals = meraxes.io.read_gals(fname, snap, 
+                                        props = ["ColdGas", "MetalsColdGas", "Sfr"],
+                                        indices = rows)
+            metals = gals["MetalsColdGas"]/gals["ColdGas"]
+            metals[isnan(metals)] = 0.001
+            sfr = gals["Sfr"]
+            gals = None
+        else:
+            # Arrays are not empty so that they can be allocated
+            metals = np.zeros(1, dtype = 'f4')
+            sfr = np.zeros(1, dtype = 'f4')
+        trees.metals[snap] = init_1d_float(metals)
+        trees.sfr[snap] = init_1d_float(sfr)
+        nRead += len(rows)
+        nTotal += len(fp["Snap%03d/Galaxies"%snap])
+        firstProgenitor = read_rows(fp["Snap%03d/FirstProgenitorIndices"%snap], rows)
+        if snap > snapMin:
+            # Follow next progenitors until the end of each chain
+            nextIndices = fp["Snap%03d/NextProgenitorIndices"%(snap - 1)]
+            progenitors = [firstProgenitor[firstProgenitor >= 0]]
+            current = np.unique(progenitors[0])
+            while len(current) > 0:
+                current = read_rows(nextIndices, current)
+                current = np.unique(current[current >= 0])
+                progenitors.append(current)
+            rows = np.unique(np.concatenate(progenitors)).astype('i4')
+            # Convert progenitor indices to rows of the previous snapshot
+            prevRows = np.union1d(rows, np.asarray(selection.get(snap - 1, []), dtype = 'i4'))
+            firstProgenitor = remap_rows(firstProgenitor, prevRows)
+        else:
+            firstProgenitor = np.full(len(rows), -1, dtype = 'i4')
+        # A sentinel is appended so that no array is empty
+        trees.firstProgenitor[snap] = \
+        init_1d_int(np.append(firstProgenitor, -1).astype('i4'))
+        if snap < snapMax:
+            nextProgenitor = remap_rows(read_rows(fp["Snap%03d/NextProgenitorIndices"%snap], 
+                                                  trees.rows[snap]), trees.rows[snap])
+            trees.nextProgenitor[snap] = init_1d_int(np.append(nextProgenitor, -1).astype('i4'))
+    fp.close()
+    print "# %d out of %d galaxies are read"%(nRead, nTotal)
+    timing_end()    
+    return trees
+
+
+def meraxes_rows(trees, snap, galIndices):
+    #=====================================================================
+    # Convert galaxy indices at a snapshot to the rows loaded by 
+    # read_meraxes(...)
+    #=====================================================================
+    if trees.rows is None:
+        return np.asarray(galIndices, dtype = 'i4')
+    return remap_rows(galIndices, trees.rows[snap])
+
+
+def meraxes_selection(snapList, idxList):
+    #=====================================================================
+    # Combine galaxy indices of each snapshot to a selection of 
+    # read_meraxes(...)
+    #=====================================================================
+    selection = {}
+    for snap, galIndices in zip(snapList, idxList):
+        selection[snap] = np.union1d(selection.get(snap, np.zeros(0, dtype = 'i4')),
+                                     np.asarray(galIndices, dtype = 'i4'))
+    return selection
+
+
+cdef extern from "mag_calc_cext.h" nogil:
     struct props:
         short index
         float metals
         float sfr
 
-    struct prop_set:
+    struct gal_props:
+        int nGal
+        long long *offsets
         props *nodes
-        int nNode
+
+    gal_props *trace_progenitors(int **firstProgenitor, int **nextProgenitor,
+                                 float **galMetals, float **galSFR,
+                                 int tSnap, int *indices, int nGal, short nThread)
+
+    gal_props *trace_progenitors_incremental(int **firstProgenitor, int **nextProgenitor,
+                                             float **galMetals, float **galSFR,
+                                             int tSnap, int *indices, int nGal, 
+                                             int prevSnap, int *prevIndices,
+                                             gal_props *prevProps, short nThread)
+
+    void count_progenitors(int **firstProgenitor, int **nextProgenitor, float **galSFR,
+                           int tSnap, int *indices, int nGal, long long *counts, short nThread)
+
+    void free_gal_props(gal_props *galProps)
+
+    void save_gal_props(char *fName, gal_props *galProps, int *indices)
+
+    gal_props *read_gal_props(char *fName, int iStart, int nGal)
 
 cdef struct trace_params:
     int **firstProgenitor
@@ -199,36 +365,6 @@ cdef struct trace_params:
     props *nodes
     int nNode
 
-DEF MAX_NODE = 100000
-
-cdef void trace_progenitors(int snap, int galIdx, trace_params *args):
-    cdef:
-        float sfr
-        props *pNodes
-        int nProg
-    if galIdx >= 0:
-        sfr = args.sfr[snap][galIdx]
-        if sfr > 0.:
-            args.nNode += 1
-            nProg = args.nNode
-            if (nProg >= MAX_NODE):
-                raise MemoryError("Error: Number of progenitors exceeds MAX_NODE")
-            pNodes = args.nodes + nProg
-            pNodes.index = args.tSnap - snap
-            # <<<<< Old metallicity tracer
-            pNodes.metals = args.metals[snap][galIdx]
-            # >>>>> New metallicity tracer
-            #pNodes.metals = trace_metallicity(snap, galIdx, args)
-            # <<<<<
-            pNodes.sfr = sfr
-            #print "snap %d, galIdx %d, metals %.3f sfr %.3f\n"%(snap, galIdx, 
-            #                                                    args.metals[snap][galIdx], 
-            #                                                    sfr)
-        
-        trace_progenitors(snap - 1, args.firstProgenitor[snap][galIdx], args)
-        trace_progenitors(snap, args.nextProgenitor[snap][galIdx], args)
-
-
 cdef inline float trace_metallicity(int snap, int galIdx, trace_params *args):
     cdef:
         float progMetalsMass = 0
@@ -246,97 +382,43 @@ cdef inline float trace_metallicity(int snap, int galIdx, trace_params *args):
         return (args.metals[snap][galIdx] - progMetalsMass) \
                /args.sfr[snap][galIdx]/args.dTime[snap]*1e4
 
-# <<<<< Old metallicity tracer
-cdef prop_set *read_properties_by_progenitors(int **firstProgenitor, int **nextProgenitor,
-                                              float **galMetals, float **galSFR,
-                                              int tSnap, int *indices, int nGal):
-# >>>>> New metallicity tracer
-#cdef prop_set *read_properties_by_progenitors(int **firstProgenitor, int **nextProgenitor,
-#                                              float **galMetals, float **galSFR, float *dTime,
-#                                              int tSnap, int *indices, int nGal):
-# <<<<<
-    cdef:
-        int iG
-
-        size_t memSize
-        size_t totalMemSize = 0
-
-        prop_set *galProps = <prop_set*>malloc(nGal*sizeof(prop_set))
-        prop_set *pGalProps
-        props nodes[MAX_NODE]
-        trace_params args
-
-        int galIdx
-        int nProg
-        float sfr
-
-    args.firstProgenitor = firstProgenitor
-    args.nextProgenitor = nextProgenitor
-    args.metals = galMetals
-    args.sfr = galSFR
-    # >>>>>  New metallicity tracer
-    #args.dTime = dTime 
-    # <<<<<
-    args.tSnap = tSnap
-    args.nodes = nodes
-
+cdef gal_props *read_properties_by_progenitors(meraxes_trees trees,
+                                               int tSnap, int *indices, int nGal, 
+                                               short nThread, int prevSnap = -1, 
+                                               int *prevIndices = NULL,
+                                               gal_props *prevProps = NULL):
+    #=====================================================================
+    # Trace progenitors of galaxies at snapshot tSnap. If prevProps is 
+    # given, histories of galaxies prevIndices at snapshot prevSnap are 
+    # reused rather than traced again.
+    #=====================================================================
+    cdef gal_props *galProps
     timing_start("# Read galaxies properties")
-    for iG in xrange(nGal):
-        galIdx = indices[iG]
-        nProg = -1
-        sfr = galSFR[tSnap][galIdx]
-        if sfr > 0.:
-            nProg += 1
-            nodes[nProg].index = 0
-            # <<<<< Old metallicity tracer
-            nodes[nProg].metals = galMetals[tSnap][galIdx]
-            # >>>>> New metallicity tracer
-            #nodes[nProg].metals = trace_metallicity(tSnap, galIdx, &args)
-            # <<<<<
-            nodes[nProg].sfr = sfr
-        args.nNode = nProg
-        trace_progenitors(tSnap - 1, firstProgenitor[tSnap][galIdx], &args)
-        nProg = args.nNode + 1
-        pGalProps = galProps + iG
-        pGalProps.nNode = nProg
-        if nProg == 0:
-            pGalProps.nodes = NULL
-            print "Warning: snapshot %d, index %d"%(tSnap, galIdx)
-            print "         the star formation rate is zero throughout the histroy"
-        else:
-            memSize = nProg*sizeof(props)
-            pGalProps.nodes = <props*>malloc(memSize)
-            memcpy(pGalProps.nodes, nodes, memSize)
-            totalMemSize += memSize
-
-    print "# %.1f MB memory has been allocted"%(totalMemSize/1024./1024.)
+    with nogil:
+        galProps = trace_progenitors_incremental(trees.firstProgenitor, trees.nextProgenitor, 
+                                                 trees.metals, trees.sfr, tSnap, indices, nGal, 
+                                                 prevSnap, prevIndices, prevProps, nThread)
+    print "# %.1f MB memory has been allocted"%(galProps.offsets[nGal]*sizeof(props)/1024./1024.)
     timing_end()
     return galProps
 
 
-def trace_star_formation_history(fname, snap, galIndices, h):
+def trace_star_formation_history(fname, snap, galIndices, h, nThread = 1, selective = False):
     #=====================================================================
     # Read galaxy properties from Meraxes outputs
+    # If selective is true, only read progenitors of the given galaxies
     #=====================================================================
-    cdef int snapMin = read_meraxes(fname, snap, h)
+    trees = read_meraxes(fname, snap, h, 
+                         meraxes_selection([snap], [galIndices]) if selective else None)
     # Trace galaxy merge trees
     cdef:
         int iG
         int nGal = len(galIndices)
-        int *indices = init_1d_int(np.asarray(galIndices, dtype = 'i4'))
-        # <<<<<Old Metallicity tracer
-        prop_set *galProps = \
-        read_properties_by_progenitors(g_firstProgenitor, g_nextProgenitor, g_metals, g_sfr,
-                                       snap, indices, nGal)
-
-        # >>>>>New metallicity tracer
-        #prop_set *galProps = \
-        #read_properties_by_progenitors(g_firstProgenitor, g_nextProgenitor, 
-        #                               g_metals, g_sfr, g_dTime,
-        #                               snap, indices, nGal)
-        # <<<<<
+        int *indices = init_1d_int(meraxes_rows(trees, snap, galIndices))
+        gal_props *galProps = read_properties_by_progenitors(trees, snap, indices, 
+                                                             nGal, nThread)
     free(indices)
-    free_meraxes(snapMin, snap)
+    trees = None
     # Convert output to numpy array
     cdef:
         int iN
@@ -345,22 +427,29 @@ def trace_star_formation_history(fname, snap, galIndices, h):
         double[:, ::1] mvNodes
     output = np.empty(nGal, dtype = object)
     for iG in xrange(nGal):
-        nNode = galProps[iG].nNode
-        nodes = galProps[iG].nodes
+        nNode = galProps.offsets[iG + 1] - galProps.offsets[iG]
+        nodes = galProps.nodes + galProps.offsets[iG]
         mvNodes = np.zeros([nNode, 3])
         for iN in xrange(nNode):
             mvNodes[iN][0] = nodes[iN].index
             mvNodes[iN][1] = nodes[iN].metals
             mvNodes[iN][2] = nodes[iN].sfr
         output[iG] = np.asarray(mvNodes)
+    free_gal_props(galProps)
     return output
 
 
 def save_star_formation_history(fname, snapList, idxList, h, 
-                                prefix = 'sfh', outPath = './'):
+                                prefix = 'sfh', outPath = './', nThread = 1, 
+                                selective = False):
     """
     Store star formation history to the disk.
 
+    Each file starts with a versioned header followed by galaxy indices,
+    an offsets table and the progenitors of all galaxies. It can be
+    memory-mapped, and any range of galaxies can be loaded without
+    reading the rest of the file.
+
     Parameters
     ----------
     fname: str
@@ -377,10 +466,18 @@ def save_star_formation_history(fname, snapList, idxList, h,
         number of the snapshot.
     outPath: str
         Path to the output.
+    nThread: int
+        Number of threads used to trace merger trees.
+    selective: bool
+        If true, only the given galaxies and their progenitors are read 
+        from the Meraxes output.
+
+    Snapshots are traced in ascending order, and each of them reuses the
+    histories traced at the previous one.
     """
     cdef:
         int iS, nSnap
-        int snap, snapMax, snapMin
+        int snap, snapMax
     if isscalar(snapList):
         snapMax = snapList
         nSnap = 1
@@ -389,78 +486,85 @@ def save_star_formation_history(fname, snapList, idxList, h,
     else:
         snapMax = max(snapList)
         nSnap = len(snapList)
-    snapMin = read_meraxes(fname, snapMax, h)
+    trees = read_meraxes(fname, snapMax, h, 
+                         meraxes_selection(snapList, idxList) if selective else None)
     # Read and save galaxy merge trees
     cdef:
-        int iG, nGal
+        int nGal
         int *indices
-        prop_set *galProps
-
-        int iN, nNode
-        props *pNodes
-    for iS in xrange(nSnap):
+        int *rows
+        gal_props *galProps
+        int prevSnap = -1
+        int *prevIndices = NULL
+        gal_props *prevProps = NULL
+    for iS in sorted(xrange(nSnap), key = lambda i: snapList[i]):
         snap = snapList[iS]
-        fp = open(get_output_name(prefix, ".bin", snap, outPath), "wb")
         galIndices = idxList[iS]
         nGal = len(galIndices)
-        fp.write(pack('i', nGal))
-        fp.write(pack('%di'%nGal, *galIndices))
         indices = init_1d_int(np.asarray(galIndices, dtype = 'i4'))
-        # <<<<< Old Metallicity tracer
-        galProps = read_properties_by_progenitors(g_firstProgenitor, g_nextProgenitor, 
-                                                  g_metals, g_sfr, snap, indices, nGal)
-        # >>>>> New metallicity tracer
-        #galProps = read_properties_by_progenitors(g_firstProgenitor, g_nextProgenitor, 
-        #                                          g_metals, g_sfr, g_dTime,
-        #                                          snap, indices, nGal)
-        # <<<<<
+        rows = init_1d_int(meraxes_rows(trees, snap, galIndices))
+        galProps = read_properties_by_progenitors(trees, snap, rows, nGal, nThread, 
+                                                  prevSnap, prevIndices, prevProps)
+        save_gal_props(get_output_name(prefix, ".bin", snap, outPath).encode(), 
+                       galProps, indices)
         free(indices)
-        for iG in xrange(nGal):
-            nNode = galProps[iG].nNode
-            fp.write(pack('i', nNode))
-            pNodes = galProps[iG].nodes
-            for iN in xrange(nNode):
-                fp.write(pack('h', pNodes.index))
-                fp.write(pack('ff', pNodes.metals, pNodes.sfr))
-                pNodes += 1
-        fp.close()
-    free_meraxes(snapMin, snapMax)
-
-
-cdef prop_set *read_properties_by_file(name):
+        if prevProps != NULL:
+            free(prevIndices)
+            free_gal_props(prevProps)
+        prevSnap = snap
+        prevIndices = rows
+        prevProps = galProps
+    if prevProps != NULL:
+        free(prevIndices)
+        free_gal_props(prevProps)
+
+
+cdef gal_props *read_properties_by_file(name, int iStart = 0, int nGal = -1):
+    #=====================================================================
+    # Read progenitors of galaxies from iStart to iStart + nGal - 1 in
+    # a SFH file. If nGal is negative, read all galaxies after iStart.
+    #=====================================================================
     timing_start("# Read galaxies properties")
-    fp = open(name, "rb")
-    cdef:
-        int iG
-        int nGal = unpack('i', fp.read(sizeof(int)))[0]
-        prop_set *galProps = <prop_set*>malloc(nGal*sizeof(prop_set))
-        prop_set *pGalProps = galProps
-
-        int iN, nNode
-        props *pNodes
-    fp.read(nGal*sizeof(int)) # Skip galaxy indices
-    for iG in xrange(nGal):
-        pGalProps = galProps + iG
-        nNode = unpack('i', fp.read(sizeof(int)))[0]
-        pGalProps.nNode = nNode
-        pNodes = <props*>malloc(nNode*sizeof(props))
-        pGalProps.nodes = pNodes
-        for iN in xrange(nNode):
-            pNodes.index = unpack('h', fp.read(sizeof(short)))[0]
-            pNodes.metals = unpack('f', fp.read(sizeof(float)))[0]
-            pNodes.sfr = unpack('f', fp.read(sizeof(float)))[0]
-            pNodes += 1
-    fp.close()
+    cdef gal_props *galProps = read_gal_props(name.encode(), iStart, nGal)
     timing_end()
     return galProps
 
 
-def read_galaxy_indices(name):
-    fp = open(name, "rb")
-    nGal = unpack('i', fp.read(sizeof(int)))[0]
-    indices = np.array(unpack('%di'%nGal, fp.read(nGal*sizeof(int))))
-    fp.close()
-    return indices
+sfhHeader = np.dtype([('magic', 'S12'), ('version', 'i4'), ('nGal', 'i4'),
+                      ('nodeSize', 'i4'), ('nNode', 'i8')])
+
+def read_galaxy_indices(name, iStart = 0, nGal = -1):
+    #=====================================================================
+    # Return indices of galaxies from iStart to iStart + nGal - 1 in a 
+    # SFH file. If nGal is negative, return all galaxies after iStart.
+    #=====================================================================
+    header = np.fromfile(name, dtype = sfhHeader, count = 1)
+    if len(header) == 1 and header['magic'][0] == b"MAGCALC_SFH":
+        nTotal = header['nGal'][0]
+        offset = sfhHeader.itemsize
+    else:
+        # Files written before version 1
+        nTotal = np.fromfile(name, dtype = 'i4', count = 1)
+        if len(nTotal) == 0:
+            raise ValueError("\"%s\" is truncated or corrupt"%name)
+        nTotal = nTotal[0]
+        offset = sizeof(int)
+    if nGal < 0 or iStart + nGal > nTotal:
+        nGal = nTotal - iStart
+    return np.fromfile(name, dtype = 'i4', count = nGal, offset = offset + iStart*sizeof(int))
+
+
+def sfh_file_range(gals):
+    #=====================================================================
+    # Return (path, iStart, nGal) if gals refers to a SFH file; otherwise
+    # return None. gals can be a path or a tuple of (path, iStart, nGal).
+    #=====================================================================
+    if type(gals) is str:
+        return gals, 0, -1
+    elif type(gals) is tuple:
+        return gals
+    else:
+        return None
 
 
 def get_age_list(fname, snap, nAgeList, h):
@@ -505,9 +609,21 @@ def Lyman_absorption_Fan(double[:] obsWaves, double z):
     return np.asarray(absorption)
 
 
-DEF NLYMAN = 39 # Inoue calculated the absorption of 40th Lyman series
+cdef extern from "mag_calc_cext.h" nogil:
+    void Lyman_absorption_cext(double *obsWaves, int nWaves, double z, 
+                               double *absorption)
+
+    void Lyman_absorption_table(double *restWaves, int nWaves, 
+                                double zMin, double dz, int nZ, 
+                                double *table, short nThread)
 
-def Lyman_absorption_Inoue(double[:] obsWaves, double z):
+    void Lyman_absorption_interp(double *table, int nWaves, 
+                                 double zMin, double dz, int nZ,
+                                 double *z, int nGal, double *absorption,
+                                 short nThread)
+
+
+def Lyman_absorption_Inoue(obsWaves, double z):
     #=====================================================================
     # Function to calculate the optical depth of Inoue et al. 2014
     # It is called by galaxy_mags(...).
@@ -519,119 +635,87 @@ def Lyman_absorption_Inoue(double[:] obsWaves, double z):
     # Reference Inoue et al. 2014
     #=====================================================================
     cdef:
-        double LymanSeries[NLYMAN]
-        double LAF1[NLYMAN]
-        double LAF2[NLYMAN]
-        double LAF3[NLYMAN]
-        double DLA1[NLYMAN]
-        double DLA2[NLYMAN]
-
-    LymanSeries[:] = [1215.67, 1025.72, 972.537, 949.743, 937.803,
-                      930.748, 926.226, 923.150, 920.963, 919.352,
-                      918.129, 917.181, 916.429, 915.824, 915.329,
-                      914.919, 914.576, 914.286, 914.039, 913.826,
-                      913.641, 913.480, 913.339, 913.215, 913.104,
-                      913.006, 912.918, 912.839, 912.768, 912.703,
-                      912.645, 912.592, 912.543, 912.499, 912.458,
-                      912.420, 912.385, 912.353, 912.324]
-    LAF1[:] = [1.690e-02, 4.692e-03, 2.239e-03, 1.319e-03, 8.707e-04,
-               6.178e-04, 4.609e-04, 3.569e-04, 2.843e-04, 2.318e-04,
-               1.923e-04, 1.622e-04, 1.385e-04, 1.196e-04, 1.043e-04,
-               9.174e-05, 8.128e-05, 7.251e-05, 6.505e-05, 5.868e-05,
-               5.319e-05, 4.843e-05, 4.427e-05, 4.063e-05, 3.738e-05,
-               3.454e-05, 3.199e-05, 2.971e-05, 2.766e-05, 2.582e-05,
-               2.415e-05, 2.263e-05, 2.126e-05, 2.000e-05, 1.885e-05,
-               1.779e-05, 1.682e-05, 1.593e-05, 1.510e-05]
-    LAF2[:] = [2.354e-03, 6.536e-04, 3.119e-04, 1.837e-04, 1.213e-04,
-               8.606e-05, 6.421e-05, 4.971e-05, 3.960e-05, 3.229e-05,
-               2.679e-05, 2.259e-05, 1.929e-05, 1.666e-05, 1.453e-05,
-               1.278e-05, 1.132e-05, 1.010e-05, 9.062e-06, 8.174e-06,
-               7.409e-06, 6.746e-06, 6.167e-06, 5.660e-06, 5.207e-06,
-               4.811e-06, 4.456e-06, 4.139e-06, 3.853e-06, 3.596e-06,
-               3.364e-06, 3.153e-06, 2.961e-06, 2.785e-06, 2.625e-06,
-               2.479e-06, 2.343e-06, 2.219e-06, 2.103e-06]
-    LAF3[:] = [1.026e-04, 2.849e-05, 1.360e-05, 8.010e-06, 5.287e-06,
-               3.752e-06, 2.799e-06, 2.167e-06, 1.726e-06, 1.407e-06,
-               1.168e-06, 9.847e-07, 8.410e-07, 7.263e-07, 6.334e-07,
-               5.571e-07, 4.936e-07, 4.403e-07, 3.950e-07, 3.563e-07,
-               3.230e-07, 2.941e-07, 2.689e-07, 2.467e-07, 2.270e-07,
-               2.097e-07, 1.943e-07, 1.804e-07, 1.680e-07, 1.568e-07,
-               1.466e-07, 1.375e-07, 1.291e-07, 1.214e-07, 1.145e-07,
-               1.080e-07, 1.022e-07, 9.673e-08, 9.169e-08]
-    DLA1[:] = [1.617e-04, 1.545e-04, 1.498e-04, 1.460e-04, 1.429e-04,
-               1.402e-04, 1.377e-04, 1.355e-04, 1.335e-04, 1.316e-04,
-               1.298e-04, 1.281e-04, 1.265e-04, 1.250e-04, 1.236e-04,
-               1.222e-04, 1.209e-04, 1.197e-04, 1.185e-04, 1.173e-04,
-               1.162e-04, 1.151e-04, 1.140e-04, 1.130e-04, 1.120e-04,
-               1.110e-04, 1.101e-04, 1.091e-04, 1.082e-04, 1.073e-04,
-               1.065e-04, 1.056e-04, 1.048e-04, 1.040e-04, 1.032e-04,
-               1.024e-04, 1.017e-04, 1.009e-04, 1.002e-04]
-    DLA2[:] = [5.390e-05, 5.151e-05, 4.992e-05, 4.868e-05, 4.763e-05, 
-               4.672e-05, 4.590e-05, 4.516e-05, 4.448e-05, 4.385e-05, 
-               4.326e-05, 4.271e-05, 4.218e-05, 4.168e-05, 4.120e-05,
-               4.075e-05, 4.031e-05, 3.989e-05, 3.949e-05, 3.910e-05, 
-               3.872e-05, 3.836e-05, 3.800e-05, 3.766e-05, 3.732e-05,
-               3.700e-05, 3.668e-05, 3.637e-05, 3.607e-05, 3.578e-05,
-               3.549e-05, 3.521e-05, 3.493e-05, 3.466e-05, 3.440e-05,
-               3.414e-05, 3.389e-05, 3.364e-05, 3.339e-05]
+        double[::1] mvWaves = np.ascontiguousarray(obsWaves, dtype = 'f8')
+        int nWaves = mvWaves.shape[0]
+        double[::1] absorption = np.zeros(nWaves)
 
-    cdef:
-        int i, j
-        int nWaves = obsWaves.shape[0]
-        double[:] absorption = np.zeros(nWaves)
-        double tau
-        double lamObs, ratio
+    if nWaves > 0:
+        with nogil:
+            Lyman_absorption_cext(&mvWaves[0], nWaves, z, &absorption[0])
+    return np.asarray(absorption)
 
-    for i in xrange(nWaves):
-        tau = 0.
-        lamObs = obsWaves[i]
-        # Lyman series
-        for j in xrange(NLYMAN):
-            ratio = lamObs/LymanSeries[j]
-            if ratio < 1. + z:
-                # LAF terms
-                if ratio < 2.2:
-                    tau += LAF1[j]*ratio**1.2
-                elif ratio < 5.7:
-                    tau += LAF2[j]*ratio**3.7
-                else:
-                    tau += LAF3[j]*ratio**5.5
-                # DLA terms
-                if ratio < 3.:
-                    tau += DLA1[j]*ratio**2.
-                else:
-                    tau += DLA2[j]*ratio**3.
-        # Lyman continuum
-        ratio = lamObs/912.
-        # LAF terms
-        if z < 1.2:
-            if ratio < 1. + z:
-                tau += .325*(ratio**1.2 - (1. + z)**-.9*ratio**2.1)
-        elif z < 4.7:
-            if ratio < 2.2:
-                tau += 2.55e-2*(1. + z)**1.6*ratio**2.1 + .325*ratio**1.2 - .25*ratio**2.1
-            elif ratio < 1. + z:
-                tau += 2.55e-2*((1. + z)**1.6*ratio**2.1 - ratio**3.7)
-        else:
-            if ratio < 2.2:
-                tau += 5.22e-4*(1. + z)**3.4*ratio**2.1 + .325*ratio**1.2 - 3.14e-2*ratio**2.1
-            elif ratio < 5.7:
-                tau += 5.22e-4*(1. + z)**3.4*ratio**2.1 + .218*ratio**2.1 - 2.55e-2*ratio**3.7
-            elif ratio < 1. + z:
-                tau += 5.22e-4*((1. + z)**3.4*ratio**2.1 - ratio**5.5)
-        # DLA terms
-        if z < 2.:
-            if ratio < 1. + z:
-                tau += .211*(1. + z)**2. - 7.66e-2*(1. + z)**2.3*ratio**-.3 - .135*ratio**2.
-        else:
-            if ratio < 3.:
-                tau += .634 + 4.7e-2*(1. + z)**3. - 1.78e-2*(1. + z)**3.3*ratio**-.3 \
-                       -.135*ratio**2. - .291*ratio**-.3
-            elif ratio < 1. + z:
-                tau += 4.7e-2*(1. + z)**3. - 1.78e-2*(1. + z)**3.3*ratio**-.3 \
-                       -2.92e-2*ratio**3.
-        absorption[i] = exp(-tau)
 
+# Tables of the IGM transmission are cached by a key made of the rest frame
+# wavelengths and the redshift step. A table always starts from z = 0 and is
+# extended when a higher redshift is requested.
+IGM_CACHE_SIZE = 4 # Maximum number of tables kept in memory
+g_IGMCache = OrderedDict()
+
+def Lyman_absorption_Inoue_table(restWaves, z, double dz = 1e-3, nThread = 1):
+    """
+    Transmission of the IGM given by Inoue et al. 2014 at many redshifts.
+
+    The transmission is tabulated on a redshift grid with a step of ``dz``
+    and interpolated linearly to each redshift. The table is given in the 
+    rest frame, so that the jumps at Lyman lines are not smeared by the
+    interpolation. Tables are cached in memory across calls.
+
+    Parameters
+    ----------
+    restWaves: ndarray
+        Rest frame wavelengths in a unit of :math:`\\unicode{x212B}`.
+    z: ndarray
+        Redshifts, which should be non-negative.
+    dz: float
+        Step of the redshift grid.
+    nThread: int
+        Number of threads used by the OpenMp.
+
+    Returns
+    -------
+    absorption: ndarray
+        Transmission at :math:`(1 + z)\\lambda` with a shape of 
+        ``(len(z), len(restWaves))``.
+    """
+    cdef:
+        double[::1] mvWaves = np.ascontiguousarray(restWaves, dtype = 'f8')
+        double[::1] mvZ = np.ascontiguousarray(np.atleast_1d(z), dtype = 'f8')
+        int nWaves = mvWaves.shape[0]
+        int nGal = mvZ.shape[0]
+        int nZ, nNew
+        double zMin
+        double[:, ::1] mvTable
+        double[:, ::1] absorption = np.zeros((nGal, nWaves))
+        short cThread = nThread
+
+    if nGal == 0 or nWaves == 0:
+        return np.asarray(absorption)
+    if np.min(mvZ) < 0.:
+        raise ValueError("Redshifts should be non-negative")
+    # The last redshift of the grid should be larger than that of any galaxy
+    nZ = max(int(np.ceil(np.max(mvZ)/dz)) + 2, 2)
+    key = sha1(repr(dz).encode() + np.asarray(mvWaves).tobytes()).hexdigest()
+    if key in g_IGMCache:
+        table = g_IGMCache.pop(key)
+    else:
+        table = np.zeros((0, nWaves))
+    if len(table) < nZ:
+        nNew = nZ - len(table)
+        zMin = len(table)*dz
+        mvTable = np.zeros((nNew, nWaves))
+        with nogil:
+            Lyman_absorption_table(&mvWaves[0], nWaves, zMin, dz, nNew, 
+                                   &mvTable[0, 0], cThread)
+        table = np.vstack([table, np.asarray(mvTable)])
+    g_IGMCache[key] = table
+    while len(g_IGMCache) > IGM_CACHE_SIZE:
+        g_IGMCache.popitem(last = False)
+
+    mvTable = table
+    nZ = len(table)
+    with nogil:
+        Lyman_absorption_interp(&mvTable[0, 0], nWaves, 0., dz, nZ,
+                                &mvZ[0], nGal, &absorption[0, 0], cThread)
     return np.asarray(absorption)
 
 
@@ -728,6 +812,19 @@ def read_filters(waves, restBands, obsBands, z):
     return filters.flatten()
 
 
+def filter_range(filters, nWaves):
+    #=====================================================================
+    # Return the first and the last indices of wavelengths needed by the
+    # filters. One more wavelength is kept at each side of the filters,
+    # so that the trapezoidal rule gives the same integrals as the full
+    # wavelength range.
+    #=====================================================================
+    support = np.where(np.any(filters.reshape(-1, nWaves) != 0., axis = 0))[0]
+    if len(support) == 0:
+        return 0, nWaves - 1
+    return max(0, support[0] - 1), min(nWaves - 1, support[-1] + 1)
+
+
 def beta_filters(waves):
     #=====================================================================
     # return the filters defined by Calzetti et al. 1994, which is used to 
@@ -774,9 +871,66 @@ cdef extern from "mag_calc_cext.h":
         double *age
         int nAge
         double *data
+        long long strideZ
+        long long strideWaves
 
+    void templates_time_integration(sed_params *rawSpectra, 
+                                    double *ageList, int nAgeList, double *intData) nogil
 
-cdef sed_params *read_sed_templates(path, maxAge, minWIdx, maxWIdx):
+
+SED_FILES = ["sed_Z.npy", "sed_waves.npy", "sed_age.npy", "sed_flux.npy"]
+# Raw SED files of the last used path, which are reused across snapshots
+g_sedFiles = {'path':None, 'stamps':None, 'arrays':{}}
+# Calls in different threads check and update the caches of SED files and
+# templates in turn
+g_cacheLock = RLock()
+
+def sed_stamps(path):
+    #=====================================================================
+    # Return sizes and modification times of SED template files. Any 
+    # change of these files invalidates cached templates.
+    #=====================================================================
+    stamps = []
+    for name in SED_FILES:
+        st = os.stat(os.path.join(path, name))
+        stamps.append((st.st_size, st.st_mtime))
+    return tuple(stamps)
+
+
+def load_sed_file(path, name, mmapMode = None):
+    #=====================================================================
+    # Load a SED template file. Arrays loaded before are reused unless the
+    # files have been changed. mmapMode is passed to np.load.
+    #=====================================================================
+    path = os.path.abspath(path)
+    with g_cacheLock:
+        stamps = sed_stamps(path)
+        if g_sedFiles['path'] != path or g_sedFiles['stamps'] != stamps:
+            g_sedFiles['path'] = path
+            g_sedFiles['stamps'] = stamps
+            g_sedFiles['arrays'] = {}
+        arrays = g_sedFiles['arrays']
+        if name not in arrays:
+            arrays[name] = np.load(os.path.join(path, name), mmap_mode = mmapMode)
+        return arrays[name]
+
+
+cdef class sed_templates:
+    #=====================================================================
+    # SED templates within a wavelength window and an age range. Arrays
+    # are views of the SED files without copies, and they are kept by 
+    # this object for the lifetime of params.
+    #=====================================================================
+    cdef:
+        sed_params params
+        object arrays
+
+
+cdef double *array_data(const double[::1] memview):
+    return <double*>&memview[0]
+
+
+def read_sed_templates(path, maxAge, minWIdx, maxWIdx):
     #=====================================================================
     # The dictionary define by *path* should contain:                               
     #                                                                               
@@ -792,41 +946,55 @@ cdef sed_params *read_sed_templates(path, maxAge, minWIdx, maxWIdx):
     # in a 3-D array. The flux density should be normlised by the surface 
     # area of a 10 pc sphere. The first, second and third dimensions should 
     # be metallicity, wavelength and stellar age respectively.
+    #
+    # "sed_flux.npy" is memory-mapped, so only the wavelengths and ages in
+    # use are read, and processes on the same node share the page cache.
+    #
+    # Return: a sed_templates object
     #=====================================================================
     timing_start("# Read SED templates")
-    cdef sed_params *rawSpectra = <sed_params*>malloc(sizeof(sed_params))
+    cdef:
+        sed_templates templates = sed_templates()
+        sed_params *rawSpectra = &templates.params
+        const double[:, :, :] mvFlux
     # Read metallicity range
-    Z = np.load(os.path.join(path, "sed_Z.npy"))
-    rawSpectra.Z = init_1d_double(Z)
+    Z = np.ascontiguousarray(load_sed_file(path, "sed_Z.npy"), dtype = 'f8')
+    rawSpectra.Z = array_data(Z)
     rawSpectra.nZ = len(Z)
     rawSpectra.minZ = <short>(Z.min()*1000 - 0.5)
     rawSpectra.maxZ = <short>(Z.max()*1000 - 0.5)
     print "# Metallicity range: %.3f to %.3f"%(Z[0], Z[-1])
     # Read wavelength
-    waves = np.load(os.path.join(path, "sed_waves.npy"))
+    waves = load_sed_file(path, "sed_waves.npy")
     print "# Wavelength range: %.1f angstrom to %.1f angstrom"%(waves[0], waves[-1])
     if minWIdx is None:
         minWIdx = 0
     if maxWIdx is None:
         maxWIdx = len(waves) - 1
-    waves = waves[minWIdx:maxWIdx + 1]
+    waves = np.ascontiguousarray(waves[minWIdx:maxWIdx + 1], dtype = 'f8')
     print "# Shrinked wavelength range: %.1f angstrom to %.1f angstrom"%(waves[0], waves[-1])
-    rawSpectra.waves = init_1d_double(waves)
+    rawSpectra.waves = array_data(waves)
     rawSpectra.nWaves = len(waves)
     # Read stellar age
-    age = np.load(os.path.join(path, "sed_age.npy"))
+    age = load_sed_file(path, "sed_age.npy")
     print "# Stellar age range: %.2f Myr to %.2f Myr"%(age[0]*1e-6, age[-1]*1e-6)
     maxAIdx = np.where(age <= maxAge)[0][-1] + 1
-    age = age[:maxAIdx + 1]
+    age = np.ascontiguousarray(age[:maxAIdx + 1], dtype = 'f8')
     print "# Shrinked stellar age range: %.2f Myr to %.2f Myr"%(age[0]*1e-6, age[-1]*1e-6)
-    rawSpectra.age = init_1d_double(age)
+    rawSpectra.age = array_data(age)
     rawSpectra.nAge = len(age)
-    # Read flux
-    flux = np.load(os.path.join(path, "sed_flux.npy"))[:, minWIdx:maxWIdx + 1, :maxAIdx + 1]
-    flux = flux.flatten()
-    rawSpectra.data = init_1d_double(flux)
+    # Take a window of fluxes. It is only copied if ages are not contiguous
+    # or fluxes are not in double precision.
+    flux = load_sed_file(path, "sed_flux.npy", 'r')[:, minWIdx:maxWIdx + 1, :maxAIdx + 1]
+    if flux.dtype != np.float64 or flux.strides[2] != sizeof(double):
+        flux = np.ascontiguousarray(flux, dtype = 'f8')
+    mvFlux = flux
+    rawSpectra.data = <double*>&mvFlux[0, 0, 0]
+    rawSpectra.strideZ = mvFlux.strides[0]//sizeof(double)
+    rawSpectra.strideWaves = mvFlux.strides[1]//sizeof(double)
+    templates.arrays = (Z, waves, age, flux)
     timing_end()
-    return rawSpectra
+    return templates
 
 
 def get_wavelength(path):
@@ -836,10 +1004,88 @@ def get_wavelength(path):
     return np.load(os.path.join(path, "sed_waves.npy"))
 
 
-cdef void free_raw_spectra(sed_params *rawSpectra):
-    free(rawSpectra.age)
-    free(rawSpectra.waves)
-    free(rawSpectra.data)
+# # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+#                                                                               #
+# Functions to cache SED templates                                              #
+#                                                                               #
+# # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+# Time integrated templates are cached by a key made of the SED path, the 
+# sizes and modification times of the SED files, the age list, the 
+# wavelength window and the output type. Changing any SED file changes the 
+# key, so stale templates are never used. They are only removed from the 
+# disk by clear_template_cache(...).
+TEMPLATE_CACHE_VERSION = 1
+TEMPLATE_CACHE_SIZE = 4 # Maximum number of templates kept in memory
+g_templateCache = OrderedDict()
+
+def template_cache_key(path, ageList, minWIdx, maxWIdx, outType):
+    key = repr((os.path.abspath(path), sed_stamps(path), 
+                minWIdx, maxWIdx, outType, TEMPLATE_CACHE_VERSION))
+    return sha1(key.encode() + np.asarray(ageList, dtype = 'f8').tobytes()).hexdigest()
+
+
+cdef integrated_templates(path, sed_params *rawSpectra, double *ageList, int nAgeList,
+                          minWIdx, maxWIdx, outType, cachePath):
+    #=====================================================================
+    # Return time integrated SED templates as a numpy array. They are 
+    # taken from the memory or cachePath if possible; otherwise they are 
+    # computed and added to the cache.
+    #=====================================================================
+    cdef:
+        double[::1] mvIntegrated
+        int intSize = rawSpectra.nZ*nAgeList*rawSpectra.nWaves
+    key = template_cache_key(path, np.asarray(<double[:nAgeList]>ageList), 
+                             minWIdx, maxWIdx, outType)
+    cacheName = None
+    if cachePath is not None:
+        cacheName = os.path.join(cachePath, "sed_%s.npy"%key)
+    with g_cacheLock:
+        integrated = g_templateCache.pop(key, None)
+        if integrated is not None:
+            # Keep it visible to other threads while this one uses it
+            g_templateCache[key] = integrated
+    if integrated is None and cacheName is not None and os.path.exists(cacheName):
+        integrated = np.load(cacheName)
+        print "# Load time integrated SED templates from \"%s\""%cacheName
+    if integrated is None or len(integrated) != intSize:
+        integrated = np.empty(intSize)
+        mvIntegrated = integrated
+        timing_start("# Integrate SED templates over time")
+        with nogil:
+            templates_time_integration(rawSpectra, ageList, nAgeList, &mvIntegrated[0])
+        timing_end()
+        if cacheName is not None:
+            # Write to a temporary file first so that other processes never
+            # read a partial file
+            tmpName = cacheName + ".%d.tmp"%os.getpid()
+            with open(tmpName, "wb") as fp:
+                np.save(fp, integrated)
+            os.rename(tmpName, cacheName)
+    with g_cacheLock:
+        g_templateCache[key] = integrated
+        while len(g_templateCache) > TEMPLATE_CACHE_SIZE:
+            g_templateCache.popitem(last = False)
+    return integrated
+
+
+def clear_template_cache(cachePath = None):
+    """
+    Remove cached SED templates.
+
+    Parameters
+    ----------
+    cachePath: str
+        If given, also remove templates saved in this directory.
+    """
+    with g_cacheLock:
+        g_templateCache.clear()
+        g_sedFiles['path'] = None
+        g_sedFiles['stamps'] = None
+        g_sedFiles['arrays'] = {}
+    if cachePath is not None:
+        for name in os.listdir(cachePath):
+            if name.startswith("sed_") and name.endswith(".npy"):
+                os.remove(os.path.join(cachePath, name))
 
 
 # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
@@ -861,28 +1107,770 @@ def get_output_name(prefix, postfix, snap, path):
     return os.path.join(path, fname)
 
 
-cdef void free_gal_props(prop_set *galProps, int nGal):
-    cdef int iG
-    for iG in xrange(nGal):
-        free(galProps[iG].nodes)
-    free(galProps)
- 
-
 cdef extern from "mag_calc_cext.h" nogil:
-    float *composite_spectra_cext(sed_params *rawSpectra,
-                                  prop_set *galProps, int nGal,
+    struct stage_stats:
+        double wallTime
+        double *threadTime
+        long long nCall
+        long long nNode
+        long long nByte
+
+    struct run_stats:
+        int nThread
+        stage_stats stages[6]
+
+    void init_stats(run_stats *stats, int nThread)
+
+    void free_stats(run_stats *stats)
+
+    struct mag_context:
+        pass
+
+    mag_context *init_context(short nThread, short singlePrecision)
+
+    void free_context(mag_context *ctx)
+
+    void init_lightcone(mag_context *ctx, int nGrid, double *zGrid, 
+                        double *filters, double *absorption)
+
+    struct histogram:
+        int nDim
+        int first[2]
+        int second[2]
+        double min[2]
+        double width[2]
+        int nBin[2]
+        double *weights
+        double *counts
+
+    float *composite_spectra_cext(mag_context *ctx, sed_params *rawSpectra,
+                                  gal_props *galProps,
                                   double z, double *ageList, int nAgeList,
-                                  double *filters, double *logWaves, int nFlux, int nObs,
+                                  double *filters, double *logWaves, double *fitWeights,
+                                  int nFlux, int nObs,
                                   double *absorption, dust_params *dustArgs,
-                                  short outType, short nThread)
+                                  double *redshifts, double *integrated, short outType,
+                                  histogram *hists, int nHist, run_stats *stats)
+
+    void reduce_spectra_cext(mag_context *ctx, sed_params *rawSpectra,
+                             gal_props *galProps,
+                             double z, double *ageList, int nAgeList,
+                             double *filters, double *logWaves, double *fitWeights,
+                             int nFlux, int nObs,
+                             double *absorption, dust_params *dustArgs,
+                             double *redshifts, double *integrated, short outType,
+                             histogram *hists, int nHist, int blockSize, run_stats *stats)
+
+    gal_props *prune_progenitors_cext(mag_context *ctx, sed_params *rawSpectra,
+                                      gal_props *galProps,
+                                      double z, double *ageList, int nAgeList,
+                                      double *filters, int nFlux, int nObs,
+                                      double *absorption, double *integrated,
+                                      double *tolerance, double *bounds,
+                                      run_stats *stats)
+
+
+# Stages in struct run_stats
+STAGE_NAMES = ["templates", "dust", "filters", "accumulation", "output", "pruning"]
+g_stats = None
+
+
+cdef stats_frame(run_stats *stats, snap):
+    #=====================================================================
+    # Convert statistics of one snapshot to a DataFrame with a row for 
+    # each stage
+    #=====================================================================
+    cdef int iS, iT
+    rows = []
+    for iS in xrange(len(STAGE_NAMES)):
+        row = OrderedDict([("snap", snap), ("stage", STAGE_NAMES[iS]),
+                           ("wallTime", stats.stages[iS].wallTime),
+                           ("nCall", stats.stages[iS].nCall),
+                           ("nNode", stats.stages[iS].nNode),
+                           ("nByte", stats.stages[iS].nByte)])
+        for iT in xrange(stats.nThread):
+            row["thread%d"%iT] = stats.stages[iS].threadTime[iT]
+        rows.append(row)
+    return DataFrame(rows).set_index(["snap", "stage"])
+
+
+def get_stats():
+    """
+    Return statistics of the last call of ``composite_spectra`` to 
+    finish. Concurrent calls should use its ``results`` instead.
+
+    Statistics are always recorded with a monotonic clock. It is a
+    ``pandas.DataFrame`` indexed by snapshot and stage, where the stages
+    are 'templates', 'dust', 'filters', 'accumulation', 'output' and 
+    'pruning', the last of which is only used with ``tolerance``.
+    'wallTime' is the elapsed time of a stage in seconds; for stages run
+    by multiple threads, it is the longest busy time among the threads,
+    and the busy time of each thread is given by 'threadN'. 'nCall' is
+    the number of calls, e.g. galaxies, 'nNode' is the number of 
+    progenitors processed, and 'nByte' is the memory allocated in bytes.
+    """
+    return g_stats
+
+
+# Galaxies computed at a time when only histograms are kept
+HISTOGRAM_BLOCK = 8192
+g_histograms = None
+
+
+def histogram_column(snapshot_inputs inputs, name):
+    #=====================================================================
+    # Return the column of name in the output of composite_spectra_cext
+    # and the offset added to it by snapshot_inputs.compute(...)
+    #=====================================================================
+    names = [str(c) for c in inputs.columns]
+    if str(name) not in names:
+        raise KeyError("%s is not an output column"%name)
+    pos = names.index(str(name))
+    if inputs.cOutType == 2:
+        # Results of the UV slope fit are after fluxes in C
+        return (inputs.nFlux + pos, 0.) if pos < 4 else (pos - 4, 0.)
+    if pos >= inputs.nFlux - inputs.nObs and inputs.nGrid == 0:
+        return pos, inputs.distmod
+    return pos, 0.
+
+
+def init_histograms(snapshot_inputs inputs, histograms, int iSnap):
+    #=====================================================================
+    # Convert histograms given to composite_spectra(...) to a list of
+    # (dims, weights, counts) for galaxies of inputs at the iSnap-th 
+    # snapshot, where each element of dims is (first, second, min, width,
+    # nBin) in the columns of composite_spectra_cext, and counts is an
+    # array of zeros to which galaxies are added.
+    #=====================================================================
+    if histograms is None:
+        return None
+    if inputs.cOutType == 1:
+        raise ValueError("histograms are not applicable to 'sp'")
+    nGal = len(inputs.galIndices)
+    result = []
+    for hist in histograms:
+        if 'x' not in hist:
+            raise KeyError("histograms should have 'x'")
+        dims = []
+        for axis in [a for a in ('x', 'y') if a in hist]:
+            quantity = hist[axis]
+            if isinstance(quantity, (tuple, list)):
+                first, offset = histogram_column(inputs, quantity[0])
+                second, secondOffset = histogram_column(inputs, quantity[1])
+                offset -= secondOffset
+            else:
+                first, offset = histogram_column(inputs, quantity)
+                second = -1
+            vMin, vMax, nBin = hist[axis + 'bins']
+            if nBin <= 0 or vMax <= vMin:
+                raise ValueError("Bins of %s should have max > min and nBin > 0"%axis)
+            # Bins are shifted, so that no offset needs to be added in C
+            dims.append((first, second, vMin - offset, (vMax - vMin)/float(nBin), int(nBin)))
+        weights = None
+        if hist.get('weights') is not None:
+            weights = np.ascontiguousarray(
+                hist['weights'][iSnap][inputs.rankStart:inputs.rankStart + nGal], dtype = 'f8')
+            if len(weights) != nGal:
+                raise ValueError("weights should have an element for each galaxy")
+        result.append((dims, weights, np.zeros([d[4] for d in dims], dtype = 'f8')))
+    return result
+
+
+def histogram_frames(histograms, counts):
+    #=====================================================================
+    # Convert counts of histograms to DataFrames indexed by the lower 
+    # edges of bins
+    #=====================================================================
+    def edges(hist, axis):
+        vMin, vMax, nBin = hist[axis + 'bins']
+        values = np.linspace(vMin, vMax, int(nBin) + 1)[:-1]
+        quantity = hist[axis]
+        if isinstance(quantity, (tuple, list)):
+            quantity = "%s - %s"%tuple(quantity)
+        return Index(values, name = str(quantity))
+
+    frames = []
+    for hist, count in zip(histograms, counts):
+        if 'y' in hist:
+            frames.append(DataFrame(count, index = edges(hist, 'x'), 
+                                    columns = edges(hist, 'y')))
+        else:
+            frames.append(DataFrame({"count": count}, index = edges(hist, 'x')))
+    return frames
+
+
+def get_histograms():
+    """
+    Return histograms of the last call of ``composite_spectra`` to 
+    finish. Concurrent calls should use its ``results`` instead.
+
+    It is a dictionary whose keys are snapshots. Each value is a list of
+    ``pandas.DataFrame`` in the same order as the input histograms. A 
+    1-D histogram has a column 'count' and is indexed by the lower edges
+    of bins, and a 2-D histogram is indexed by the lower edges of 'x' 
+    and its columns are the lower edges of 'y'. If ``comm`` is given, 
+    only rank 0 has the histograms of all ranks.
+    """
+    return g_histograms
+
+
+g_errorBounds = None
+
+def get_error_bounds():
+    """
+    Return error bounds of the last call of ``composite_spectra`` to 
+    finish. Concurrent calls should use its ``results`` instead.
+
+    It is a dictionary whose keys are snapshots. Each value is a 
+    ``pandas.DataFrame`` indexed by galaxies, which gives the upper bound
+    of the change in magnitudes of each flux due to pruning progenitors.
+    If ``comm`` is given, each rank has the bounds of its own galaxies.
+    """
+    return g_errorBounds
+
+
+cdef progenitor_counts(meraxes_trees trees, int snap, int *indices, int nGal, short nThread):
+    #=====================================================================
+    # Return the number of progenitors of each galaxy at snapshot snap
+    #=====================================================================
+    counts = np.zeros(max(nGal, 1), dtype = 'i8')
+    cdef long long[::1] mvCounts = counts
+    with nogil:
+        count_progenitors(trees.firstProgenitor, trees.nextProgenitor, trees.sfr,
+                          snap, indices, nGal, &mvCounts[0], nThread)
+    return counts[:nGal]
+
+
+def partition_galaxies(costs, nRank):
+    #=====================================================================
+    # Split galaxies into nRank contiguous ranges with similar total
+    # costs. Return the boundaries of the ranges. The result only depends
+    # on the input, so that every rank computes the same partition. Ranges
+    # can be empty, e.g. if there are fewer galaxies than ranks.
+    #=====================================================================
+    nGal = len(costs)
+    bounds = np.zeros(nRank + 1, dtype = 'i8')
+    bounds[-1] = nGal
+    if nGal == 0:
+        return bounds
+    cumCosts = np.cumsum(costs, dtype = 'f8')
+    bounds[1:-1] = np.searchsorted(cumCosts, cumCosts[-1]*np.arange(1, nRank)/nRank)
+    return bounds
+
+
+def mpi_output_index(comm, fileName, nGal):
+    #=====================================================================
+    # Gather the output file and the number of galaxies of each rank.
+    # Return a DataFrame indexed by rank on the root and None on others.
+    #=====================================================================
+    parts = comm.gather((fileName, nGal), root = 0)
+    if comm.Get_rank() != 0:
+        return None
+    fileNames, counts = zip(*parts)
+    counts = np.array(counts, dtype = 'i8')
+    starts = np.append(0, np.cumsum(counts)[:-1])
+    index = DataFrame(OrderedDict([("file", [os.path.basename(f) for f in fileNames]),
+                                   ("start", starts), ("nGal", counts)]))
+    index.index.name = "rank"
+    return index
+
+
+cdef class snapshot_inputs:
+    #=====================================================================
+    # Inputs of composite_spectra_cext at one snapshot. They are owned by
+    # this object and freed with it. Templates are kept by the context 
+    # after the first computation, and the lock makes computations of the
+    # same snapshot take turns. The context is created in the precision of
+    # the first computation or pruning, which later calls should have. If
+    # progenitors are pruned, tracedProps 
+    # keeps the histories before pruning, which later snapshots reuse.
+    # For lightcones, gridFilters and gridAbsorption are the filters and
+    # the IGM absorption at nGrid redshifts zGrid.
+    #=====================================================================
+    cdef:
+        mag_context *ctx
+        sed_templates templates
+        sed_params *rawSpectra
+        gal_props *galProps
+        gal_props *tracedProps
+        int *rows
+        double *ageList
+        int nAgeList
+        double z
+        double *filters
+        double *logWaves
+        double *fitWeights
+        double *absorption
+        int nGrid
+        double *zGrid
+        double *gridFilters
+        double *gridAbsorption
+        int nFlux
+        int nObs
+        short cOutType
+        short singlePrecision
+        double[::1] mvIntegrated
+        run_stats stats
+        object lock
+        public int snap
+        public long rankStart
+        public object galIndices
+        public object columns
+        public object distmod
+        public object factor
+        public object errorBounds
+
+    def __cinit__(self):
+        self.ctx = NULL
+        self.singlePrecision = 0
+        self.lock = Lock()
+        self.rawSpectra = NULL
+        self.galProps = NULL
+        self.tracedProps = NULL
+        self.rows = NULL
+        self.ageList = NULL
+        self.filters = NULL
+        self.logWaves = NULL
+        self.fitWeights = NULL
+        self.absorption = NULL
+        self.nGrid = 0
+        self.zGrid = NULL
+        self.gridFilters = NULL
+        self.gridAbsorption = NULL
+        self.rankStart = 0
+        init_stats(&self.stats, 1)
+
+    def __dealloc__(self):
+        if self.ctx != NULL:
+            free_context(self.ctx)
+        if self.galProps != NULL:
+            free_gal_props(self.galProps)
+        if self.tracedProps != NULL:
+            free_gal_props(self.tracedProps)
+        free(self.rows)
+        free(self.ageList)
+        free(self.filters)
+        free(self.logWaves)
+        free(self.fitWeights)
+        free(self.absorption)
+        free(self.zGrid)
+        free(self.gridFilters)
+        free(self.gridAbsorption)
+        free_stats(&self.stats)
+
+    cdef check_precision(self, short singlePrecision):
+        #=================================================================
+        # Raise an error if the context has a different precision, since
+        # it only keeps templates in its own precision
+        #=================================================================
+        if self.ctx != NULL and self.singlePrecision != singlePrecision:
+            raise ValueError("A snapshot can only be computed in one precision")
+
+    cdef init_ctx(self, short nThread, short singlePrecision):
+        #=================================================================
+        # Create the context of the snapshot if it does not exist
+        #=================================================================
+        if self.ctx == NULL:
+            self.ctx = init_context(nThread, singlePrecision)
+            self.singlePrecision = singlePrecision
+            # Statistics record each thread of the context
+            free_stats(&self.stats)
+            init_stats(&self.stats, nThread)
+            if self.nGrid > 0:
+                init_lightcone(self.ctx, self.nGrid, self.zGrid, 
+                               self.gridFilters, self.gridAbsorption)
+
+    def compute(self, dustParams, short singlePrecision, short nThread, 
+                int iStart = 0, int nGal = -1, histograms = None, bint keepOutput = True,
+                redshifts = None):
+        #=================================================================
+        # Return the output of galaxies from iStart to iStart + nGal - 1 
+        # with the given dust parameters as a numpy array, whose columns 
+        # are the same as composite_spectra. If nGal is negative, compute
+        # all galaxies after iStart. Statistics are added to self.stats.
+        #
+        # histograms: list given by init_histograms(...), whose counts 
+        #             are updated in place by these galaxies
+        # keepOutput: if false, galaxies are only added to histograms in
+        #             blocks of HISTOGRAM_BLOCK, and None is returned
+        # redshifts: redshift of each galaxy for lightcones, in which case
+        #            observer frame magnitudes are apparent magnitudes
+        #=================================================================
+        cdef:
+            gal_props chunkProps
+            dust_params *dustArgs = NULL
+            double *integrated = &self.mvIntegrated[0]
+            float *cOutput = NULL
+            float[:] mvOutput
+            histogram *hists = NULL
+            int nHist = 0
+            int iH, iD
+            int blockSize = HISTOGRAM_BLOCK
+            double[::1] mvRedshifts
+            double *cRedshifts = NULL
+
+        if not keepOutput and not histograms:
+            raise ValueError("keepOutput = False requires histograms")
+        self.check_precision(singlePrecision)
+        if nGal < 0:
+            nGal = self.galProps.nGal - iStart
+        chunkProps.nGal = nGal
+        chunkProps.offsets = self.galProps.offsets + iStart
+        chunkProps.nodes = self.galProps.nodes
+        if redshifts is not None:
+            if self.nGrid == 0:
+                raise ValueError("redshifts require a lightcone")
+            mvRedshifts = np.ascontiguousarray(redshifts, dtype = 'f8')
+            if mvRedshifts.shape[0] != nGal:
+                raise ValueError("redshifts should have an element for each galaxy")
+            if nGal > 0:
+                cRedshifts = &mvRedshifts[0]
+        if dustParams is not None:
+            # A single set of parameters applies to all galaxies
+            dustParams = np.ascontiguousarray(np.broadcast_to(dustParams, (nGal, 5)), 
+                                              dtype = 'f8')
+            dustArgs = dust_parameters(dustParams)
+        if histograms is not None and len(histograms) > 0:
+            nHist = len(histograms)
+            hists = <histogram*>malloc(nHist*sizeof(histogram))
+            for iH, (dims, weights, counts) in enumerate(histograms):
+                hists[iH].nDim = len(dims)
+                for iD, (first, second, vMin, width, nBin) in enumerate(dims):
+                    hists[iH].first[iD] = first
+                    hists[iH].second[iD] = second
+                    hists[iH].min[iD] = vMin
+                    hists[iH].width[iD] = width
+                    hists[iH].nBin[iD] = nBin
+                hists[iH].weights = NULL if weights is None else array_data(weights[iStart:])
+                hists[iH].counts = array_data(counts.reshape(-1))
+        with self.lock:
+            self.init_ctx(nThread, singlePrecision)
+            with nogil:
+                if keepOutput:
+                    cOutput = composite_spectra_cext(self.ctx, self.rawSpectra, &chunkProps, 
+                                                     self.z, self.ageList, self.nAgeList,
+                                                     self.filters, self.logWaves, 
+                                                     self.fitWeights, self.nFlux, self.nObs,
+                                                     self.absorption, dustArgs, cRedshifts,
+                                                     integrated, self.cOutType, 
+                                                     hists, nHist, &self.stats)
+                else:
+                    reduce_spectra_cext(self.ctx, self.rawSpectra, &chunkProps, 
+                                        self.z, self.ageList, self.nAgeList,
+                                        self.filters, self.logWaves, self.fitWeights, 
+                                        self.nFlux, self.nObs, self.absorption, 
+                                        dustArgs, cRedshifts, integrated, self.cOutType, 
+                                        hists, nHist, blockSize, &self.stats)
+        free(dustArgs)
+        free(hists)
+        if not keepOutput:
+            return None
+        if nGal == 0:
+            output = np.zeros((0, self.nFlux + (4 if self.cOutType == 2 else 0)), dtype = 'f4')
+        elif self.cOutType == 2:
+            mvOutput = <float[:<Py_ssize_t>nGal*(self.nFlux + 4)]>cOutput
+            output = np.hstack([np.asarray(mvOutput[<Py_ssize_t>nGal*self.nFlux:], 
+                                           dtype = 'f4').reshape(nGal, -1),
+                                np.asarray(mvOutput[:<Py_ssize_t>nGal*self.nFlux], 
+                                           dtype = 'f4').reshape(nGal, -1)])
+        else:
+            mvOutput = <float[:<Py_ssize_t>nGal*self.nFlux]>cOutput
+            output = np.array(mvOutput, dtype = 'f4').reshape(nGal, -1)
+        free(cOutput)
+        # Convert apparent magnitudes to absolute magnitudes
+        if self.cOutType == 0 and self.nObs > 0 and redshifts is None:
+            output[:, self.nFlux - self.nObs:] += self.distmod
+        # Convert to observed frame fluxes       
+        if self.factor is not None:
+            output *= self.factor*self.factor
+        return output
+
+    def prune(self, tolerance, short singlePrecision, short nThread):
+        #=================================================================
+        # Merge and drop progenitors, such that the magnitude of each 
+        # flux without dust changes by less than tolerance, which can be
+        # a scalar or an array with a value for each flux. Return upper 
+        # bounds of the changes as a nGal x nFlux array. singlePrecision
+        # is the precision of later computations.
+        #=================================================================
+        cdef:
+            int nGal = self.galProps.nGal
+            double *integrated = &self.mvIntegrated[0]
+            double[::1] mvTolerance = np.array(np.broadcast_to(tolerance, self.nFlux), 
+                                               dtype = 'f8')
+            double[:, ::1] mvBounds
+            gal_props *pruned
+        self.check_precision(singlePrecision)
+        bounds = np.zeros([max(nGal, 1), self.nFlux])
+        mvBounds = bounds
+        with self.lock:
+            self.init_ctx(nThread, singlePrecision)
+            with nogil:
+                pruned = prune_progenitors_cext(self.ctx, self.rawSpectra, self.galProps,
+                                                self.z, self.ageList, self.nAgeList,
+                                                self.filters, self.nFlux, self.nObs,
+                                                self.absorption, integrated, 
+                                                &mvTolerance[0], &mvBounds[0, 0], 
+                                                &self.stats)
+        if self.tracedProps == NULL:
+            self.tracedProps = self.galProps
+        else:
+            free_gal_props(self.galProps)
+        self.galProps = pruned
+        return bounds[:nGal]
+
+    def flux_columns(self):
+        #=================================================================
+        # Return names of the fluxes in the output
+        #=================================================================
+        return self.columns[4:] if self.cOutType == 2 else self.columns
+
+    def get_stats(self):
+        #=================================================================
+        # Return statistics of the computations as a DataFrame
+        #=================================================================
+        return stats_frame(&self.stats, self.snap)
+
+
+def load_snapshot(fname, int snap, int snapMin, h, cosmo, sedPath, waves, IGM, outType, 
+                  restBands, obsBands, obsFrame, betaWeights, cachePath, 
+                  zRange = None, lightconeStep = 1e-2):
+    #=====================================================================
+    # Prepare the inputs of a snapshot that do not depend on galaxies, 
+    # i.e. the age list, filters, the IGM transmission and SED templates.
+    # If zRange = (zMin, zMax) is given, also prepare filters of a 
+    # lightcone at redshifts from zMin to zMax with a step of 
+    # lightconeStep, which include the distance modulus. Other arguments
+    # are the same as composite_spectra(...).
+    #
+    # Return: a snapshot_inputs object
+    #=====================================================================
+    cdef:
+        snapshot_inputs inputs = snapshot_inputs()
+        int nWaves = len(waves)
+        int nRest
+    inputs.snap = snap
+    # Read look back time and redshift
+    inputs.nAgeList = snap - snapMin + 1
+    with g_hdf5Lock:
+        inputs.ageList = init_1d_double(get_age_list(fname, snap, inputs.nAgeList, h))
+        inputs.z = meraxes.io.grab_redshift(fname, snap)
+    z = inputs.z
+    # Generate Filters
+    minWIdx = None
+    maxWIdx = None
+    inputs.nObs = 0
+    if outType == 'ph':
+        nRest = len(restBands)
+        inputs.nObs = len(obsBands)
+        inputs.nFlux = nRest + inputs.nObs
+        # Only read wavelengths where the filters are non-zero
+        phFilters = read_filters(waves, restBands, obsBands, z).reshape(inputs.nFlux, -1)
+        if zRange is None:
+            minWIdx, maxWIdx = filter_range(phFilters, nWaves)
+        else:
+            zMin, zMax = zRange
+            zGrid = zMin + lightconeStep*np.arange(
+                max(int(np.ceil((zMax - zMin)/lightconeStep - 1e-6)), 0) + 1)
+            gridFilters = np.array([read_filters(waves, restBands, obsBands, zG)
+                                    for zG in zGrid]).reshape(len(zGrid), inputs.nFlux, -1)
+            # Observer frame fluxes are normalised by the luminosity distance
+            gridFilters[:, nRest:] *= 10.**(-.4*cosmo.distmod(zGrid).value)[:, None, None]
+            # Wavelengths are shared by the snapshot and all redshifts
+            minWIdx, maxWIdx = filter_range(np.vstack([phFilters, 
+                                                       gridFilters.reshape(-1, nWaves)]), 
+                                            nWaves)
+            inputs.nGrid = len(zGrid)
+            inputs.zGrid = init_1d_double(zGrid)
+            inputs.gridFilters = init_1d_double(
+                gridFilters[:, :, minWIdx:maxWIdx + 1].flatten())
+            if IGM == 'I2014':
+                inputs.gridAbsorption = init_1d_double(Lyman_absorption_Inoue_table(
+                    waves[minWIdx:maxWIdx + 1], zGrid).flatten())
+        inputs.filters = init_1d_double(phFilters[:, minWIdx:maxWIdx + 1].flatten())
+        inputs.cOutType = 0
+        inputs.columns = ["M%d-%d"%(band[0], band[1]) for band in restBands] \
+                         + [band[0] for band in obsBands]
+        inputs.distmod = cosmo.distmod(z).value
+    elif zRange is not None:
+        raise ValueError("Lightcones are only applicable to 'ph'")
+    elif outType == 'sp':
+        inputs.nFlux = nWaves
+        if obsFrame:
+            inputs.nObs = nWaves
+            inputs.factor = 10./cosmo.luminosity_distance(z).to(u.parsec).value
+        inputs.cOutType = 1
+        inputs.columns = (1. + z)*waves if obsFrame else waves
+    elif outType == 'UV slope':
+        centreWaves, betaFilters, minWIdx, maxWIdx = beta_filters(waves)
+        inputs.logWaves = init_1d_double(np.log(centreWaves))
+        if betaWeights is not None:
+            if len(betaWeights) != len(centreWaves) - 1:
+                raise ValueError("betaWeights should have %d elements"
+                                 %(len(centreWaves) - 1))
+            inputs.fitWeights = init_1d_double(np.asarray(betaWeights, dtype = 'f8'))
+        inputs.filters = init_1d_double(betaFilters)
+        inputs.nFlux = len(centreWaves)
+        inputs.cOutType = 2
+        inputs.columns = list(np.append(["beta", "norm", "R", "beta_err"], centreWaves))
+        inputs.columns[-1] = "M1600-100"
+    else:
+        raise KeyError("outType can only be 'ph', 'sp' and 'UV Slope'")
+    # Compute the transmission of the IGM
+    if IGM == 'I2014':
+        inputs.absorption = init_1d_double(Lyman_absorption_Inoue(
+            (1. + z)*(waves if minWIdx is None else waves[minWIdx:maxWIdx + 1]), z))
+    # Read raw SED templates
+    inputs.templates = read_sed_templates(sedPath, inputs.ageList[inputs.nAgeList - 1], 
+                                          minWIdx, maxWIdx)
+    inputs.rawSpectra = &inputs.templates.params
+    inputs.mvIntegrated = integrated_templates(sedPath, inputs.rawSpectra, 
+                                               inputs.ageList, inputs.nAgeList,
+                                               minWIdx, maxWIdx, outType, cachePath)
+    return inputs
+
+
+def trace_snapshot(snapshot_inputs inputs, gals, trees = None, 
+                   snapshot_inputs prevInputs = None, rank = 0, nRank = 1, nThread = 1):
+    #=====================================================================
+    # Read or trace star formation histories of galaxies at the snapshot 
+    # of inputs. gals are galaxy indices or a stored star formation 
+    # history given in the same way as composite_spectra(...). If 
+    # prevInputs is given, histories traced at its snapshot are reused. 
+    # If nRank > 1, only galaxies of this rank are kept.
+    #=====================================================================
+    cdef:
+        int snap = inputs.snap
+        int nGal
+        int prevSnap = -1
+        int *prevIndices = NULL
+        gal_props *prevProps = NULL
+        gal_props *galProps
+    if sfh_file_range(gals) is not None:
+        sfhName, iStart, nGal = sfh_file_range(gals)
+        if nRank > 1:
+            # Offsets are memory-mapped, so the partition is cheap
+            galProps = read_properties_by_file(sfhName, iStart, nGal)
+            nGal = galProps.nGal
+            bounds = partition_galaxies(
+                np.diff(np.asarray(<long long[:nGal + 1]>galProps.offsets)) + 1, nRank)
+            free_gal_props(galProps)
+            inputs.rankStart = bounds[rank]
+            iStart += inputs.rankStart
+            nGal = bounds[rank + 1] - inputs.rankStart
+        inputs.galIndices = read_galaxy_indices(sfhName, iStart, nGal)
+        inputs.galProps = read_properties_by_file(sfhName, iStart, len(inputs.galIndices))
+    else:
+        galIndices = gals
+        nGal = len(galIndices)
+        if nRank > 1:
+            inputs.rows = init_1d_int(meraxes_rows(trees, snap, galIndices))
+            bounds = partition_galaxies(
+                progenitor_counts(trees, snap, inputs.rows, nGal, nThread) + 1, nRank)
+            free(inputs.rows)
+            inputs.rows = NULL
+            inputs.rankStart = bounds[rank]
+            galIndices = galIndices[inputs.rankStart:bounds[rank + 1]]
+            nGal = len(galIndices)
+        inputs.galIndices = galIndices
+        inputs.rows = init_1d_int(meraxes_rows(trees, snap, galIndices))
+        if prevInputs is not None:
+            prevSnap = prevInputs.snap
+            prevIndices = prevInputs.rows
+            # Pruned histories are only valid at their own snapshot
+            prevProps = prevInputs.galProps if prevInputs.tracedProps == NULL \
+                        else prevInputs.tracedProps
+        inputs.galProps = read_properties_by_progenitors(trees, snap, inputs.rows, nGal, 
+                                                         nThread, prevSnap, prevIndices, 
+                                                         prevProps)
+
+
+PIPELINE_END = object()
+
+def pipeline(source, stages, queueDepth = 0):
+    #=====================================================================
+    # Apply stages, a list of functions, to each item of source in turn,
+    # and yield the results in order. 
+    #
+    # If queueDepth is positive, the source and each stage run in their
+    # own threads, and items are passed by queues that hold at most 
+    # queueDepth items, so that different items are processed by 
+    # different stages at the same time. queueDepth can also be a list 
+    # with a depth for each of the len(stages) + 1 queues. The first 
+    # exception in any thread is raised in the calling thread.
+    #=====================================================================
+    if isscalar(queueDepth):
+        queueDepth = [queueDepth]*(len(stages) + 1)
+    if len(queueDepth) != len(stages) + 1:
+        raise ValueError("queueDepth should have %d elements"%(len(stages) + 1))
+    if min(queueDepth) <= 0:
+        for item in source:
+            for stage in stages:
+                item = stage(item)
+            yield item
+        return
+
+    stop = Event()
+    errors = []
+    queues = [Queue(depth) for depth in queueDepth]
+
+    def put(queue, item):
+        # Wait until there is space, unless the pipeline is stopped
+        while not stop.is_set():
+            try:
+                queue.put(item, timeout = .1)
+                return
+            except Full:
+                pass
+
+    def get(queue):
+        while not stop.is_set():
+            try:
+                return queue.get(timeout = .1)
+            except Empty:
+                pass
+        return PIPELINE_END
+
+    def run(stage, qIn, qOut):
+        try:
+            items = iter(source) if qIn is None else iter(lambda: get(qIn), PIPELINE_END)
+            for item in items:
+                put(qOut, item if stage is None else stage(item))
+        except BaseException as error:
+            errors.append(error)
+            stop.set()
+        put(qOut, PIPELINE_END)
+
+    threads = [Thread(target = run, args = (None, None, queues[0]))]
+    for iS in xrange(len(stages)):
+        threads.append(Thread(target = run, args = (stages[iS], queues[iS], queues[iS + 1])))
+    for thread in threads:
+        thread.daemon = True
+        thread.start()
+    try:
+        while True:
+            item = get(queues[-1])
+            if item is PIPELINE_END:
+                break
+            yield item
+    finally:
+        stop.set()
+        for thread in threads:
+            thread.join()
+    if len(errors) > 0:
+        raise errors[0]
 
 
 def composite_spectra(fname, snapList, gals, h, Om0, sedPath,
-                      IGM = 'I2014', dustParams = None,
-                      outType = 'ph', 
+                      IGM = 'I2014', dustParams = None, redshifts = None,
+                      lightconeStep = 1e-2, outType = 'ph', 
                       restBands = [[1600, 100],], obsBands = [], obsFrame = False,
-                      prefix = 'mags', outPath = './',
-                      nThread = 1):
+                      betaWeights = None,
+                      prefix = 'mags', outPath = './', cachePath = None,
+                      chunkSize = None, compression = None, 
+                      precision = 'double', selective = False, tolerance = None,
+                      comm = None, mpiOutput = 'gather', histograms = None, 
+                      galaxyOutput = True, queueDepth = 0, results = None, nThread = 1):
     """
     Main function to calculate galaxy magnitudes and spectra.
 
@@ -894,7 +1882,10 @@ def composite_spectra(fname, snapList, gals, h, Om0, sedPath,
         List of snapshots to be computed.
     gals: list
         Each element of the list can be an array of galaxy indices or
-        a path to stored star formation history.
+        a path to stored star formation history. To compute only part 
+        of a stored star formation history, use a tuple of 
+        ``(path, start, number)``, which selects galaxies from ``start``
+        to ``start + number - 1`` in the file.
     h: float
         Dimensionless Hubble constant. This is substituded into all 
         involved functions in meraxes python package. It is also used
@@ -912,6 +1903,17 @@ def composite_spectra(fname, snapList, gals, h, Om0, sedPath,
         Parameters for the dust model. It should have a shape of
         ``(len(snapList), len(gals), 5)``. The five parameters are
         tauUV_ISM, nISM, tauUV_BC, nBC, tBC.
+    redshifts: ndarray
+        Only applicable to 'ph'. If given, galaxies are placed on a 
+        lightcone, where observer frame magnitudes are apparent 
+        magnitudes at the redshift of each galaxy instead of that of the
+        snapshot. It should have a shape of ``(len(snapList), len(gals))``.
+        Observer frame filters, the IGM absorption and the distance 
+        modulus are tabulated on a redshift grid covering the galaxies
+        of each snapshot, and fluxes are interpolated linearly between 
+        the two nearest redshifts. It cannot be used with ``tolerance``.
+    lightconeStep: float
+        Step of the redshift grid of ``redshifts``.
     outTypestr
         If 'ph', output AB magnitudes in filters given by restBands
         and obsBands.
@@ -922,9 +1924,9 @@ def composite_spectra(fname, snapList, gals, h, Om0, sedPath,
         it is normlised by :math:`10 pc`. Wavelengths are in a unit of 
         :math:`\\unicode{x212B}`.
 
-        If 'UV slope', output slopes, normalisations, and correlation
-        cofficients by a power law fit at UV range using 10 windows 
-        given by Calzetti et al. 1994. It also outputs flux densities
+        If 'UV slope', output slopes, normalisations, correlation
+        cofficients and uncertainties of slopes by a power law fit at 
+        UV range using 10 windows given by Calzetti et al. 1994. It also outputs flux densities
         in these windows in a unit of :math:`erg/s/\\unicode{x212B}/cm^2`
         normlised by :math:`10 pc`. Wavelengths are in a unit of 
         :math:`\\unicode{x212B}`.
@@ -940,19 +1942,126 @@ def composite_spectra(fname, snapList, gals, h, Om0, sedPath,
         the transmission curve.
     obsFrame: bool
         See ``outType``.
+    betaWeights: list
+        Only applicable to 'UV slope'. Weights of the 10 windows in the 
+        power law fit. By default, all windows have the same weight.
     prefix: str
         The name of the output file is 'prefix_XXX.hdf5', where XXX is
         number of the snapshot.
     outPath: str
         Path to the output.
+    cachePath: str
+        Directory to save time integrated SED templates, so that later 
+        runs with the same SED templates, snapshot and ``outType`` can 
+        skip the integration. Templates are always cached in memory 
+        across snapshots and calls. A cached template is not used if any
+        SED file has been modified since it was saved.
+    chunkSize: int
+        Only applicable to 'sp'. If given, galaxies are computed in chunks
+        of this size, and each chunk is appended to the output before the
+        next one is computed, so that the memory usage does not grow with
+        the number of galaxies. The output is then stored in the table
+        format of ``pandas.HDFStore``, and no output is kept in memory.
+    compression: str
+        Compression library used by ``pandas.HDFStore`` when ``chunkSize``
+        is given, e.g. 'zlib' or 'blosc'. No compression by default.
+    precision: str
+        If 'single', the spectrum of each galaxy is computed in single 
+        precision, which is faster but less accurate. SED templates are
+        always built in double precision. The default is 'double'.
+    selective: bool
+        If true, only the given galaxies and their progenitors are read
+        from the Meraxes output, which reduces the memory usage and I/O 
+        when a small fraction of galaxies is computed.
+    tolerance: float or list
+        If given, progenitors of each galaxy in the same metallicity and 
+        age bin are merged, and progenitors whose total contribution is 
+        provably below the tolerance are dropped, which reduces the 
+        computation of deep merger trees. The tolerance is the maximum 
+        change in magnitudes of each flux, and can also be a list with a
+        value for each band of 'ph', each window of 'UV slope' or each 
+        wavelength of 'sp'. The bound is derived for fluxes without dust,
+        so it cannot be used with ``dustParams``, and includes the 
+        rounding of merged star formation rates to float. Pruned histories are not reused by later snapshots, which
+        trace from the full histories. Bounds achieved by each galaxy can
+        be obtained by ``results`` or ``get_error_bounds``.
+    comm: mpi4py.MPI.Comm
+        If given, galaxies of each snapshot are split into contiguous 
+        ranges with similar numbers of progenitors, and each rank of the
+        communicator computes one range, e.g. ``MPI.COMM_WORLD`` in a job
+        launched by ``mpirun``. A range can be empty if there are fewer
+        galaxies than ranks. All ranks should call this function with
+        the same arguments. Each rank can use ``nThread`` threads.
+    mpiOutput: str
+        Only applicable if ``comm`` is given. If 'gather', outputs are
+        gathered to rank 0, which saves them in the order of the input.
+        If 'split', each rank saves its output to 'prefix_rankRRR_XXX.hdf5', 
+        where RRR is the rank, and rank 0 saves 'prefix_index_XXX.hdf5', 
+        which lists the file, the first position and the number of 
+        galaxies of each rank. ``chunkSize`` requires 'split'.
+    histograms: list
+        Only applicable to 'ph' and 'UV slope'. Histograms of outputs
+        accumulated while galaxies are computed. Each element is a 
+        dictionary with keys:
+
+        'x': name of an output column, e.g. 'M1600-100' or 'beta', or a 
+        tuple of two names for the difference of the columns, e.g. a 
+        colour.
+
+        'xbins': tuple of ``(min, max, nBin)`` giving uniform bins.
+
+        'y', 'ybins': optional second quantity of a 2-D histogram.
+
+        'weights': optional weights of galaxies, e.g. inverse volumes,
+        with a shape of ``(len(snapList), len(gals))``.
+
+        Galaxies outside the bins are ignored. Histograms of each 
+        snapshot are saved to 'prefix_hist_XXX.hdf5' with keys 'h0', 
+        'h1', ..., and can be obtained by ``results`` or 
+        ``get_histograms``. Histograms 
+        of all ranks are added up if ``comm`` is given.
+    galaxyOutput: bool
+        If false, only histograms are computed, and no output of each
+        galaxy is kept or saved, so that the memory usage does not grow
+        with the number of galaxies. ``chunkSize`` is then ignored.
+    queueDepth: int or list
+        If positive, snapshots are processed by a pipeline, where loading
+        the inputs, tracing merger trees, computing and saving the output
+        run in different threads. For example, a snapshot can be loaded 
+        and traced while the previous one is computed and the one before
+        is saved. The depth is the maximum number of snapshots waiting 
+        between two stages, which limits the memory usage. It can also 
+        be a list of three depths for the queues after loading, tracing
+        and computing. If 0, the stages run one after another.
+    results: dict
+        If given, it receives the statistics, histograms and error bounds
+        of this call with keys 'stats', 'histograms' and 'errorBounds', 
+        which are the same as the returns of ``get_stats``, 
+        ``get_histograms`` and ``get_error_bounds``.
     nThread: int
-        Number of threads used by the OpenMp.
+        Number of threads used by the OpenMp. In a pipeline, tracing and
+        computing can use this number of threads each at the same time.
+
+    The GIL is released while galaxies are computed, and each call owns 
+    its merger trees and templates, so that several calls, e.g. for 
+    different snapshots, can run at the same time in Python threads. 
+    Their outputs should have different ``prefix`` or ``outPath``, and
+    each of them should use ``results``, since ``get_stats``, 
+    ``get_histograms`` and ``get_error_bounds`` only return those of the
+    last call to finish.
 
     Returns
     -------
     mags: pandas.DataFrame
         If ``snapList`` is a scalar, it returns the output according to 
-        ``outType``.
+        ``outType``. It returns None if the output is written in chunks.
+        If ``comm`` is given, ranks other than 0 return None for 'gather',
+        and each rank returns its own part for 'split'.
+
+        Statistics of the run can be obtained by ``results`` or 
+        ``get_stats``.
+
+        If ``galaxyOutput`` is false, it returns None.
 
         This function always generates at least one output in the
         directory defined by ``outPath``. The output, whose name is
@@ -961,171 +2070,352 @@ def composite_spectra(fname, snapList, gals, h, Om0, sedPath,
         this function never overwrites an output which has the same name;
         instead it generates an output with a different name.
     """
+    global g_stats, g_histograms, g_errorBounds
     cosmo = FlatLambdaCDM(H0 = 100.*h, Om0 = Om0)
    
     cdef:
-        int i, iG
-        int snap, nSnap
-        int sanpMin = 1
+        int snapMin = 1
         int snapMax
+        int nSnap
+        short singlePrecision
 
     if isscalar(snapList):
         snapMax = snapList
         nSnap = 1
         snapList = [snapList]
         gals = [gals]
+        if redshifts is not None:
+            redshifts = [redshifts]
     else:
         snapMax = max(snapList)
         nSnap = len(snapList)
 
-    if type(gals[0]) is str:
-        snapMin = 1
+    if precision == 'double':
+        singlePrecision = 0
+    elif precision == 'single':
+        singlePrecision = 1
     else:
-        snapMin = read_meraxes(fname, snapMax, h)
-
+        raise KeyError("precision can only be 'double' and 'single'")
+
+    if chunkSize is not None and outType != 'sp':
+        raise ValueError("chunkSize is only applicable to 'sp'")
+
+    if redshifts is not None:
+        if outType != 'ph':
+            raise ValueError("redshifts are only applicable to 'ph'")
+        if tolerance is not None:
+            raise ValueError("redshifts cannot be used with tolerance")
+
+    if tolerance is not None and dustParams is not None:
+        raise ValueError("dustParams cannot be used with tolerance")
+
+    if not galaxyOutput:
+        if not histograms:
+            raise ValueError("galaxyOutput = False requires histograms")
+        chunkSize = None
+
+    if comm is not None:
+        if mpiOutput not in ('gather', 'split'):
+            raise KeyError("mpiOutput can only be 'gather' and 'split'")
+        if chunkSize is not None and mpiOutput != 'split':
+            raise ValueError("chunkSize requires mpiOutput = 'split'")
+        rank = comm.Get_rank()
+        nRank = comm.Get_size()
+        if mpiOutput == 'split':
+            rankPrefix = "%s_rank%03d"%(prefix, rank)
+        else:
+            rankPrefix = prefix
+    else:
+        rank = 0
+        nRank = 1
+        rankPrefix = prefix
+
+    trees = None
+    if sfh_file_range(gals[0]) is None:
+        trees = read_meraxes(fname, snapMax, h, 
+                             meraxes_selection(snapList, gals) if selective else None)
+        snapMin = trees.snapMin
     waves = get_wavelength(sedPath)
-    cdef:
-        sed_params *rawSpectra = NULL
-        int nWaves = len(waves)
-        int nGal
-        int *indices
 
-        prop_set *galProps
+    # Snapshots are computed in ascending order, so that histories traced at
+    # one snapshot can be reused by the next
+    order = sorted(xrange(nSnap), key = lambda iS: snapList[iS])
+
+    def load():
+        for i in order:
+            zRange = None
+            if redshifts is not None:
+                zRange = (np.min(redshifts[i]), np.max(redshifts[i]))
+            yield i, load_snapshot(fname, snapList[i], snapMin, h, cosmo, sedPath, waves, 
+                                   IGM, outType, restBands, obsBands, obsFrame, 
+                                   betaWeights, cachePath, zRange, lightconeStep)
+
+    prevInputs = [None]
+    def trace(item):
+        i, inputs = item
+        trace_snapshot(inputs, gals[i], trees, prevInputs[0], rank, nRank, nThread)
+        if tolerance is not None:
+            bounds = inputs.prune(tolerance, singlePrecision, nThread)
+            inputs.errorBounds = DataFrame(bounds, index = inputs.galIndices,
+                                           columns = inputs.flux_columns())
+        if trees is not None:
+            prevInputs[0] = inputs
+        return i, inputs
+
+    def compute(item):
+        i, inputs = item
+        nGal = len(inputs.galIndices)
+        dust = None
+        if dustParams is not None:
+            dust = dustParams[i][inputs.rankStart:inputs.rankStart + nGal]
+        galZ = None
+        if redshifts is not None:
+            galZ = np.asarray(redshifts[i])[inputs.rankStart:inputs.rankStart + nGal]
+        hists = init_histograms(inputs, histograms, i)
+        if chunkSize is None:
+            return i, inputs, inputs.compute(dust, singlePrecision, nThread, 
+                                             histograms = hists, 
+                                             keepOutput = galaxyOutput,
+                                             redshifts = galZ), hists
+        # Compute and save spectra chunk by chunk
+        outName = get_output_name(rankPrefix, ".hdf5", inputs.snap, outPath)
+        with g_hdf5Lock:
+            if compression is None:
+                store = HDFStore(outName, "w")
+            else:
+                store = HDFStore(outName, "w", complevel = 5, complib = compression)
+        for iStart in xrange(0, nGal, chunkSize):
+            nChunk = min(chunkSize, nGal - iStart)
+            output = inputs.compute(None if dust is None else dust[iStart:iStart + nChunk],
+                                    singlePrecision, nThread, iStart, nChunk, hists)
+            with g_hdf5Lock:
+                store.append("w", DataFrame(output, columns = inputs.columns,
+                                            index = inputs.galIndices[iStart:iStart + nChunk]))
+        with g_hdf5Lock:
+            store.close()
+        return i, inputs, outName, hists
+
+    # Outputs are saved by this thread, which makes all MPI calls
+    mags = None
+    statsList = []
+    callHistograms = {}
+    callErrorBounds = {}
+    for i, inputs, output, hists in pipeline(load(), [trace, compute], queueDepth):
+        snap = inputs.snap
+        galIndices = inputs.galIndices
+        nGal = len(galIndices)
+        if inputs.errorBounds is not None:
+            callErrorBounds[snap] = inputs.errorBounds
+        if hists is not None:
+            # Add up histograms of all ranks
+            counts = [hist[2] for hist in hists]
+            if comm is not None:
+                parts = comm.gather(counts, root = 0)
+                if rank == 0:
+                    counts = [np.sum(c, axis = 0) for c in zip(*parts)]
+            if comm is None or rank == 0:
+                callHistograms[snap] = histogram_frames(histograms, counts)
+                histName = get_output_name(prefix + "_hist", ".hdf5", snap, outPath)
+                with g_hdf5Lock:
+                    store = HDFStore(histName, "w")
+                    for iH, frame in enumerate(callHistograms[snap]):
+                        store.put("h%d"%iH, frame)
+                    store.close()
+        if chunkSize is not None:
+            outName = output
+        elif galaxyOutput:
+            # Gather the output of all ranks in the order of the input
+            if comm is not None and mpiOutput == 'gather':
+                parts = comm.gather((np.asarray(galIndices), output), root = 0)
+                if rank == 0:
+                    galIndices = np.concatenate([p[0] for p in parts])
+                    output = np.vstack([p[1] for p in parts])
+            # Save the output to the disk
+            if comm is None or mpiOutput == 'split' or rank == 0:
+                outName = get_output_name(rankPrefix, ".hdf5", snap, outPath)
+                with g_hdf5Lock:
+                    DataFrame(output, index = galIndices, 
+                              columns = inputs.columns).to_hdf(outName, "w")
+                if nSnap == 1:
+                    mags = DataFrame(output, index = galIndices, columns = inputs.columns)
+        # Save where the output of each rank is
+        if galaxyOutput and comm is not None and mpiOutput == 'split':
+            index = mpi_output_index(comm, outName, nGal)
+            if rank == 0:
+                with g_hdf5Lock:
+                    index.to_hdf(get_output_name(prefix + "_index", ".hdf5", snap, outPath), 
+                                 "w")
+        statsList.append(inputs.get_stats())
+
+    # Results of this call are only published when it finishes, so that
+    # concurrent calls never see each other's partial results
+    callStats = concat(statsList)
+    if results is not None:
+        results['stats'] = callStats
+        results['histograms'] = callHistograms
+        results['errorBounds'] = callErrorBounds
+    g_stats, g_histograms, g_errorBounds = callStats, callHistograms, callErrorBounds
+
+    if nSnap == 1:
+        return mags
 
-        int nAgeList
-        double *ageList
-        
-        double z
 
-        int nRest = 0
-        int nObs = 0
-        int nFlux = 0
-        double *logWaves= NULL
-        double *filters = NULL
-        int cOutType = 0
+def prune_star_formation_history(fname, sfhPath, snap, h, Om0, sedPath, tolerance,
+                                 IGM = 'I2014', outType = 'ph',
+                                 restBands = [[1600, 100],], obsBands = [], obsFrame = False,
+                                 betaWeights = None, prefix = 'sfh_pruned', outPath = './', 
+                                 cachePath = None, nThread = 1):
+    """
+    Store a pruned copy of a star formation history file.
 
-        int nR = 3
+    Progenitors are merged and dropped in the same way as ``tolerance`` 
+    of ``composite_spectra``, and the result is saved to 
+    'prefix_XXX.bin', which can be used as ``gals`` of 
+    ``composite_spectra``. Pruning depends on the filters, so the pruned
+    file should only be used with the same SED templates, ``outType`` and
+    bands. The bounds are derived for fluxes without dust, so the pruned
+    file should not be used with ``dustParams``, whose errors are not 
+    bounded.
 
-        double *absorption = NULL
+    Parameters
+    ----------
+    sfhPath: str or tuple
+        Star formation history file saved by 
+        ``save_star_formation_history`` at snapshot ``snap``, or a tuple
+        of ``(path, start, number)`` to prune part of it.
+    Other parameters have the same meaning as those of 
+    ``composite_spectra``.
 
-        dust_params *dustArgs = NULL
+    Returns
+    -------
+    bounds: pandas.DataFrame
+        Upper bounds of the change in magnitudes of each flux of each 
+        galaxy.
+    """
+    cdef:
+        snapshot_inputs inputs
+        int *indices
+    cosmo = FlatLambdaCDM(H0 = 100.*h, Om0 = Om0)
+    inputs = load_snapshot(fname, snap, 1, h, cosmo, sedPath, get_wavelength(sedPath), 
+                           IGM, outType, restBands, obsBands, obsFrame, betaWeights, 
+                           cachePath)
+    trace_snapshot(inputs, sfhPath, nThread = nThread)
+    bounds = DataFrame(inputs.prune(tolerance, 0, nThread), index = inputs.galIndices,
+                       columns = inputs.flux_columns())
+    indices = init_1d_int(np.asarray(inputs.galIndices, dtype = 'i4'))
+    outName = get_output_name(prefix, ".bin", snap, outPath)
+    save_gal_props(outName.encode(), inputs.galProps, indices)
+    free(indices)
+    warn("Warning: \"%s\" is pruned for fluxes without dust, and should not be "
+         "used with dustParams"%outName)
+    return bounds
 
-        float *cOutput 
-        float[:] mvOutput
 
-    for i in xrange(nSnap):
-        snap = snapList[i]
-        # Read star formation rates and metallcities form galaxy merger trees
-        if type(gals[0]) is str:
-            galIndices = read_galaxy_indices(gals[i])
-            nGal = len(galIndices)
-            galProps = read_properties_by_file(gals[i])
-        else:
-            galIndices = gals[i]
-            nGal = len(galIndices)
-            indices = init_1d_int(np.asarray(galIndices, dtype = 'i4'))
-            # <<<<< Old Metallicity tracer
-            galProps = read_properties_by_progenitors(g_firstProgenitor, g_nextProgenitor, 
-                                                      g_metals, g_sfr, snap, indices, nGal)
-            # >>>>> New metallicity tracer
-            #galProps = read_properties_by_progenitors(g_firstProgenitor, g_nextProgenitor, 
-            #                                          g_metals, g_sfr, g_dTime,
-            #                                          snap, indices, nGal)
-            # <<<<<
-            free(indices)
-
-        # Read look back time
-        nAgeList = snap - snapMin + 1
-        ageList= init_1d_double(get_age_list(fname, snap, nAgeList, h))
-        # Read redshift
-        z = meraxes.io.grab_redshift(fname, snap)
-        # Convert the format of dust parameters 
-        if dustParams is not None:
-            dustArgs = dust_parameters(dustParams[i])
-        # Compute the transmission of the IGM
-        if IGM == 'I2014':
-            absorption = init_1d_double(Lyman_absorption_Inoue((1. + z)*waves, z))
-        # Generate Filters
-        minWIdx = None
-        maxWIdx = None
-        if outType == 'ph':
-            filters = init_1d_double(read_filters(waves, restBands, obsBands, z))
-            nRest = len(restBands)
-            nObs = len(obsBands)
-            nFlux = nRest + nObs
-            cOutType = 0
-        elif outType == 'sp':
-            nFlux = nWaves
-            if obsFrame:
-                nObs = nWaves
-            cOutType = 1
-        elif outType == 'UV slope':
-            centreWaves, betaFilters, minWIdx, maxWIdx = beta_filters(waves)
-            logWaves = init_1d_double(np.log(centreWaves))
-            filters = init_1d_double(betaFilters)
-            nRest = len(centreWaves)
-            nFlux = nRest
-            cOutType = 2
-        else:
-            raise KeyError("outType can only be 'ph', 'sp' and 'UV Slope'")
-        # Read raw SED templates
-        rawSpectra = read_sed_templates(sedPath, ageList[nAgeList - 1], minWIdx, maxWIdx)
-        # Compute spectra
-        cOutput = composite_spectra_cext(rawSpectra,
-                                         galProps, nGal, z, ageList, nAgeList,
-                                         filters, logWaves, nFlux, nObs,
-                                         absorption, dustArgs,
-                                         cOutType, nThread)
-        # Save the output to a numpy array
-        if outType == 'UV slope':
-            mvOutput = <float[:nGal*(nFlux + nR)]>cOutput
-            output = np.hstack([np.asarray(mvOutput[nGal*nFlux:], 
-                                           dtype = 'f4').reshape(nGal, -1),
-                                np.asarray(mvOutput[:nGal*nFlux], 
-                                           dtype = 'f4').reshape(nGal, -1)])
-        else:
-            mvOutput = <float[:nGal*nFlux]>cOutput
-            output = np.asarray(mvOutput, dtype = 'f4').reshape(nGal, -1)
-        # Convert apparent magnitudes to absolute magnitudes
-        if outType == 'ph' and nObs > 0:
-            output[:, nRest:] += cosmo.distmod(z).value
-        # Convert to observed frame fluxes       
-        if outType == 'sp' and obsFrame:
-            factor = 10./cosmo.luminosity_distance(z).to(u.parsec).value
-            output *= factor*factor
-        # Set output column names
-        if outType == 'ph':
-            columns = []
-            for i in xrange(nRest):
-                columns.append("M%d-%d"%(restBands[i][0], restBands[i][1]))
-            for i in xrange(nObs):
-                columns.append(obsBands[i][0])
-        elif outType == 'sp':
-            columns = (1. + z)*waves if obsFrame else waves
-        elif outType == 'UV slope':
-            columns = np.append(["beta", "norm", "R"], centreWaves)
-            columns[-1] = "M1600-100"           
-        # Save the output to the disk
-        DataFrame(output, index = galIndices, columns = columns).\
-        to_hdf(get_output_name(prefix, ".hdf5", snap, outPath), "w")
-       
-        if len(snapList) == 1:
-            mags = DataFrame(deepcopy(output), index = galIndices, columns = columns)
-
-        free_gal_props(galProps, nGal)
-        free(ageList)
-        free(dustArgs)
-        free(absorption)
-        free(filters)
-        free(cOutput)
-        free(logWaves)
+# # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+#                                                                               #
+# Calibration session                                                           #
+#                                                                               #
+# # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+class CalibrationSession(object):
+    """
+    Resident inputs of ``composite_spectra`` for repeated evaluations 
+    with different dust parameters, e.g. in a MCMC calibration.
 
-    free_raw_spectra(rawSpectra)
-    if type(gals[0]) is not str:
-        free_meraxes(snapMin, snapMax)
+    Merger trees or star formation histories, SED templates, filters and
+    the IGM transmission are read once when the session is created. Each
+    call of ``evaluate`` only computes the dust dependent stages, and 
+    returns the output in the memory without writing any file.
 
-    if len(snapList) == 1:
-        return mags
+    Parameters
+    ----------
+    All parameters have the same meaning as those of ``composite_spectra``.
+    Only 'ph' and 'UV slope' are applicable to ``outType``.
+
+    Attributes
+    ----------
+    snapList: list
+        Snapshots in the same order as the input.
+    galIndices: list
+        Indices of galaxies at each snapshot.
+    columns: list
+        Names of output columns at each snapshot.
+    """
+    def __init__(self, fname, snapList, gals, h, Om0, sedPath,
+                 IGM = 'I2014', outType = 'ph',
+                 restBands = [[1600, 100],], obsBands = [], betaWeights = None,
+                 cachePath = None, precision = 'double', selective = False,
+                 nThread = 1):
+        cdef:
+            int i
+            int snapMin = 1
+            int snapMax
+            snapshot_inputs inputs
+            snapshot_inputs prevInputs = None
+
+        if precision not in ('double', 'single'):
+            raise KeyError("precision can only be 'double' and 'single'")
+        if outType not in ('ph', 'UV slope'):
+            raise KeyError("outType can only be 'ph' and 'UV slope'")
+        cosmo = FlatLambdaCDM(H0 = 100.*h, Om0 = Om0)
+        self.isScalar = isscalar(snapList)
+        if self.isScalar:
+            snapList = [snapList]
+            gals = [gals]
+        self.snapList = list(snapList)
+        self.singlePrecision = 1 if precision == 'single' else 0
+        self.nThread = nThread
+
+        snapMax = max(snapList)
+        trees = None
+        if sfh_file_range(gals[0]) is None:
+            trees = read_meraxes(fname, snapMax, h, 
+                                 meraxes_selection(snapList, gals) if selective else None)
+            snapMin = trees.snapMin
+        waves = get_wavelength(sedPath)
+        self.inputs = [None]*len(snapList)
+        # Trace snapshots in ascending order to reuse histories
+        for i in sorted(xrange(len(snapList)), key = lambda iS: snapList[iS]):
+            inputs = load_snapshot(fname, snapList[i], snapMin, h, cosmo, sedPath, waves, 
+                                   IGM, outType, restBands, obsBands, False, 
+                                   betaWeights, cachePath)
+            if trees is None:
+                trace_snapshot(inputs, gals[i])
+            else:
+                trace_snapshot(inputs, np.asarray(gals[i]), trees, prevInputs, 
+                               nThread = nThread)
+                prevInputs = inputs
+            self.inputs[i] = inputs
+        self.galIndices = [inputs.galIndices for inputs in self.inputs]
+        self.columns = [inputs.columns for inputs in self.inputs]
+
+    def evaluate(self, dustParams = None):
+        """
+        Compute the output with the given dust parameters.
+
+        Parameters
+        ----------
+        dustParams: ndarray
+            Parameters for the dust model, i.e. tauUV_ISM, nISM, 
+            tauUV_BC, nBC, tBC. For each snapshot, it can have a shape of
+            ``(len(gals), 5)``, or ``(5,)`` such that all galaxies have 
+            the same parameters. If ``snapList`` is not a scalar, the
+            first dimension should be the snapshot. If None, no dust is
+            applied.
+
+        Returns
+        -------
+        output: ndarray
+            If ``snapList`` is a scalar, it returns a 2-D array with the 
+            same columns as ``composite_spectra``; otherwise, it returns a
+            list of such arrays. Rows are in the order of ``galIndices``.
+        """
+        if self.isScalar:
+            dustParams = [dustParams]
+        elif dustParams is None:
+            dustParams = [None]*len(self.inputs)
+        output = [self.inputs[i].compute(dustParams[i], self.singlePrecision, self.nThread)
+                  for i in xrange(len(self.inputs))]
+        return output[0] if self.isScalar else output
 
 
 # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
@@ -1135,36 +2425,65 @@ def composite_spectra(fname, snapList, gals, h, Om0, sedPath,
 # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
 
 from scipy.interpolate import interp1d
-from scipy.optimize import brentq
 
-DEF DUST_C = -2.33
-DEF DUST_M0 = -19.5
-DEF DUST_SIGMA = .34
-DEF DUST_BRIGHTER = -35.
-DEF DUST_FAINTER = 0.
-DEF DUST_BOUND = -5.
 
+cdef extern from "mag_calc_cext.h" nogil:
+    void dust_extinction_cext(double *M1600, double *noise, int nM, 
+                              double slope, double inter, double *A1600, short nThread)
+
+    void dust_table_range(double slope, double inter, double *refMin, double *refMax)
 
-cdef double beta_MUV(double obsMag, double slope, double inter):
-    if obsMag >= DUST_M0:
-        return (inter - DUST_C)*exp(slope*(obsMag - DUST_M0)/(inter - DUST_C)) \
-               + DUST_C
-    else:
-        return slope*(obsMag - DUST_M0) + inter
+    void dust_inversion_table(double slope, double inter, double refMin, double dRef, 
+                              int nRef, double *obsMag, short nThread)
+
+    void dust_extinction_table(double *obsMag, double refMin, double dRef, int nRef,
+                               double *M1600, double *noise, int nM, 
+                               double *A1600, short nThread)
 
 
-cdef dust_equation(double obsMag, double slope, double inter,
-                   double insMag, double noise):
-    return obsMag - insMag \
-           - (4.43 + 1.99*(beta_MUV(obsMag, slope, inter) + noise))
+# Inversion tables of the Meurer relation are cached by the slope and the
+# intercept of the beta-MUV relation and the step of the table
+DUST_TABLE_STEP = 1e-3
+DUST_CACHE_SIZE = 16 # Maximum number of tables kept in memory
+g_dustCache = OrderedDict()
 
+def cached_dust_table(double slope, double inter, double dRef, short nThread):
+    #=====================================================================
+    # Return the cached inversion table and its first point, or compute
+    # and cache it if it does not exist
+    #=====================================================================
+    cdef:
+        double refMin, refMax
+        int nRef
+        double[::1] mvTable
 
-def dust_extinction(M1600, double z, double scatter):
+    key = (slope, inter, dRef)
+    if key in g_dustCache:
+        table = g_dustCache.pop(key)
+    else:
+        dust_table_range(slope, inter, &refMin, &refMax)
+        nRef = int((refMax - refMin)/dRef) + 1
+        mvTable = np.zeros(nRef)
+        with nogil:
+            dust_inversion_table(slope, inter, refMin, dRef, nRef, &mvTable[0], nThread)
+        table = (refMin, np.asarray(mvTable))
+    g_dustCache[key] = table
+    while len(g_dustCache) > DUST_CACHE_SIZE:
+        g_dustCache.popitem(last = False)
+    return table
+
+
+def dust_extinction(M1600, double z, double scatter, 
+                    seed = None, method = 'solve', nThread = 1):
     #=====================================================================
     # Calculate the dust extinction at rest frame 1600 angstrom
     #
     # M1600: rest frame 1600 angstrom magnitudes. It can be an array.
     # z: redshift
+    # scatter: standard deviation of the Gaussian scatter of beta
+    # seed: seed of the scatter. If None, numpy's global state is used.
+    # method: 'solve' finds the root of the Meurer relation for each 
+    #         galaxy; 'table' interpolates a cached inversion table
     #
     # Returns: dust extinction at rest frame 1600 angstrom
     #          M1600_obs = M1600 + A1600,
@@ -1172,49 +2491,46 @@ def dust_extinction(M1600, double z, double scatter):
     # Reference Mason et al. 2015, equation 4
     #           Bouwens 2014 et al. 2014, Table 3
     #=====================================================================
-
-    cdef:
-        int iM
-        int nM
-    if isscalar(M1600):
-        nM = 1
-        M1600 = np.array([M1600], dtpye = 'f8')
-    else:
-        nM = len(M1600)
-        M1600 = np.asarray(M1600, dtype = 'f8')
     cdef:
-        double insMag
-        double[:] mvM1600 = M1600
-        double[:] mvA1600 = np.zeros(nM)
-        double[:] mvScatter
+        double[::1] mvM1600 = np.ascontiguousarray(np.atleast_1d(M1600), dtype = 'f8')
+        int nM = mvM1600.shape[0]
+        double[::1] mvA1600 = np.zeros(nM)
+        double[::1] mvScatter
+        double *noise = NULL
         double slope = interp1d([2.5, 3.8, 5., 5.9, 7., 8.], 
                                 [-.2, -.11, -.14, -.2, -.2, -.15], 
                                 fill_value = 'extrapolate')(z)
         double inter = interp1d([2.5, 3.8, 5., 5.9, 7., 8.], 
                                 [-1.7, -1.85, -1.91, -2., -2.05, -2.13], 
                                 fill_value = 'extrapolate')(z)
+        double refMin
+        double dRef = DUST_TABLE_STEP
+        double[::1] mvTable
+        short cThread = nThread
 
+    if nM == 0:
+        return np.zeros(0)
     if scatter != 0.:
-        mvScatter = np.random.normal(0., scatter, nM)
-        for iM in xrange(nM):
-            insMag = mvM1600[iM]
-            if insMag < DUST_BOUND:
-                mvA1600[iM] = brentq(dust_equation, DUST_BRIGHTER, DUST_FAINTER, 
-                                     args = (slope, inter, mvM1600[iM], mvScatter[iM])) \
-                              - mvM1600[iM]
-            else:
-                mvA1600[iM] = 0.
+        if seed is None:
+            mvScatter = np.random.normal(0., scatter, nM)
+        else:
+            mvScatter = np.random.RandomState(seed).normal(0., scatter, nM)
+        noise = &mvScatter[0]
+    if method == 'solve':
+        with nogil:
+            dust_extinction_cext(&mvM1600[0], noise, nM, slope, inter, 
+                                 &mvA1600[0], cThread)
+    elif method == 'table':
+        refMin, table = cached_dust_table(slope, inter, dRef, cThread)
+        mvTable = table
+        with nogil:
+            dust_extinction_table(&mvTable[0], refMin, dRef, mvTable.shape[0],
+                                  &mvM1600[0], noise, nM, &mvA1600[0], cThread)
     else:
-        for iM in xrange(nM):
-            insMag = mvM1600[iM]
-            if insMag < DUST_BOUND:
-                mvA1600[iM] = brentq(dust_equation, DUST_BRIGHTER, DUST_FAINTER,
-                                     args = (slope, inter, mvM1600[iM], scatter)) \
-                              - mvM1600[iM]
-            else:
-                mvA1600[iM] = 0.
+        raise KeyError("method can only be 'solve' and 'table'")
     A1600 = np.asarray(mvA1600)
-    A1600[A1600 < 0.] = 0.
+    if isnan(A1600).any():
+        raise ValueError("The Meurer relation has no solution for some galaxies")
     return A1600
 
 
@@ -1239,7 +2555,7 @@ def reddening_curve(lam):
         return max(0., -.57136*lam + 1.62620)
 
 
-def reddening(waves, M1600, z, scatter = 0.):
+def reddening(waves, M1600, z, scatter = 0., seed = None, method = 'solve', nThread = 1):
     """
     Compute the dust extinction at given wavelengths.
     
@@ -1254,6 +2570,15 @@ def reddening(waves, M1600, z, scatter = 0.):
     scatter: float
         Add a Gaussian scatter to the Meurer relation. If 0, no
         scatter is applied.
+    seed: int
+        Seed of the scatter, so that the result is reproducible. If None,
+        the global random state of numpy is used.
+    method: str
+        If 'solve', the Meurer relation is solved for each galaxy. If
+        'table', it is inverted by interpolating a table, which is cached
+        for each redshift. The two methods agree within about 1e-8 mag.
+    nThread: int
+        Number of threads used by the OpenMp.
 
     Returns
     -------
@@ -1261,7 +2586,7 @@ def reddening(waves, M1600, z, scatter = 0.):
         Dust extinction at given wavelengths, which is additive to AB
         magnitudes. It has a dimension of ``(len(M1600), len(waves))``.
     """
-    A1600 = dust_extinction(M1600, z, scatter)
+    A1600 = dust_extinction(M1600, z, scatter, seed, method, nThread)
     if isscalar(waves):
         return reddening_curve(waves)/reddening_curve(1600.)*A1600
     else: